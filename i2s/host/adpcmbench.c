@@ -0,0 +1,230 @@
+/* IMA-ADPCM encoder benchmark
+
+   Encodes sample audio with ima_adpcm and reports how fast it went, in
+   frames per second, as a multiple of real time and as the share of one
+   host core that real time takes. Then decodes it again, with a decoder
+   written straight from the IMA recommendation, and reports the signal to
+   noise ratio of the round trip. The audio is the PCM in the WAV files
+   given (24-bit audio is cut to 16 bits first), or else the synthetic
+   piece from bench_audio.c.
+
+   -m sets the lowest SNR that passes, e.g. for "make adpcmcheck"; -o
+   writes the first piece as an IMA-ADPCM WAV file, for other decoders.
+
+   Usage: adpcmbench [-r rate] [-s seconds] [-B block_bytes] [-m min_db] [-o out.wav] [file.wav...]
+*/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench_audio.h"
+#include "ima_adpcm.h"
+
+#define CHANNELS    BENCH_CHANNELS
+
+static double now_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const int16_t step_table[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37,
+    41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173,
+    190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658,
+    724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484,
+    7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500,
+    20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int index_table[16] = { -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8 };
+
+// Decode one block of block_bytes into frames interleaved frames at pcm
+static void decode_block(const uint8_t *in, uint32_t block_bytes, int16_t *pcm, uint32_t frames) {
+    int32_t pred[CHANNELS];
+    int index[CHANNELS];
+    const uint8_t *p = in + 4 * CHANNELS;
+
+    for (int c = 0; c < CHANNELS; c++) {
+        pred[c] = (int16_t)(in[4 * c] | (in[4 * c + 1] << 8));
+        index[c] = in[4 * c + 2];
+        pcm[c] = pred[c];
+    }
+    for (uint32_t base = 1; p < in + block_bytes; base += 8) {
+        for (int c = 0; c < CHANNELS; c++) {
+            for (int k = 0; k < 8; k++) {
+                int code = (p[k / 2] >> (4 * (k & 1))) & 15;
+                int step = step_table[index[c]];
+                int32_t diff = step >> 3;
+
+                if (code & 4) {
+                    diff += step;
+                }
+                if (code & 2) {
+                    diff += step >> 1;
+                }
+                if (code & 1) {
+                    diff += step >> 2;
+                }
+                pred[c] += (code & 8) ? -diff : diff;
+                pred[c] = pred[c] > 32767 ? 32767 : pred[c] < -32768 ? -32768 : pred[c];
+                index[c] += index_table[code];
+                index[c] = index[c] < 0 ? 0 : index[c] > 88 ? 88 : index[c];
+                if (base + k < frames) {
+                    pcm[(base + k) * CHANNELS + c] = pred[c];
+                }
+            }
+            p += 4;
+        }
+    }
+}
+
+static void put_le16(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+// An IMA-ADPCM WAV file of the encoded blocks, as the recorder writes them
+static void write_wav(FILE *f, const ima_adpcm_t *e, uint32_t rate, uint64_t frames,
+    const uint8_t *data, uint64_t data_bytes) {
+    uint8_t h[60];
+
+    memcpy(h, "RIFF", 4);
+    put_le32(h + 4, sizeof h - 8 + data_bytes);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_le32(h + 16, 20);
+    put_le16(h + 20, 0x11);
+    put_le16(h + 22, CHANNELS);
+    put_le32(h + 24, rate);
+    put_le32(h + 28, (uint64_t)rate * e->block_bytes / e->block_frames);
+    put_le16(h + 32, e->block_bytes);
+    put_le16(h + 34, 4);
+    put_le16(h + 36, 2);
+    put_le16(h + 38, e->block_frames);
+    memcpy(h + 40, "fact", 4);
+    put_le32(h + 44, 4);
+    put_le32(h + 48, frames);
+    memcpy(h + 52, "data", 4);
+    put_le32(h + 56, data_bytes);
+    fwrite(h, 1, sizeof h, f);
+    fwrite(data, 1, data_bytes, f);
+}
+
+static bool bench(const char *name, const pcm_t *pcm, uint32_t block_bytes, double min_db, FILE *out) {
+    ima_adpcm_t enc;
+    uint32_t block_frames = IMA_ADPCM_BLOCK_FRAMES(block_bytes, CHANNELS);
+    uint64_t blocks = (pcm->frames + block_frames - 1) / block_frames;
+    int16_t *in = malloc(blocks * block_frames * CHANNELS * sizeof(int16_t));
+    int16_t *dec = malloc(blocks * block_frames * CHANNELS * sizeof(int16_t));
+    uint8_t *coded = malloc(blocks * block_bytes);
+    double start, elapsed, signal = 0, noise = 0, snr;
+
+    if (in == NULL || dec == NULL || coded == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+
+    // Interleave and cut to 16 bits, padding the last block out with the
+    // last frame, as the recorder does
+    for (uint64_t i = 0; i < blocks * block_frames; i++) {
+        uint64_t from = i < pcm->frames ? i : pcm->frames - 1;
+        for (int c = 0; c < CHANNELS; c++) {
+            in[i * CHANNELS + c] = pcm->ch[c][from] >> (pcm->bits - 16);
+        }
+    }
+
+    ima_adpcm_init(&enc, CHANNELS, block_bytes);
+    start = now_s();
+    for (uint64_t b = 0; b < blocks; b++) {
+        ima_adpcm_block(&enc, in + b * block_frames * CHANNELS, coded + b * block_bytes);
+    }
+    elapsed = now_s() - start;
+
+    for (uint64_t b = 0; b < blocks; b++) {
+        decode_block(coded + b * block_bytes, block_bytes, dec + b * block_frames * CHANNELS, block_frames);
+    }
+    for (uint64_t i = 0; i < pcm->frames * CHANNELS; i++) {
+        double d = in[i] - dec[i];
+        signal += (double)in[i] * in[i];
+        noise += d * d;
+    }
+    snr = noise > 0 ? 10 * log10(signal / noise) : INFINITY;
+
+    printf("%-24s %6u %12.0f %9.1f %7.3f %8.3f %7.1f\n", name, pcm->rate,
+        pcm->frames / elapsed, pcm->frames / elapsed / pcm->rate,
+        100.0 * pcm->rate * elapsed / pcm->frames,
+        (double)blocks * block_bytes / (pcm->frames * CHANNELS * 2), snr);
+    if (out != NULL) {
+        write_wav(out, &enc, pcm->rate, pcm->frames, coded, blocks * block_bytes);
+    }
+    free(in);
+    free(dec);
+    free(coded);
+    if (snr < min_db) {
+        printf("%s: SNR %.1f dB is under %.1f dB\n", name, snr, min_db);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    pcm_t pcm = { .rate = 48000, .bits = 16 };
+    double seconds = 60;
+    double min_db = -INFINITY;
+    uint32_t block_bytes = 2048;
+    FILE *out = NULL;
+    int opt;
+    bool ok = true;
+
+    while ((opt = getopt(argc, argv, "r:s:B:m:o:")) != -1) {
+        switch (opt) {
+        case 'r':
+            pcm.rate = atoi(optarg);
+            break;
+        case 's':
+            seconds = atof(optarg);
+            break;
+        case 'B':
+            block_bytes = atoi(optarg);
+            break;
+        case 'm':
+            min_db = atof(optarg);
+            break;
+        case 'o':
+            out = fopen(optarg, "wb");
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r rate] [-s seconds] [-B block_bytes] [-m min_db]"
+                " [-o out.wav] [file.wav...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (block_bytes % (4 * CHANNELS) != 0 || block_bytes <= 4 * CHANNELS || block_bytes > 65535) {
+        fprintf(stderr, "Block size must be a multiple of %d, up to 65535\n", 4 * CHANNELS);
+        return 1;
+    }
+
+    printf("%-24s %6s %12s %9s %7s %8s %7s\n", "audio", "rate", "frames/s", "realtime",
+        "core%", "ratio", "SNR dB");
+    if (optind == argc) {
+        ok = synth_pcm(&pcm, seconds) && bench("synthetic", &pcm, block_bytes, min_db, out);
+    }
+    for (int i = optind; i < argc && ok; i++) {
+        // Only the first file goes to -o
+        ok = read_wav(argv[i], &pcm) && bench(argv[i], &pcm, block_bytes, min_db,
+            i == optind ? out : NULL);
+    }
+    if (out != NULL) {
+        fclose(out);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,133 @@
+/* Audio for the encoder benchmarks
+
+*/
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench_audio.h"
+
+static uint32_t get_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool alloc_pcm(pcm_t *pcm) {
+    for (int c = 0; c < BENCH_CHANNELS; c++) {
+        pcm->ch[c] = malloc(pcm->frames * sizeof(int32_t));
+        if (pcm->ch[c] == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Notes a quarter of a second apart, each a few harmonics decaying at
+// different rates, panned by pitch, on top of noise around -70 dBFS
+bool synth_pcm(pcm_t *pcm, double seconds) {
+    static const double notes[] = { 220.0, 277.2, 329.6, 440.0, 370.0, 293.7, 246.9, 196.0 };
+    const double note_s = 0.25;
+    const double full = (1 << (pcm->bits - 1)) - 1;
+    uint32_t seed = 1;
+
+    pcm->frames = (uint64_t)(seconds * pcm->rate);
+    if (!alloc_pcm(pcm)) {
+        return false;
+    }
+    for (uint64_t i = 0; i < pcm->frames; i++) {
+        double t = (double)i / pcm->rate;
+        double v[BENCH_CHANNELS] = { 0 };
+
+        // The last three notes are still ringing
+        for (int back = 0; back < 3; back++) {
+            long n = (long)(t / note_s) - back;
+            double age = t - n * note_s;
+            double f = notes[n & 7];
+            double pan = (double)(n & 7) / 7;
+            double s = 0;
+
+            if (n < 0) {
+                continue;
+            }
+            for (int h = 1; h <= 5; h++) {
+                s += sin(2 * M_PI * f * h * age) * exp(-age * (2 + 3 * h)) / h;
+            }
+            v[0] += 0.12 * s * (1 - pan);
+            v[1] += 0.12 * s * pan;
+        }
+        for (int c = 0; c < BENCH_CHANNELS; c++) {
+            seed = seed * 1664525 + 1013904223;
+            v[c] += ((int32_t)seed / 2147483648.0) * 0.0003;
+            pcm->ch[c][i] = (int32_t)lrint(v[c] * full);
+        }
+    }
+    return true;
+}
+
+// 16 or 24-bit stereo PCM from a WAV file
+bool read_wav(const char *path, pcm_t *pcm) {
+    uint8_t hdr[8];
+    uint8_t fmt[16];
+    bool have_fmt = false;
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL || fread(hdr, 1, 4, f) != 4 || memcmp(hdr, "RIFF", 4) != 0
+        || fseek(f, 12, SEEK_SET) != 0) {
+        fprintf(stderr, "%s: not a WAV file\n", path);
+        return false;
+    }
+    while (fread(hdr, 1, 8, f) == 8) {
+        uint32_t len = get_le32(hdr + 4);
+
+        if (memcmp(hdr, "fmt ", 4) == 0 && len >= 16) {
+            if (fread(fmt, 1, 16, f) != 16) {
+                break;
+            }
+            fseek(f, len - 16 + (len & 1), SEEK_CUR);
+            have_fmt = true;
+        } else if (memcmp(hdr, "data", 4) == 0 && have_fmt) {
+            unsigned channels = fmt[2] | (fmt[3] << 8);
+            unsigned bytes;
+            uint8_t *raw;
+
+            pcm->rate = get_le32(fmt + 4);
+            pcm->bits = fmt[14] | (fmt[15] << 8);
+            bytes = pcm->bits / 8;
+            if ((fmt[0] | (fmt[1] << 8)) != 1 || channels != BENCH_CHANNELS
+                || (pcm->bits != 16 && pcm->bits != 24)) {
+                fprintf(stderr, "%s: only 16 or 24-bit stereo PCM\n", path);
+                break;
+            }
+            pcm->frames = len / (BENCH_CHANNELS * bytes);
+            raw = malloc(len);
+            if (raw == NULL || !alloc_pcm(pcm) || fread(raw, 1, len, f) != len) {
+                fprintf(stderr, "%s: short file\n", path);
+                break;
+            }
+            for (uint64_t i = 0; i < pcm->frames; i++) {
+                for (int c = 0; c < BENCH_CHANNELS; c++) {
+                    const uint8_t *p = raw + (i * BENCH_CHANNELS + c) * bytes;
+                    pcm->ch[c][i] = bytes == 2 ? (int16_t)(p[0] | (p[1] << 8))
+                        : (int32_t)((p[0] << 8) | (p[1] << 16) | ((uint32_t)p[2] << 24)) >> 8;
+                }
+            }
+            free(raw);
+            fclose(f);
+            return true;
+        } else {
+            fseek(f, len + (len & 1), SEEK_CUR);
+        }
+    }
+    fprintf(stderr, "%s: no usable audio\n", path);
+    fclose(f);
+    return false;
+}
+
+void write_raw(FILE *f, const pcm_t *pcm) {
+    unsigned bytes = pcm->bits / 8;
+
+    for (uint64_t i = 0; i < pcm->frames; i++) {
+        for (int c = 0; c < BENCH_CHANNELS; c++) {
+            uint8_t b[3] = { pcm->ch[c][i], pcm->ch[c][i] >> 8, pcm->ch[c][i] >> 16 };
+            fwrite(b, 1, bytes, f);
+        }
+    }
+}
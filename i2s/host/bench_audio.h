@@ -0,0 +1,32 @@
+/* Audio for the encoder benchmarks
+
+   Stereo PCM held a channel at a time as 32-bit samples, either from a
+   WAV file or a synthetic piece: plucked notes with harmonics, panned
+   across the stereo field, over a low noise floor, which compresses about
+   as well as music does.
+*/
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define BENCH_CHANNELS  (2)
+
+typedef struct pcm {
+    uint32_t rate;
+    unsigned bits;
+    uint64_t frames;
+    int32_t *ch[BENCH_CHANNELS];
+} pcm_t;
+
+// seconds of the synthetic piece at pcm->rate and pcm->bits. Returns
+// false if it couldn't be allocated.
+bool synth_pcm(pcm_t *pcm, double seconds);
+
+// The audio in a 16 or 24-bit stereo PCM WAV file. Returns false, having
+// said why, if there is none.
+bool read_wav(const char *path, pcm_t *pcm);
+
+// Write pcm as interleaved little-endian samples of pcm->bits
+void write_raw(FILE *f, const pcm_t *pcm);
@@ -0,0 +1,426 @@
+/* Descriptor ring benchmark and tests
+
+   Without -t, passes record buffers round between two threads, as
+   i2s_task and sd_task do, through the descriptor rings, with a
+   notification to wake the other side when it finds its ring empty, and
+   through a pair of locked queues like the FreeRTOS ones the rings
+   replaced, each send and receive copying the message in or out under
+   the lock, with its 128-byte filename. It reports how many buffers each
+   way gets round a second and the time each round takes. On Linux, the
+   notification is a lock and a condition variable too, so the rings are
+   also timed with both sides polling them, yielding when there's nothing
+   there, which is nearer what they cost on their own.
+
+   With -t, checks the ring: that it holds exactly its size, and comes
+   back in order, including when its counts wrap, then that with one
+   thread pushing as fast as it can, and popping the oldest back off
+   whenever the ring is full, as i2s_task does to reclaim a buffer, while
+   another pops as fast as it can, every descriptor comes out exactly
+   once, whole, on one side or the other, and in order on each. Exits
+   non-zero if any check fails, e.g. for "make desccheck".
+
+   Usage: descbench [-t] [-n buffers]
+*/
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "desc_ring.h"
+
+#define RING_SLOTS      (16)        // RING_SIZE
+#define POOL            (8)         // CONFIG_RECORDER_NUM_CHUNKS
+#define RACE_DESCS      (4000000)
+
+static double now_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A descriptor whose every field says which one it is, so a copy torn
+// between two of them shows up
+static recbuf_desc_t desc(unsigned seq) {
+    return (recbuf_desc_t){
+        .position = (uint64_t)seq * 48000, .timestamp = (int64_t)seq * 1000000,
+        .frames = seq ^ 0x5a5a5a5a, .buf_index = seq & 0xff, .flags = seq >> 8 & 0xff,
+        .offset = ~seq, .bytes = seq * 2654435761u, .silence = seq + 1,
+    };
+}
+
+// Which descriptor d is, or UINT_MAX if it isn't whole
+static unsigned which(const recbuf_desc_t *d) {
+    unsigned seq = d->position / 48000;
+    recbuf_desc_t w = desc(seq);
+
+    return d->position == w.position && d->timestamp == w.timestamp && d->frames == w.frames
+        && d->buf_index == w.buf_index && d->flags == w.flags && d->offset == w.offset
+        && d->bytes == w.bytes && d->silence == w.silence ? seq : UINT_MAX;
+}
+
+// Fill the ring and empty it, again and again, starting from counts
+// just short of wrapping
+static const char *test_fill(void) {
+    static char text[128];
+    recbuf_desc_t slots[RING_SLOTS], d;
+    desc_ring_t ring;
+    unsigned seq = 0, next = 0;
+
+    desc_ring_init(&ring, slots, RING_SLOTS);
+    atomic_store(&ring.head, UINT_MAX - 3 * RING_SLOTS);
+    atomic_store(&ring.tail, UINT_MAX - 3 * RING_SLOTS);
+    for (int round = 0; round < 8; round++) {
+        for (unsigned i = 0; i < RING_SLOTS; i++) {
+            d = desc(seq++);
+            if (!desc_ring_push(&ring, &d)) {
+                snprintf(text, sizeof text, "round %d: full after %u", round, i);
+                return text;
+            }
+        }
+        d = desc(seq);
+        if (desc_ring_push(&ring, &d) || desc_ring_count(&ring) != RING_SLOTS) {
+            snprintf(text, sizeof text, "round %d: took more than %u", round, RING_SLOTS);
+            return text;
+        }
+        // Then empty it, in order
+        for (unsigned i = 0; i < RING_SLOTS; i++) {
+            if (!desc_ring_pop(&ring, &d) || which(&d) != next++) {
+                snprintf(text, sizeof text, "round %d: descriptor %u out of order", round, next - 1);
+                return text;
+            }
+        }
+        if (desc_ring_pop(&ring, &d)) {
+            snprintf(text, sizeof text, "round %d: popped from an empty ring", round);
+            return text;
+        }
+    }
+    return NULL;
+}
+
+typedef struct race {
+    desc_ring_t ring;
+    recbuf_desc_t slots[RING_SLOTS];
+    atomic_bool done;           // the producer has pushed everything
+    uint8_t *seen;              // times each descriptor came out, either side
+    unsigned reclaimed, delivered;
+    const char *problem;        // the producer's
+    const char *consumer_problem;
+} race_t;
+
+// Push every descriptor, popping the oldest to make room when the ring is
+// full, as i2s_task reclaims a buffer sd_task hasn't got to
+static void *producer(void *arg) {
+    race_t *race = arg;
+    unsigned last = UINT_MAX;
+
+    for (unsigned seq = 0; seq < RACE_DESCS; seq++) {
+        recbuf_desc_t d = desc(seq);
+
+        while (!desc_ring_push(&race->ring, &d)) {
+            recbuf_desc_t old;
+            if (desc_ring_pop(&race->ring, &old)) {
+                unsigned s = which(&old);
+                if (s == UINT_MAX || (last != UINT_MAX && s <= last)) {
+                    race->problem = s == UINT_MAX ? "reclaimed a torn descriptor"
+                        : "reclaimed out of order";
+                    atomic_store(&race->done, true);
+                    return NULL;
+                }
+                race->seen[s]++;
+                race->reclaimed++;
+                last = s;
+            }
+        }
+    }
+    atomic_store(&race->done, true);
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    race_t *race = arg;
+    unsigned last = UINT_MAX;
+
+    while (true) {
+        bool done = atomic_load(&race->done);
+        recbuf_desc_t d;
+
+        if (!desc_ring_pop(&race->ring, &d)) {
+            if (done) {
+                return NULL;
+            }
+            continue;
+        }
+        unsigned s = which(&d);
+        if (s == UINT_MAX || (last != UINT_MAX && s <= last)) {
+            race->consumer_problem = s == UINT_MAX ? "delivered a torn descriptor"
+                : "delivered out of order";
+            return NULL;
+        }
+        race->seen[s]++;
+        race->delivered++;
+        last = s;
+    }
+}
+
+static const char *test_race(void) {
+    static race_t race;
+    static char text[128];
+    pthread_t p, c;
+
+    memset(&race, 0, sizeof race);
+    desc_ring_init(&race.ring, race.slots, RING_SLOTS);
+    race.seen = calloc(RACE_DESCS, 1);
+    if (race.seen == NULL) {
+        return "out of memory";
+    }
+    pthread_create(&c, NULL, consumer, &race);
+    pthread_create(&p, NULL, producer, &race);
+    pthread_join(p, NULL);
+    pthread_join(c, NULL);
+    if (race.problem != NULL || race.consumer_problem != NULL) {
+        free(race.seen);
+        return race.problem != NULL ? race.problem : race.consumer_problem;
+    }
+    for (unsigned seq = 0; seq < RACE_DESCS; seq++) {
+        if (race.seen[seq] != 1) {
+            snprintf(text, sizeof text, "descriptor %u came out %u times", seq, race.seen[seq]);
+            free(race.seen);
+            return text;
+        }
+    }
+    free(race.seen);
+    // If the consumer always kept up, nothing was reclaimed, and the race
+    // between the two pops was never run
+    if (race.reclaimed == 0 || race.delivered == 0) {
+        snprintf(text, sizeof text, "%u delivered and %u reclaimed, one side never ran",
+            race.delivered, race.reclaimed);
+        return text;
+    }
+    return NULL;
+}
+
+static int run_tests(void) {
+    static const struct {
+        const char *name;
+        const char *(*fn)(void);
+    } tests[] = {
+        { "fill, empty and wrap", test_fill },
+        { "deliver or reclaim once", test_race },
+    };
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof tests / sizeof tests[0]; i++) {
+        const char *problem = tests[i].fn();
+        printf("%-28s %s%s\n", tests[i].name, problem ? "FAIL, " : "ok", problem ? problem : "");
+        failed += problem != NULL;
+    }
+    return failed;
+}
+
+// A thread's notification, like the host HAL's hal_task_notify()
+typedef struct notify {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned pending;
+} notify_t;
+
+static void notify(notify_t *n) {
+    pthread_mutex_lock(&n->lock);
+    n->pending++;
+    pthread_cond_signal(&n->cond);
+    pthread_mutex_unlock(&n->lock);
+}
+
+static void notify_wait(notify_t *n) {
+    pthread_mutex_lock(&n->lock);
+    while (n->pending == 0) {
+        pthread_cond_wait(&n->cond, &n->lock);
+    }
+    n->pending = 0;
+    pthread_mutex_unlock(&n->lock);
+}
+
+// The message the filled queue carried, and a FreeRTOS queue of them: a
+// copy in and a copy out, each under the queue's lock, and a wait on
+// either side for room or for a message
+typedef struct q_msg {
+    char filename[128];
+    int64_t timestamp;
+    uint8_t buf_index;
+    uint32_t len;
+} q_msg;
+
+typedef struct queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+    unsigned head, count, size, item;
+    uint8_t *items;
+} queue_t;
+
+static void queue_init(queue_t *q, unsigned size, unsigned item) {
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    q->head = q->count = 0;
+    q->size = size;
+    q->item = item;
+    q->items = malloc((size_t)size * item);
+}
+
+static void queue_send(queue_t *q, const void *item) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->size) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    memcpy(q->items + (size_t)(q->head + q->count) % q->size * q->item, item, q->item);
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void queue_receive(queue_t *q, void *item) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    memcpy(item, q->items + (size_t)q->head * q->item, q->item);
+    q->head = (q->head + 1) % q->size;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static struct {
+    unsigned buffers;
+    bool poll;          // poll the rings, rather than wait to be notified
+    // The rings, each with the notification of the thread that pops it
+    desc_ring_t filled, free;
+    recbuf_desc_t filled_slots[RING_SLOTS], free_slots[RING_SLOTS];
+    notify_t sd, i2s;
+    // The queues
+    queue_t queue, free_queue;
+} bench;
+
+static void *ring_sd(void *arg) {
+    for (unsigned n = 0; n < bench.buffers; n++) {
+        recbuf_desc_t d;
+
+        while (!desc_ring_pop(&bench.filled, &d)) {
+            if (bench.poll) {
+                sched_yield();
+            } else {
+                notify_wait(&bench.sd);
+            }
+        }
+        desc_ring_push(&bench.free, &d);
+        if (!bench.poll) {
+            notify(&bench.i2s);
+        }
+    }
+    return NULL;
+}
+
+static void *ring_i2s(void *arg) {
+    for (unsigned n = 0; n < bench.buffers; n++) {
+        recbuf_desc_t d;
+
+        while (!desc_ring_pop(&bench.free, &d)) {
+            if (bench.poll) {
+                sched_yield();
+            } else {
+                notify_wait(&bench.i2s);
+            }
+        }
+        d.position = (uint64_t)n * 48000;
+        d.timestamp = (int64_t)n * 1000000;
+        d.frames = 48000;
+        desc_ring_push(&bench.filled, &d);
+        if (!bench.poll) {
+            notify(&bench.sd);
+        }
+    }
+    return NULL;
+}
+
+static void *queue_sd(void *arg) {
+    for (unsigned n = 0; n < bench.buffers; n++) {
+        q_msg m;
+
+        queue_receive(&bench.queue, &m);
+        queue_send(&bench.free_queue, &m.buf_index);
+    }
+    return NULL;
+}
+
+static void *queue_i2s(void *arg) {
+    for (unsigned n = 0; n < bench.buffers; n++) {
+        q_msg m = { "/sdcard/20240101-0000.wav", (int64_t)n * 1000000, 0, 192000 };
+
+        queue_receive(&bench.free_queue, &m.buf_index);
+        queue_send(&bench.queue, &m);
+    }
+    return NULL;
+}
+
+static void run(const char *name, void *(*i2s)(void *), void *(*sd)(void *)) {
+    pthread_t a, b;
+    double start = now_s(), elapsed;
+
+    pthread_create(&b, NULL, sd, NULL);
+    pthread_create(&a, NULL, i2s, NULL);
+    pthread_join(a, NULL);
+    pthread_join(b, NULL);
+    elapsed = now_s() - start;
+    printf("%-28s %12.0f %10.0f\n", name, bench.buffers / elapsed, elapsed / bench.buffers * 1e9);
+}
+
+int main(int argc, char **argv) {
+    bool test = false;
+    int opt;
+
+    bench.buffers = 1000000;
+    while ((opt = getopt(argc, argv, "tn:")) != -1) {
+        switch (opt) {
+        case 't':
+            test = true;
+            break;
+        case 'n':
+            bench.buffers = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t] [-n buffers]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (test) {
+        return run_tests() != 0;
+    }
+
+    desc_ring_init(&bench.filled, bench.filled_slots, RING_SLOTS);
+    desc_ring_init(&bench.free, bench.free_slots, RING_SLOTS);
+    queue_init(&bench.queue, POOL, sizeof(q_msg));
+    queue_init(&bench.free_queue, POOL, sizeof(uint8_t));
+    pthread_mutex_init(&bench.sd.lock, NULL);
+    pthread_cond_init(&bench.sd.cond, NULL);
+    pthread_mutex_init(&bench.i2s.lock, NULL);
+    pthread_cond_init(&bench.i2s.cond, NULL);
+    for (uint8_t i = 0; i < POOL; i++) {
+        recbuf_desc_t d = { .buf_index = i };
+        desc_ring_push(&bench.free, &d);
+        queue_send(&bench.free_queue, &i);
+    }
+
+    printf("%-28s %12s %10s\n", "passing buffers", "buffers/s", "ns each");
+    run("descriptor rings", ring_i2s, ring_sd);
+    bench.poll = true;
+    run("  polled, not notified", ring_i2s, ring_sd);
+    run("queues", queue_i2s, queue_sd);
+    return 0;
+}
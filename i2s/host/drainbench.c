@@ -0,0 +1,135 @@
+/* Backlog drain benchmark
+
+   Runs the real recorder pipeline against the synthetic I2S source and a
+   card model in which every write() costs a fixed command overhead on top
+   of its bandwidth, and every fsync() a fixed time. After STALL_AT_S of
+   recording, one write stalls for the given number of seconds, so the
+   record buffers back up; the bench reports how much audio was waiting
+   when the stall ended, and how much longer it took sd_task to work it
+   off, down to the one buffer being captured. Times are in seconds of
+   audio: the clock scaled by the speed the bench runs at.
+
+   Built twice by the Makefile, batching writes (SD_BATCH_BYTES) and not,
+   at two record buffer sizes; "make drain" runs each over a set of stalls.
+
+   Usage: drainbench [-H] [-d seconds] [-b MB/s] [-c ms] [-f ms] [-x speed]
+     -H  print the table header and exit
+     -d  length of the stall (default 8)
+     -b  card write bandwidth (default 1.5 MB/s)
+     -c  overhead of each write (default 4 ms)
+     -f  cost of each fsync (default 20 ms)
+     -x  run at this multiple of real time (default 20)
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "recorder.h"
+#include "recorder_config.h"
+#include "recorder_hal.h"
+#include "recorder_hal_linux.h"
+
+#define STALL_AT_S  (10)    // seconds of recording before the stall
+
+static double speed = 20;
+static double bandwidth = 1.5e6;
+static double command_ms = 4;
+static double fsync_ms = 20;
+static double stall_s = 8;
+
+// Set by sd_task in the wrappers, read by main
+static volatile bool stalled;           // the stall has been and gone
+static volatile int64_t stall_end_us;   // hal_uptime_us() when it ended
+static volatile uint64_t backlog_frames;    // waiting when it ended
+static volatile uint32_t drain_writes;  // writes since
+
+ssize_t __real_write(int fd, const void *buf, size_t n);
+int __real_fsync(int fd);
+
+// Hold up the caller for ms of card time, scaled to the simulation
+static void card_delay(double ms) {
+    usleep((useconds_t)(ms * 1000 / speed));
+}
+
+// Audio captured but not yet written, dropped or lost
+static uint64_t backlog(void) {
+    return hal_linux_frames_read() - (sd_stats.frames_written + recbuf_stats.dropped_frames
+        + recbuf_stats.lost_frames);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t n) {
+    double ms = command_ms + n / bandwidth * 1000;
+
+    if (!stalled && hal_linux_frames_read() >= STALL_AT_S * SAMPLE_RATE) {
+        card_delay(stall_s * 1000);
+        stall_end_us = hal_uptime_us();
+        backlog_frames = backlog();
+        stalled = true;
+    } else if (stalled) {
+        drain_writes++;
+    }
+    card_delay(ms);
+    return __real_write(fd, buf, n);
+}
+
+int __wrap_fsync(int fd) {
+    card_delay(fsync_ms);
+    return __real_fsync(fd);
+}
+
+int main(int argc, char **argv) {
+    uint64_t frames;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "Hd:b:c:f:x:")) != -1) {
+        switch (opt) {
+        case 'H':
+            printf("%-8s %-6s %7s %10s %9s %9s %8s %8s\n",
+                "buf KB", "batch", "stall s", "backlog s", "drain s", "catch-up", "writes",
+                "dropped");
+            return 0;
+        case 'd':
+            stall_s = atof(optarg);
+            break;
+        case 'b':
+            bandwidth = atof(optarg) * 1e6;
+            break;
+        case 'c':
+            command_ms = atof(optarg);
+            break;
+        case 'f':
+            fsync_ms = atof(optarg);
+            break;
+        case 'x':
+            speed = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-H] [-d seconds] [-b MB/s] [-c ms] [-f ms] [-x speed]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+    // Long enough to drain anything a card with any headroom can
+    frames = (uint64_t)((STALL_AT_S + stall_s * 20 + 60) * SAMPLE_RATE);
+    hal_linux_source_config(frames, speed);
+
+    recorder_start();
+    while (!stalled || backlog() > RECBUF_FRAMES) {
+        if (sd_stats.frames_written + recbuf_stats.dropped_frames
+                + recbuf_stats.lost_frames >= frames) {
+            break;
+        }
+        usleep(1000);
+    }
+
+    printf("%-8d %-6s %7.0f %10.2f ", RECBUF_SIZE / 1000, SD_BATCH_BYTES > 0 ? "yes" : "no",
+        stall_s, (double)backlog_frames / SAMPLE_RATE);
+    if (stalled && backlog() <= RECBUF_FRAMES) {
+        double drain_s = (hal_uptime_us() - stall_end_us) * speed / 1e6;
+        printf("%9.2f %8.1fx %8u %8u\n", drain_s,
+            (drain_s + (double)backlog_frames / SAMPLE_RATE) / drain_s, drain_writes,
+            recbuf_stats.dropped_frames);
+    } else {
+        printf("%9s %9s %8u %8u\n", "-", "-", drain_writes, recbuf_stats.dropped_frames);
+    }
+    return 0;
+}
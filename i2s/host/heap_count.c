@@ -0,0 +1,78 @@
+/* Heap operation counter
+
+*/
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include "heap_count.h"
+
+#if defined(__SANITIZE_ADDRESS__)
+
+bool heap_count(uint64_t *ops) {
+    *ops = 0;
+    return false;
+}
+
+#else
+
+// glibc's own, which it exports for just this
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+
+static atomic_uint_fast64_t heap_ops;
+
+static void counted(void) {
+    atomic_fetch_add_explicit(&heap_ops, 1, memory_order_relaxed);
+}
+
+void *malloc(size_t size) {
+    counted();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    counted();
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    counted();
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    counted();
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    void *p = memalign(alignment, size);
+
+    if (p == NULL) {
+        return ENOMEM;
+    }
+    *ptr = p;
+    return 0;
+}
+
+// free(NULL) does nothing, so isn't counted
+void free(void *ptr) {
+    if (ptr != NULL) {
+        counted();
+    }
+    __libc_free(ptr);
+}
+
+bool heap_count(uint64_t *ops) {
+    *ops = atomic_load_explicit(&heap_ops, memory_order_relaxed);
+    return true;
+}
+
+#endif
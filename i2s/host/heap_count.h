@@ -0,0 +1,16 @@
+/* Heap operation counter
+
+   Counts every malloc(), calloc(), realloc(), memalign() and free() the
+   program makes, from any thread, by standing in for glibc's and passing
+   each call on to glibc's own. recorder_host links it in to show that the
+   recorder leaves the heap alone once it's running. Under AddressSanitizer,
+   which has its own, it counts nothing.
+*/
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Sets ops to the heap operations so far. Returns false if they aren't
+// being counted.
+bool heap_count(uint64_t *ops);
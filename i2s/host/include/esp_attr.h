@@ -0,0 +1,5 @@
+/* Host stand-in for ESP-IDF's esp_attr.h */
+#pragma once
+
+// Everything is in the one kind of memory here
+#define EXT_RAM_ATTR
@@ -0,0 +1,25 @@
+/* Host stand-in for ESP-IDF's esp_log.h
+
+   Warnings and errors go to stderr. Info and debug messages are compiled
+   in but only printed when built with -DHOST_LOG_INFO, as the recorder
+   logs every buffer and would swamp a faster-than-real-time run.
+*/
+#pragma once
+
+#include <stdio.h>
+
+#ifdef HOST_LOG_INFO
+#define HOST_LOG_INFO_ENABLED 1
+#else
+#define HOST_LOG_INFO_ENABLED 0
+#endif
+
+#define HOST_LOG(letter, tag, format, ...) \
+    fprintf(stderr, letter " (%s) " format "\n", tag, ##__VA_ARGS__)
+
+#define ESP_LOGE(tag, format, ...) HOST_LOG("E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) HOST_LOG("W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) \
+    do { if (HOST_LOG_INFO_ENABLED) HOST_LOG("I", tag, format, ##__VA_ARGS__); } while (0)
+#define ESP_LOGD(tag, format, ...) \
+    do { if (HOST_LOG_INFO_ENABLED) HOST_LOG("D", tag, format, ##__VA_ARGS__); } while (0)
@@ -0,0 +1,21 @@
+/* Host stand-in for the generated sdkconfig.h, mirroring ../sdkconfig */
+#pragma once
+
+#ifndef CONFIG_RECORDER_CHUNK_SIZE
+#define CONFIG_RECORDER_CHUNK_SIZE 192000
+#endif
+#ifndef CONFIG_RECORDER_NUM_CHUNKS
+#define CONFIG_RECORDER_NUM_CHUNKS 12
+#endif
+#ifndef CONFIG_RECORDER_HIMEM_CHUNKS
+#define CONFIG_RECORDER_HIMEM_CHUNKS 21
+#endif
+#ifndef CONFIG_RECORDER_STAGE_SIZE
+#define CONFIG_RECORDER_STAGE_SIZE 65536
+#endif
+#ifndef CONFIG_RECORDER_NAME
+#define CONFIG_RECORDER_NAME "i2s_recorder"
+#endif
+#ifndef CONFIG_SPIRAM_BANKSWITCH_RESERVE
+#define CONFIG_SPIRAM_BANKSWITCH_RESERVE 12
+#endif
@@ -0,0 +1,260 @@
+/* Level gate benchmark and tests
+
+   Without -t, measures the level of sample audio in 10 ms blocks, the way
+   the gate does, and reports how fast that went, in frames per second,
+   as a multiple of real time and as the share of one host core that real
+   time takes, and the share of blocks that peak over -42 dBFS. The audio
+   is the PCM in the WAV files given, or else the synthetic piece from
+   bench_audio.c.
+
+   With -t, runs synthetic bursts through the gate, fed to it in pieces of
+   several sizes, and checks where it opens and closes. Exits non-zero if
+   any check fails, e.g. for "make levelcheck".
+
+   Usage: levelbench [-t] [-b bits] [-r rate] [-s seconds] [file.wav...]
+*/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench_audio.h"
+#include "level_gate.h"
+
+#define CHANNELS    BENCH_CHANNELS
+#define RATE        (48000)
+#define BLOCK       (RATE / 100)
+#define HANGOVER    (RATE / 2)
+#define MAX_SPANS   (16)
+
+static double now_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Interleaved samples of pcm, in the layout of a record buffer
+static uint8_t *interleave(const pcm_t *pcm) {
+    unsigned bytes = pcm->bits / 8;
+    uint8_t *out = malloc(pcm->frames * CHANNELS * bytes);
+
+    for (uint64_t i = 0; out != NULL && i < pcm->frames; i++) {
+        for (int c = 0; c < CHANNELS; c++) {
+            int32_t v = pcm->ch[c][i];
+            memcpy(out + (i * CHANNELS + c) * bytes, &v, bytes);
+        }
+    }
+    return out;
+}
+
+static bool bench(const char *name, const pcm_t *pcm) {
+    uint32_t block = pcm->rate / 100;
+    uint8_t *data = interleave(pcm);
+    size_t frame_bytes = CHANNELS * pcm->bits / 8;
+    uint64_t loud = 0;
+    double start, elapsed;
+
+    if (data == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+    start = now_s();
+    for (uint64_t i = 0; i < pcm->frames; i += block) {
+        uint32_t n = pcm->frames - i < block ? pcm->frames - i : block;
+        level_t lv;
+
+        if (pcm->bits == 16) {
+            level_measure_s16((const int16_t *)(data + i * frame_bytes), n * CHANNELS, &lv);
+        } else {
+            level_measure_s24(data + i * frame_bytes, n * CHANNELS, &lv);
+        }
+        loud += lv.peak > (1u << (pcm->bits - 8));
+    }
+    elapsed = now_s() - start;
+
+    printf("%-24s %6u %4u %12.0f %9.1f %7.3f %6.1f%%\n", name, pcm->rate, pcm->bits,
+        pcm->frames / elapsed, pcm->frames / elapsed / pcm->rate,
+        100.0 * pcm->rate * elapsed / pcm->frames,
+        100.0 * loud * block / pcm->frames);
+    free(data);
+    return true;
+}
+
+// A test signal: a noise floor, with bursts on top
+typedef struct burst {
+    double start_s, length_s;
+    double dbfs;                // level of the burst's sine
+    bool click;                 // a single sample at that level instead
+} burst_t;
+
+static int16_t *make_signal(uint32_t frames, double floor_dbfs, const burst_t *bursts, int n) {
+    int16_t *pcm = malloc(frames * CHANNELS * sizeof(int16_t));
+    uint32_t seed = 1;
+
+    for (uint32_t i = 0; pcm != NULL && i < frames; i++) {
+        double v = 0;
+
+        seed = seed * 1664525 + 1013904223;
+        v = ((int32_t)seed / 2147483648.0) * pow(10, floor_dbfs / 20);
+        for (int b = 0; b < n; b++) {
+            uint32_t from = bursts[b].start_s * RATE;
+            uint32_t to = from + bursts[b].length_s * RATE;
+
+            if (bursts[b].click && i == from) {
+                v = pow(10, bursts[b].dbfs / 20);
+            } else if (!bursts[b].click && i >= from && i < to) {
+                v += pow(10, bursts[b].dbfs / 20) * sin(2 * M_PI * 440 * i / RATE);
+            }
+        }
+        for (int c = 0; c < CHANNELS; c++) {
+            pcm[i * CHANNELS + c] = (int16_t)lrint(v * 32767);
+        }
+    }
+    return pcm;
+}
+
+// Run pcm through a gate in pieces of chunk frames, as the recorder would
+// with record buffers, joining up spans that carry on from one piece to
+// the next. Returns the number of spans, each [start, end) in frames.
+static int run_gate(const int16_t *pcm, uint32_t frames, uint32_t chunk, bool rms,
+    uint32_t spans[][2]) {
+    level_gate_t g;
+    int n = 0;
+
+    level_gate_init(&g, CHANNELS, 16, BLOCK, rms, -40, HANGOVER);
+    for (uint32_t pos = 0; pos < frames; ) {
+        uint32_t len = frames - pos < chunk ? frames - pos : chunk;
+        level_span_t span;
+
+        level_gate_run(&g, pos, pcm + pos * CHANNELS, len, &span);
+        if (span.opened && n < MAX_SPANS) {
+            spans[n][0] = pos + span.start;
+            spans[n++][1] = frames;
+        }
+        if (span.closed && n > 0) {
+            spans[n - 1][1] = pos + span.end;
+        }
+        // A span closing partway through leaves the rest of the piece
+        pos += span.closed ? span.end : len;
+    }
+    return n;
+}
+
+typedef struct gate_test {
+    const char *name;
+    burst_t bursts[3];
+    int num_bursts;
+    bool rms;
+    int expect;                 // spans
+    double open_s[2], close_s[2];
+} gate_test_t;
+
+// Bursts over a -70 dBFS floor, with the gate at -40 dBFS and a half
+// second hangover. A -20 dBFS click opens a peak gate, but is well under
+// the threshold as RMS over a block.
+static const gate_test_t tests[] = {
+    { "quiet throughout", { { 1.0, 0.5, -50 } }, 1, false, 0 },
+    { "one burst", { { 1.0, 0.5, -20 } }, 1, false, 1, { 1.0 }, { 2.0 } },
+    { "one burst, RMS", { { 1.0, 0.5, -20 } }, 1, true, 1, { 1.0 }, { 2.0 } },
+    { "just over the threshold", { { 1.0, 0.5, -39 } }, 1, false, 1, { 1.0 }, { 2.0 } },
+    { "just under the threshold", { { 1.0, 0.5, -41 } }, 1, false, 0 },
+    { "bursts within the hangover", { { 1.0, 0.3, -20 }, { 1.6, 0.3, -20 } }, 2, false,
+        1, { 1.0 }, { 2.4 } },
+    { "bursts apart", { { 1.0, 0.3, -20 }, { 2.5, 0.3, -20 } }, 2, false,
+        2, { 1.0, 2.5 }, { 1.8, 3.3 } },
+    { "a click", { { 1.0, 0, -20, true } }, 1, false, 1, { 1.0 }, { 1.5 } },
+    { "a click, RMS", { { 1.0, 0, -20, true } }, 1, true, 0 },
+    { "still going at the end", { { 3.5, 1.0, -20 } }, 1, false, 1, { 3.5 }, { 4.0 } },
+};
+
+static int run_tests(void) {
+    static const uint32_t chunks[] = { RATE, 4096, 777, BLOCK };
+    const uint32_t frames = 4 * RATE;
+    int failed = 0;
+
+    for (size_t t = 0; t < sizeof tests / sizeof tests[0]; t++) {
+        const gate_test_t *test = &tests[t];
+        int16_t *pcm = make_signal(frames, -70, test->bursts, test->num_bursts);
+        const char *problem = NULL;
+        static char text[128];
+
+        if (pcm == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        for (size_t c = 0; c < sizeof chunks / sizeof chunks[0] && problem == NULL; c++) {
+            uint32_t spans[MAX_SPANS][2];
+            int n = run_gate(pcm, frames, chunks[c], test->rms, spans);
+
+            if (n != test->expect) {
+                snprintf(text, sizeof text, "%d spans, not %d, in pieces of %u",
+                    n, test->expect, chunks[c]);
+                problem = text;
+                break;
+            }
+            for (int s = 0; s < n; s++) {
+                // Blocks are counted from the start of each piece, so where
+                // a burst begins and ends within a block depends on the
+                // piece size: allow for up to a block either way
+                int64_t open = (int64_t)(test->open_s[s] * RATE);
+                int64_t close = (int64_t)(test->close_s[s] * RATE);
+                close = close > frames ? frames : close;
+                if (llabs((int64_t)spans[s][0] - open) > BLOCK
+                    || llabs((int64_t)spans[s][1] - close) > BLOCK) {
+                    snprintf(text, sizeof text,
+                        "span %d is %u-%u, not %lld-%lld, in pieces of %u", s + 1,
+                        spans[s][0], spans[s][1], (long long)open, (long long)close, chunks[c]);
+                    problem = text;
+                    break;
+                }
+            }
+        }
+        printf("%-28s %s%s\n", test->name, problem ? "FAIL, " : "ok", problem ? problem : "");
+        failed += problem != NULL;
+        free(pcm);
+    }
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    pcm_t pcm = { .rate = 48000, .bits = 16 };
+    double seconds = 60;
+    bool test = false;
+    int opt;
+    bool ok = true;
+
+    while ((opt = getopt(argc, argv, "tb:r:s:")) != -1) {
+        switch (opt) {
+        case 't':
+            test = true;
+            break;
+        case 'b':
+            pcm.bits = atoi(optarg);
+            break;
+        case 'r':
+            pcm.rate = atoi(optarg);
+            break;
+        case 's':
+            seconds = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t] [-b bits] [-r rate] [-s seconds] [file.wav...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (test) {
+        return run_tests();
+    }
+
+    printf("%-24s %6s %4s %12s %9s %7s %7s\n", "audio", "rate", "bits", "frames/s", "realtime",
+        "core%", "loud");
+    if (optind == argc) {
+        ok = synth_pcm(&pcm, seconds) && bench("synthetic", &pcm);
+    }
+    for (int i = optind; i < argc && ok; i++) {
+        ok = read_wav(argv[i], &pcm) && bench(argv[i], &pcm);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,211 @@
+/* I2S recorder, Linux host build
+
+   Runs the recorder pipeline against a synthetic I2S source, writing WAV
+   (PCM, or IMA-ADPCM with SD_ADPCM) or with SD_FLAC, FLAC files to
+   MOUNT_POINT, or with SD_RAW, the raw log to a card image, and reports how fast the writer kept up, and how many heap
+   operations the program made before and after the first file (or log
+   segment) was closed.
+   By then, the recorder and the C library have set up everything they
+   will, so the count after it should be 0.
+
+   Usage: recorder_host [-l] [-s seconds] [-x speed] [-o reads] [-g reads] [-b on:off]
+                        [-t seconds,...] [-i image] [-m MB] [-e start] [-k ppm]
+     -l  print the SD latency histograms at the end
+     -s  seconds of audio to record (default 600)
+     -x  pace the source at this multiple of real time (default 0, unpaced)
+     -o  simulate a DMA overflow every this many reads
+     -g  simulate a short read every this many reads
+     -b  make the source bursts of on seconds of sine and off of silence
+     -t  call recorder_trigger() this many seconds into the audio (SD_TRIGGER),
+         in order, each at least TRIGGER_POST_MS before the end
+     -i  card image to record to (SD_RAW, default sdcard.img)
+     -m  size to make the card image if it isn't there (default 1024 MB)
+     -e  start the clock this many seconds after the epoch (default now)
+     -k  run the clock this many parts per million fast against the audio
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "recorder.h"
+#include "recorder_config.h"
+#include "recorder_hal_linux.h"
+#include "heap_count.h"
+
+#define MAX_TRIGGERS    (16)
+
+static double now_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    double seconds = 600;
+    double speed = 0;
+    int latency = 0;
+    uint32_t overflow_every = 0, short_every = 0;
+    double burst_on = 0, burst_off = 0;
+    const char *image = "sdcard.img";
+    uint64_t image_mb = 1024;
+    double clock_start = 0, clock_ppm = 0;
+    double trigger_s[MAX_TRIGGERS];
+    int num_triggers = 0, fired = 0;
+    uint64_t frames;
+    uint64_t heap_start = 0, heap_end;
+    bool heap_started = false, heap_counted;
+    double start, elapsed, rate_mb, realtime_mb, busy_s;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ls:x:o:g:b:t:i:m:e:k:")) != -1) {
+        switch (opt) {
+        case 'l':
+            latency = 1;
+            break;
+        case 's':
+            seconds = atof(optarg);
+            break;
+        case 'x':
+            speed = atof(optarg);
+            break;
+        case 'o':
+            overflow_every = atoi(optarg);
+            break;
+        case 'g':
+            short_every = atoi(optarg);
+            break;
+        case 'b':
+            if (sscanf(optarg, "%lf:%lf", &burst_on, &burst_off) != 2) {
+                fprintf(stderr, "-b takes on:off seconds\n");
+                return 1;
+            }
+            break;
+        case 't':
+            for (char *t = strtok(optarg, ","); t != NULL && num_triggers < MAX_TRIGGERS;
+                    t = strtok(NULL, ",")) {
+                trigger_s[num_triggers++] = atof(t);
+            }
+            break;
+        case 'i':
+            image = optarg;
+            break;
+        case 'm':
+            image_mb = atoll(optarg);
+            break;
+        case 'e':
+            clock_start = atof(optarg);
+            break;
+        case 'k':
+            clock_ppm = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-l] [-s seconds] [-x speed] [-o reads] [-g reads] [-b on:off]"
+                " [-t seconds,...] [-i image] [-m MB] [-e start] [-k ppm]\n", argv[0]);
+            return 1;
+        }
+    }
+    frames = (uint64_t)(seconds * SAMPLE_RATE);
+    hal_linux_source_config(frames, speed);
+    hal_linux_fault_config(overflow_every, short_every);
+    hal_linux_burst_config(burst_on * SAMPLE_RATE, burst_off * SAMPLE_RATE);
+    hal_linux_raw_config(image, image_mb << 20);
+    hal_linux_clock_config((int64_t)(clock_start * 1e6), clock_ppm);
+
+    start = now_s();
+    recorder_start();
+
+    // Every frame is eventually either written, dropped, lost or gated.
+    // With SD_TRIGGER, most are none of those: the run is over once the
+    // source has stopped and the last snapshot is written.
+    while (SD_TRIGGER
+            ? hal_linux_frames_read() < frames || fired < num_triggers || recorder_trigger_busy()
+            : sd_stats.frames_written + recbuf_stats.dropped_frames
+                + recbuf_stats.lost_frames + sd_stats.frames_gated < frames) {
+        while (fired < num_triggers
+                && hal_linux_frames_read() >= trigger_s[fired] * SAMPLE_RATE
+                && recorder_trigger()) {
+            fired++;
+        }
+        if (!heap_started && sd_stats.files_closed + sd_stats.log_segments > 0) {
+            heap_count(&heap_start);
+            heap_started = true;
+        }
+        usleep(1000);
+    }
+    elapsed = now_s() - start;
+    // Before anything is printed, as stdout's buffer comes from the heap
+    heap_counted = heap_count(&heap_end);
+    if (!heap_started) {
+        heap_start = heap_end;
+    }
+
+    rate_mb = sd_stats.bytes_written / elapsed / 1e6;
+    realtime_mb = (double)SAMPLE_RATE * FRAME_BYTES / 1e6;
+    printf("recorded     %.0f s of audio in %.3f s (%.1fx real time)\n",
+        seconds, elapsed, seconds / elapsed);
+    if (SD_TRIGGER) {
+        printf("ring         %d x %d bytes, %.1f s\n", TRIGGER_RING_SLOTS, RECBUF_SIZE,
+            (double)TRIGGER_RING_SLOTS * RECBUF_FRAMES / SAMPLE_RATE);
+    } else {
+        printf("buffers      %d x %d bytes, %d of them in himem, %.1f s\n", NUM_RECBUFS,
+            RECBUF_SIZE, HIMEM_RECBUFS, (double)NUM_RECBUFS * RECBUF_FRAMES / SAMPLE_RATE);
+    }
+    printf("written      %llu bytes in %u complete files, %.2f MB/s\n",
+        (unsigned long long)sd_stats.bytes_written, sd_stats.files_closed, rate_mb);
+    if (speed == 0) {
+        // The writer never waited for the source, so this is its ceiling.
+        // (An unpaced source outruns any writer, so drops are expected.)
+        printf("headroom     %.1fx the %.3f MB/s real-time requirement\n",
+            rate_mb / realtime_mb, realtime_mb);
+    } else {
+        printf("kept up      %s at %.1fx real time\n",
+            recbuf_stats.dropped_frames == 0 ? "yes" : "no", speed);
+    }
+    // Time sd_task spent in the filesystem, whatever the pacing
+    busy_s = 0;
+    for (int op = 0; op < SD_OP_COUNT; op++) {
+        busy_s += sd_latency[op].total_us / 1e6;
+    }
+    printf("busy         %.3f s %s, %.2f MB/s while busy, %s\n",
+        busy_s, SD_RAW ? "on the card" : "in the filesystem", sd_stats.bytes_written / busy_s / 1e6,
+        SD_RAW ? "raw log" : SD_FLAC ? "FLAC" : SD_ADPCM ? "IMA-ADPCM" : SD_RF64 ? "RF64 enabled"
+        : "RIFF only");
+    if (SD_FLAC || SD_ADPCM) {
+        printf("compressed   to %.3f of the PCM size\n",
+            sd_stats.bytes_written / ((double)sd_stats.frames_written * FRAME_BYTES));
+    }
+    printf("dropped      %u frames, max outstanding buffers %u, %u taken from himem\n",
+        recbuf_stats.dropped_frames, recbuf_stats.max_outstanding, recbuf_stats.banked_taken);
+    printf("lost         %u frames in the driver, %u short reads\n",
+        recbuf_stats.lost_frames, recbuf_stats.short_reads);
+    printf("gaps         %u, %llu frames\n",
+        sd_stats.gaps, (unsigned long long)sd_stats.gap_frames);
+    if (SD_RAW) {
+        printf("log          %u segments of up to %u KB\n", sd_stats.log_segments,
+            RAW_SEGMENT_BYTES / 1024);
+    }
+    if (!SD_FLAC && !SD_LEVEL_TRIGGER && !SD_TRIGGER) {
+        printf("batched      %u writes of %u buffers, once behind\n",
+            sd_stats.batches, sd_stats.batched);
+    }
+    if (heap_counted) {
+        printf("heap         %llu operations starting up, %llu after the first file\n",
+            (unsigned long long)heap_start, (unsigned long long)(heap_end - heap_start));
+    }
+    if (SD_LEVEL_TRIGGER) {
+        printf("gated        %u segments, %llu frames (%.1f%%) left out\n",
+            sd_stats.segments, (unsigned long long)sd_stats.frames_gated,
+            100.0 * sd_stats.frames_gated / frames);
+    }
+    if (SD_TRIGGER) {
+        printf("triggered    %u times, %u snapshots, %u overruns\n",
+            sd_stats.triggers, sd_stats.snapshots, sd_stats.snapshot_overruns);
+    }
+    if (latency) {
+        printf("\n");
+        recorder_dump_latency(stdout);
+    }
+    return 0;
+}
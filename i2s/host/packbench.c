@@ -0,0 +1,180 @@
+/* 24-bit packing benchmark and tests
+
+   Without -t, packs a second's worth of 32-bit I2S slots at a time into
+   24-bit PCM, with pcm_pack_s32_to_s24() into aligned and unaligned
+   memory and with a plain byte-at-a-time loop, and reports how fast each
+   went, in frames per second, as a multiple of real time at the given
+   rate and as the share of one host core that real time takes.
+
+   With -t, checks pcm_pack_s32_to_s24() against the byte-at-a-time loop
+   for every length up to a few groups of samples at every alignment of
+   dst, and a stream packed in pieces of odd sizes, as i2s_capture() does
+   when a read comes up short. Exits non-zero if any check fails, e.g. for
+   "make packcheck".
+
+   Usage: packbench [-t] [-r rate] [-s seconds]
+*/
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "pcm_pack.h"
+
+#define CHANNELS    (2)
+#define GUARD       (8)     // bytes either side of the output that mustn't change
+
+static double now_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The reference: each sample's upper three bytes, a byte at a time
+static void pack_ref(uint8_t *dst, const int32_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint32_t v = src[i];
+        dst[3 * i] = v >> 8;
+        dst[3 * i + 1] = v >> 16;
+        dst[3 * i + 2] = v >> 24;
+    }
+}
+
+static void fill(int32_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        src[i] = (int32_t)((uint32_t)rand() << 16 ^ (uint32_t)rand());
+    }
+}
+
+// Every length up to max at every alignment, with the bytes around the
+// output left alone
+static const char *test_lengths(void) {
+    static char problem[96];
+    enum { MAX = 40 };
+    int32_t src[MAX];
+    uint8_t got[GUARD + 3 * MAX + 4 + GUARD], want[sizeof got];
+
+    for (unsigned align = 0; align < 4; align++) {
+        for (size_t n = 0; n <= MAX; n++) {
+            fill(src, n);
+            memset(got, 0xa5, sizeof got);
+            memset(want, 0xa5, sizeof want);
+            pcm_pack_s32_to_s24(got + GUARD + align, src, n);
+            pack_ref(want + GUARD + align, src, n);
+            if (memcmp(got, want, sizeof got) != 0) {
+                snprintf(problem, sizeof problem, "%zu samples at offset %u differ", n, align);
+                return problem;
+            }
+        }
+    }
+    return NULL;
+}
+
+// A stream packed in pieces of odd sizes, one after the other
+static const char *test_pieces(void) {
+    static char problem[96];
+    enum { SAMPLES = 4096 };
+    static int32_t src[SAMPLES];
+    static uint8_t got[3 * SAMPLES], want[3 * SAMPLES];
+    static const size_t pieces[] = { 1, 2, 3, 5, 7, 9, 13, 250, 511, 1022 };
+
+    fill(src, SAMPLES);
+    pack_ref(want, src, SAMPLES);
+    for (size_t first = 0; first < sizeof pieces / sizeof pieces[0]; first++) {
+        size_t done = 0;
+        memset(got, 0, sizeof got);
+        for (size_t p = first; done < SAMPLES; p++) {
+            size_t n = pieces[p % (sizeof pieces / sizeof pieces[0])];
+            if (n > SAMPLES - done) {
+                n = SAMPLES - done;
+            }
+            pcm_pack_s32_to_s24(got + 3 * done, src + done, n);
+            done += n;
+        }
+        if (memcmp(got, want, sizeof got) != 0) {
+            snprintf(problem, sizeof problem, "pieces from %zu samples on differ", pieces[first]);
+            return problem;
+        }
+    }
+    return NULL;
+}
+
+static int run_tests(void) {
+    static const struct {
+        const char *name;
+        const char *(*fn)(void);
+    } tests[] = {
+        { "every length and alignment", test_lengths },
+        { "short reads", test_pieces },
+    };
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof tests / sizeof tests[0]; i++) {
+        const char *problem = tests[i].fn();
+        printf("%-28s %s%s\n", tests[i].name, problem ? "FAIL, " : "ok", problem ? problem : "");
+        failed += problem != NULL;
+    }
+    return failed;
+}
+
+static void bench(const char *name, void (*pack)(uint8_t *, const int32_t *, size_t),
+    unsigned align, const int32_t *src, uint8_t *dst, uint32_t rate, double seconds) {
+    size_t samples = (size_t)rate * CHANNELS;
+    uint64_t frames = 0;
+    double start = now_s(), elapsed;
+
+    do {
+        pack(dst + align, src, samples);
+        frames += rate;
+    } while (frames < seconds * rate);
+    elapsed = now_s() - start;
+    printf("%-28s %12.0f %9.1f %7.3f\n", name, frames / elapsed, frames / elapsed / rate,
+        100.0 * rate * elapsed / frames);
+}
+
+int main(int argc, char **argv) {
+    uint32_t rate = 48000;
+    double seconds = 600;
+    bool test = false;
+    int32_t *src;
+    uint8_t *dst;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "tr:s:")) != -1) {
+        switch (opt) {
+        case 't':
+            test = true;
+            break;
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        case 's':
+            seconds = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t] [-r rate] [-s seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (test) {
+        return run_tests() != 0;
+    }
+
+    // A second of slots, and room to pack them at any alignment
+    src = malloc((size_t)rate * CHANNELS * sizeof *src);
+    dst = malloc((size_t)rate * CHANNELS * 3 + 4);
+    if (src == NULL || dst == NULL || rate == 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    fill(src, (size_t)rate * CHANNELS);
+    printf("%-28s %12s %9s %7s\n", "packing", "frames/s", "realtime", "core%");
+    bench("pcm_pack_s32_to_s24()", pcm_pack_s32_to_s24, 0, src, dst, rate, seconds);
+    bench("  into unaligned memory", pcm_pack_s32_to_s24, 1, src, dst, rate, seconds);
+    bench("a byte at a time", pack_ref, 0, src, dst, rate, seconds);
+    free(src);
+    free(dst);
+    return 0;
+}
@@ -0,0 +1,327 @@
+/* Record buffer pool benchmark and tests
+
+   Without -t, runs an hour of recording through the pool, a buffer at a
+   time, as i2s_task and sd_task would, with the writer stalling now and
+   then, and counts the bank switches each way of handing out buffers
+   makes: mapped buffers first, as the recorder does, or round robin, as
+   a single free ring would. Between stalls the writer gets through rate
+   buffers in the time one is captured. Every buffer carries its number
+   through the banks, and is checked when it's written.
+
+   With -t, checks the pool: that it hands out mapped buffers first, that
+   each banked buffer keeps what was captured into it whichever window it
+   is mapped through, that a bank can only be in one window at a time,
+   and that a stalled hour loses nothing the pool had room for. Exits
+   non-zero if any check fails, e.g. for "make poolcheck".
+
+   Usage: poolbench [-t] [-m mapped] [-k banked] [-r rate]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "recbuf_pool.h"
+#include "recorder_config.h"
+
+#define HOUR        (3600)      // buffers, of a second each at 48 kHz 16-bit
+
+// Writer stalls of stall buffers' time, every period
+typedef struct trace {
+    const char *name;
+    unsigned stall, period;
+} trace_t;
+
+static const trace_t traces[] = {
+    { "no stalls", 0, HOUR },
+    { "2 s every minute", 2, 60 },
+    { "10 s every 5 minutes", 10, 300 },
+    { "20 s every 10 minutes", 20, 600 },
+    { "30 s once", 30, HOUR },
+};
+
+typedef struct run {
+    unsigned banked_taken;      // buffers handed out from the banks
+    unsigned maps;              // bank switches, both windows
+    unsigned dropped;           // buffers reclaimed unwritten
+    unsigned max_outstanding;
+    unsigned bad;               // buffers that didn't hold what was captured
+} run_t;
+
+// Mark the start and end of a buffer with its number, as capture would fill it
+static void stamp(uint8_t *buf, size_t bytes, uint32_t seq) {
+    memcpy(buf, &seq, sizeof seq);
+    memcpy(buf + bytes - sizeof seq, &seq, sizeof seq);
+}
+
+static bool stamped(const uint8_t *buf, size_t bytes, uint32_t seq) {
+    uint32_t a, b;
+
+    memcpy(&a, buf, sizeof a);
+    memcpy(&b, buf + bytes - sizeof b, sizeof b);
+    return a == seq && b == seq;
+}
+
+// Record buffers buffers through p, with the writer stalled as t says
+static run_t record(recbuf_pool_t *p, const trace_t *t, unsigned rate, unsigned buffers) {
+    static recbuf_desc_t filled_slots[RECBUF_POOL_MAX];
+    desc_ring_t filled;
+    run_t run = { 0 };
+
+    desc_ring_init(&filled, filled_slots, RECBUF_POOL_MAX);
+    for (uint32_t seq = 0; seq < buffers; seq++) {
+        recbuf_desc_t d;
+        uint8_t *buf;
+        unsigned outstanding;
+
+        // i2s_task: a buffer, mapped for as long as it takes to capture into
+        if (!recbuf_pool_get(p, &d)) {
+            desc_ring_pop(&filled, &d);
+            run.dropped++;
+        }
+        if (d.buf_index >= p->mapped) {
+            run.banked_taken++;
+        }
+        outstanding = p->count - recbuf_pool_free(p);
+        run.max_outstanding = outstanding > run.max_outstanding ? outstanding : run.max_outstanding;
+        if ((buf = recbuf_pool_map(p, RECBUF_WINDOW_CAPTURE, d.buf_index)) == NULL) {
+            run.bad++;
+            recbuf_pool_put(p, RECBUF_WINDOW_CAPTURE, &d);
+            continue;
+        }
+        stamp(buf, p->buf_bytes, seq);
+        recbuf_pool_unmap(p, RECBUF_WINDOW_CAPTURE);
+        d.position = seq;
+        desc_ring_push(&filled, &d);
+
+        // sd_task, unless it's stalled
+        if (seq % t->period >= t->stall) {
+            for (unsigned i = 0; i < rate && desc_ring_pop(&filled, &d); i++) {
+                buf = recbuf_pool_map(p, RECBUF_WINDOW_DRAIN, d.buf_index);
+                run.bad += buf == NULL || !stamped(buf, p->buf_bytes, d.position);
+                recbuf_pool_put(p, RECBUF_WINDOW_DRAIN, &d);
+            }
+        }
+    }
+
+    // Drain what's left, then hand everything back
+    for (recbuf_desc_t d; desc_ring_pop(&filled, &d); ) {
+        uint8_t *buf = recbuf_pool_map(p, RECBUF_WINDOW_DRAIN, d.buf_index);
+
+        run.bad += buf == NULL || !stamped(buf, p->buf_bytes, d.position);
+        recbuf_pool_put(p, RECBUF_WINDOW_DRAIN, &d);
+    }
+    run.maps = p->maps[RECBUF_WINDOW_CAPTURE] + p->maps[RECBUF_WINDOW_DRAIN];
+    return run;
+}
+
+// A pool of mapped + banked buffers, all free, handing them out by
+// policy. The HAL only reserves banks once, so it's the same buffers
+// every time.
+static bool pool_init(recbuf_pool_t *p, unsigned mapped, unsigned banked,
+    recbuf_pool_policy_t policy) {
+    static recbuf_pool_t first;
+    static uint8_t *mem;
+
+    if (mem == NULL && (mem = malloc((size_t)mapped * RECBUF_SIZE)) == NULL) {
+        return false;
+    }
+    if (first.count == 0
+        && recbuf_pool_init(&first, mem, mapped, banked, RECBUF_SIZE, policy) != mapped + banked) {
+        return false;
+    }
+    *p = first;
+    p->policy = policy;
+    for (int r = 0; r < 2; r++) {
+        desc_ring_init(&p->free[r], p->free_slots[r], RECBUF_POOL_MAX);
+    }
+    for (unsigned i = 0; i < p->count; i++) {
+        recbuf_pool_put(p, RECBUF_WINDOW_CAPTURE, &(recbuf_desc_t){ .buf_index = i });
+    }
+    return true;
+}
+
+static const char *test_mapped_first(recbuf_pool_t *p) {
+    static char text[128];
+    bool taken[RECBUF_POOL_MAX] = { false };
+    recbuf_desc_t d;
+
+    for (unsigned i = 0; i < p->count; i++) {
+        if (!recbuf_pool_get(p, &d)) {
+            snprintf(text, sizeof text, "only %u of %u buffers could be taken", i, p->count);
+            return text;
+        }
+        if (taken[d.buf_index] || (i < p->mapped) != (d.buf_index < p->mapped)) {
+            snprintf(text, sizeof text, "buffer %u was handed out %s", d.buf_index,
+                taken[d.buf_index] ? "twice" : "out of turn");
+            return text;
+        }
+        taken[d.buf_index] = true;
+    }
+    if (recbuf_pool_get(p, &d) || recbuf_pool_free(p) != 0) {
+        return "more buffers than the pool holds";
+    }
+    for (unsigned i = 0; i < p->count; i++) {
+        recbuf_pool_put(p, RECBUF_WINDOW_DRAIN, &(recbuf_desc_t){ .buf_index = i });
+    }
+    return recbuf_pool_free(p) == p->count ? NULL : "buffers handed back went missing";
+}
+
+// Fill each banked buffer through one window, then read them all back,
+// the other way round, through the other
+static const char *test_banks(recbuf_pool_t *p) {
+    static char text[128];
+
+    for (unsigned i = p->mapped; i < p->count; i++) {
+        uint32_t *w = recbuf_pool_map(p, RECBUF_WINDOW_CAPTURE, i);
+
+        if (w == NULL) {
+            return "a banked buffer couldn't be mapped";
+        }
+        for (size_t j = 0; j < p->buf_bytes / 4; j++) {
+            w[j] = i * 2654435761u + j;
+        }
+        recbuf_pool_unmap(p, RECBUF_WINDOW_CAPTURE);
+    }
+    for (unsigned i = p->count; i-- > p->mapped; ) {
+        uint32_t *w = recbuf_pool_map(p, RECBUF_WINDOW_DRAIN, i);
+        unsigned maps = p->maps[RECBUF_WINDOW_DRAIN];
+
+        for (size_t j = 0; w != NULL && j < p->buf_bytes / 4; j++) {
+            if (w[j] != i * 2654435761u + j) {
+                snprintf(text, sizeof text, "buffer %u held something else at byte %zu", i, j * 4);
+                return text;
+            }
+        }
+        if (recbuf_pool_map(p, RECBUF_WINDOW_DRAIN, i) != w || p->maps[RECBUF_WINDOW_DRAIN] != maps) {
+            return "mapping a buffer already in the window switched banks";
+        }
+    }
+    recbuf_pool_unmap(p, RECBUF_WINDOW_DRAIN);
+    return NULL;
+}
+
+static const char *test_one_window(recbuf_pool_t *p) {
+    unsigned i = p->mapped;
+
+    if (recbuf_pool_map(p, RECBUF_WINDOW_CAPTURE, i) == NULL) {
+        return "a banked buffer couldn't be mapped";
+    }
+    if (recbuf_pool_map(p, RECBUF_WINDOW_DRAIN, i) != NULL) {
+        return "a buffer was mapped into two windows at once";
+    }
+    recbuf_pool_put(p, RECBUF_WINDOW_CAPTURE, &(recbuf_desc_t){ .buf_index = i });
+    if (p->window_buf[RECBUF_WINDOW_CAPTURE] != -1
+        || recbuf_pool_map(p, RECBUF_WINDOW_DRAIN, i) == NULL) {
+        return "handing a buffer back didn't take it out of the window";
+    }
+    recbuf_pool_unmap(p, RECBUF_WINDOW_DRAIN);
+    return NULL;
+}
+
+static int run_tests(unsigned mapped, unsigned banked, unsigned rate) {
+    recbuf_pool_t p;
+    const char *problem;
+    int failed = 0;
+
+    if (banked == 0 || !pool_init(&p, mapped, banked, RECBUF_POOL_MAPPED_FIRST)) {
+        fprintf(stderr, "Can't set up a pool of %u + %u buffers\n", mapped, banked);
+        return 1;
+    }
+    problem = test_mapped_first(&p);
+    printf("%-32s %s%s\n", "mapped buffers first", problem ? "FAIL, " : "ok", problem ? problem : "");
+    failed += problem != NULL;
+
+    problem = test_banks(&p);
+    printf("%-32s %s%s\n", "banks keep their audio", problem ? "FAIL, " : "ok", problem ? problem : "");
+    failed += problem != NULL;
+
+    problem = test_one_window(&p);
+    printf("%-32s %s%s\n", "one window at a time", problem ? "FAIL, " : "ok", problem ? problem : "");
+    failed += problem != NULL;
+
+    // The longest stall the pool can ride out, and one it can't, each
+    // in an hour. Either way, every banked buffer is taken once.
+    for (int longer = 0; longer < 2; longer++) {
+        const trace_t t = { "", mapped + banked - 1 + longer * 5, HOUR };
+        run_t run;
+        static char name[32], text[128];
+
+        pool_init(&p, mapped, banked, RECBUF_POOL_MAPPED_FIRST);
+        run = record(&p, &t, rate, HOUR);
+        problem = NULL;
+        if (run.bad > 0) {
+            snprintf(text, sizeof text, "%u buffers didn't hold what was captured", run.bad);
+            problem = text;
+        } else if ((run.dropped > 0) != longer) {
+            snprintf(text, sizeof text, "%u buffers dropped", run.dropped);
+            problem = text;
+        } else if (run.banked_taken != banked) {
+            snprintf(text, sizeof text, "%u buffers taken from the banks, not %u",
+                run.banked_taken, banked);
+            problem = text;
+        }
+        snprintf(name, sizeof name, "a %u s stall", t.stall);
+        printf("%-32s %s%s\n", name, problem ? "FAIL, " : "ok", problem ? problem : "");
+        failed += problem != NULL;
+    }
+    return failed ? 1 : 0;
+}
+
+static int bench(unsigned mapped, unsigned banked, unsigned rate) {
+    static const char *const policies[] = { "mapped first", "round robin" };
+
+    printf("%u mapped + %u banked buffers of %d bytes, writer at %ux real time\n",
+        mapped, banked, RECBUF_SIZE, rate);
+    printf("%-24s %-14s %8s %8s %8s %8s %5s\n", "an hour with", "policy", "banked", "switches",
+        "per min", "dropped", "max");
+    for (size_t t = 0; t < sizeof traces / sizeof traces[0]; t++) {
+        for (int policy = 0; policy < 2; policy++) {
+            recbuf_pool_t p;
+            run_t run;
+
+            if (!pool_init(&p, mapped, banked, policy)) {
+                fprintf(stderr, "Can't set up a pool of %u + %u buffers\n", mapped, banked);
+                return 1;
+            }
+            run = record(&p, &traces[t], rate, HOUR);
+            printf("%-24s %-14s %8u %8u %8.1f %8u %5u%s\n", policy == 0 ? traces[t].name : "",
+                policies[policy], run.banked_taken, run.maps, run.maps / 60.0, run.dropped,
+                run.max_outstanding, run.bad ? "  audio lost!" : "");
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned mapped = MAPPED_RECBUFS;
+    unsigned banked = HIMEM_RECBUFS;
+    unsigned rate = 8;          // a 1.5 MB/s card, at 48 kHz 16-bit
+    bool test = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "tm:k:r:")) != -1) {
+        switch (opt) {
+        case 't':
+            test = true;
+            break;
+        case 'm':
+            mapped = atoi(optarg);
+            break;
+        case 'k':
+            banked = atoi(optarg);
+            break;
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t] [-m mapped] [-k banked] [-r rate]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (mapped + banked > RECBUF_POOL_MAX || rate < 2) {
+        fprintf(stderr, "At most %d buffers, and a writer at least twice real time\n",
+            RECBUF_POOL_MAX);
+        return 1;
+    }
+    return test ? run_tests(mapped, banked, rate) : bench(mapped, banked, rate);
+}
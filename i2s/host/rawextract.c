@@ -0,0 +1,365 @@
+/* Raw log extractor
+
+   Turns the log SD_RAW records (../main/raw_log.h) back into WAV files,
+   from an image of the card, of its raw partition alone, or the card
+   itself. Every slot's header is read, the good ones taken in the order
+   they were written, and each one's audio checked against its CRC.
+   Segments that follow on go into the same file; a gap of up to -g
+   frames is filled with silence and marked with a cue point, as the
+   recorder does, and anything else (a longer gap, a damaged segment, a
+   new take or a reset) starts a new file. The oldest segment left, in the
+   slot the recorder was writing when it stopped, is usually partly
+   overwritten; that's reported, but not as damage. Files are Broadcast
+   WAV, named for the time of their first frame, to the second, in UTC,
+   and start a new file short of 4 GB.
+
+   Usage: rawextract [-l] [-q] [-g frames] [-d dir] image
+     -l  list the segments rather than extract them
+     -q  only print problems, and the totals
+     -g  longest gap to fill with silence (default a tenth of a second)
+     -d  directory to put the files in (default .)
+   Exits non-zero if there is no log, or a file can't be written.
+*/
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "raw_log.h"
+
+#define MAX_CUES        (64)
+#define WAV_HDR_BYTES   (12 + 8 + 602 + 8 + 16 + 8)
+#define CUE_BYTES       (12 + 24 * MAX_CUES)
+
+typedef struct slot_hdr {
+    uint32_t slot;
+    raw_seg_t h;
+} slot_hdr_t;
+
+// The file being written
+static struct {
+    FILE *f;
+    char name[512];
+    uint32_t boot, take;
+    uint64_t end;               // position after its last frame
+    int64_t timestamp_us;       // of its first frame
+    uint64_t frames;
+    uint32_t cues[MAX_CUES];    // frames into the file the filled gaps start
+    uint32_t num_cues;
+} out;
+
+static raw_super_t super;
+static uint32_t frame_bytes;
+static const char *dir = ".";
+static bool quiet;
+static unsigned files, failures;
+
+static void put_le16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static double now_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int by_seq(const void *a, const void *b) {
+    uint32_t x = ((const slot_hdr_t *)a)->h.seq, y = ((const slot_hdr_t *)b)->h.seq;
+
+    return x < y ? -1 : x > y;
+}
+
+// The WAV header for the file being written, as it stands
+static void wav_header(uint8_t *hdr, uint32_t trailer_bytes) {
+    uint64_t data_bytes = out.frames * frame_bytes;
+    time_t t = out.timestamp_us / 1000000;
+    uint64_t since_midnight = (uint64_t)(out.timestamp_us % 86400000000LL) * super.sample_rate
+        / 1000000;
+    struct tm tm;
+    uint8_t *p = hdr;
+
+    memset(hdr, 0, WAV_HDR_BYTES);
+    gmtime_r(&t, &tm);
+    memcpy(p, "RIFF", 4);
+    put_le32(p + 4, WAV_HDR_BYTES - 8 + data_bytes + trailer_bytes);
+    memcpy(p + 8, "WAVE", 4);
+    p += 12;
+
+    memcpy(p, "bext", 4);
+    put_le32(p + 4, 602);
+    snprintf((char *)p + 8, 256, "I2S recorder raw log, boot %u take %u", out.boot, out.take);
+    snprintf((char *)p + 8 + 256, 32, "rawextract");
+    strftime((char *)p + 8 + 320, 11, "%Y-%m-%d", &tm);
+    strftime((char *)p + 8 + 330, 9, "%H:%M:%S", &tm);
+    put_le32(p + 8 + 338, since_midnight);
+    put_le32(p + 8 + 342, since_midnight >> 32);
+    put_le16(p + 8 + 346, 1);
+    p += 8 + 602;
+
+    memcpy(p, "fmt ", 4);
+    put_le32(p + 4, 16);
+    put_le16(p + 8, 1);
+    put_le16(p + 10, super.channels);
+    put_le32(p + 12, super.sample_rate);
+    put_le32(p + 16, super.sample_rate * frame_bytes);
+    put_le16(p + 20, frame_bytes);
+    put_le16(p + 22, super.bits);
+    p += 24;
+
+    memcpy(p, "data", 4);
+    put_le32(p + 4, data_bytes);
+}
+
+// Finish the file being written, if there is one: its cue chunk, then
+// its header, now the sizes are known
+static void out_close(void) {
+    uint8_t hdr[WAV_HDR_BYTES];
+    uint8_t cue[CUE_BYTES];
+    uint32_t cue_bytes = out.num_cues > 0 ? 12 + 24 * out.num_cues : 0;
+
+    if (out.f == NULL) {
+        return;
+    }
+    if (cue_bytes > 0) {
+        memset(cue, 0, sizeof cue);
+        memcpy(cue, "cue ", 4);
+        put_le32(cue + 4, cue_bytes - 8);
+        put_le32(cue + 8, out.num_cues);
+        for (uint32_t i = 0; i < out.num_cues; i++) {
+            uint8_t *c = cue + 12 + 24 * i;
+            put_le32(c, i + 1);
+            put_le32(c + 4, out.cues[i]);
+            memcpy(c + 8, "data", 4);
+            put_le32(c + 20, out.cues[i]);
+        }
+    }
+    wav_header(hdr, cue_bytes);
+    if (fwrite(cue, 1, cue_bytes, out.f) != cue_bytes || fseeko(out.f, 0, SEEK_SET) != 0
+        || fwrite(hdr, 1, sizeof hdr, out.f) != sizeof hdr || fclose(out.f) != 0) {
+        fprintf(stderr, "%s: failed to write\n", out.name);
+        failures++;
+    } else if (!quiet) {
+        printf("%s: %" PRIu64 " frames (%.1f s), boot %u take %u, %u gaps filled\n", out.name,
+            out.frames, (double)out.frames / super.sample_rate, out.boot, out.take, out.num_cues);
+    }
+    out.f = NULL;
+    files++;
+}
+
+// Start a file for h's audio, named for the time of its first frame
+static bool out_open(const raw_seg_t *h) {
+    static char last[512];
+    static unsigned same;
+    uint8_t hdr[WAV_HDR_BYTES] = { 0 };
+    time_t t = h->timestamp_us / 1000000;
+    char datetime[32];
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    strftime(datetime, sizeof datetime, "%Y%m%d-%H%M%S", &tm);
+    snprintf(out.name, sizeof out.name, "%s/%s.wav", dir, datetime);
+    // Takes can start within a second of each other
+    same = strcmp(out.name, last) == 0 ? same + 1 : 0;
+    strcpy(last, out.name);
+    if (same > 0) {
+        snprintf(out.name, sizeof out.name, "%s/%s-%u.wav", dir, datetime, same + 1);
+    }
+    out.f = fopen(out.name, "wb");
+    if (out.f == NULL || fwrite(hdr, 1, sizeof hdr, out.f) != sizeof hdr) {
+        perror(out.name);
+        failures++;
+        return false;
+    }
+    out.boot = h->boot;
+    out.take = h->take;
+    out.end = h->position;
+    out.timestamp_us = h->timestamp_us;
+    out.frames = 0;
+    out.num_cues = 0;
+    return true;
+}
+
+// Write frames of audio, or of silence if data is NULL
+static bool out_put(const uint8_t *data, uint64_t frames) {
+    static const uint8_t silence[4096];
+
+    if (data != NULL) {
+        if (fwrite(data, frame_bytes, frames, out.f) != frames) {
+            return false;
+        }
+    } else {
+        for (uint64_t left = frames * frame_bytes; left > 0; ) {
+            size_t n = left < sizeof silence ? left : sizeof silence;
+            if (fwrite(silence, 1, n, out.f) != n) {
+                return false;
+            }
+            left -= n;
+        }
+    }
+    out.frames += frames;
+    out.end += frames;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    uint64_t gap_max = 0, start = 0, sectors;
+    uint8_t sector[RAW_SECTOR_BYTES];
+    slot_hdr_t *segs;
+    uint32_t count = 0, damaged = 0, overwritten = 0, gaps = 0, head;
+    uint64_t bytes = 0;
+    bool list = false;
+    uint8_t *data;
+    double t0, elapsed;
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "lqg:d:")) != -1) {
+        switch (opt) {
+        case 'l':
+            list = true;
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case 'g':
+            gap_max = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-l] [-q] [-g frames] [-d dir] image\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-l] [-q] [-g frames] [-d dir] image\n", argv[0]);
+        return 1;
+    }
+    if ((fd = open(argv[optind], O_RDONLY)) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    t0 = now_s();
+
+    // A whole card has the log in its partition; an image of the partition
+    // starts with the superblock
+    if (pread(fd, sector, sizeof sector, 0) != sizeof sector) {
+        fprintf(stderr, "%s: can't read\n", argv[optind]);
+        return 1;
+    }
+    if (raw_partition(sector, &start, &sectors)
+        && pread(fd, sector, sizeof sector, start * RAW_SECTOR_BYTES) != sizeof sector) {
+        fprintf(stderr, "%s: can't read the partition\n", argv[optind]);
+        return 1;
+    }
+    memcpy(&super, sector, sizeof super);
+    if (!raw_super_check(&super)) {
+        fprintf(stderr, "%s: no raw log\n", argv[optind]);
+        return 1;
+    }
+    frame_bytes = super.channels * super.bits / 8;
+    if (gap_max == 0) {
+        gap_max = super.sample_rate / 10;
+    }
+    if (!quiet) {
+        printf("volume %08x: %u Hz %u-bit %u ch, %u slots of %u sectors\n", super.volume,
+            super.sample_rate, super.bits, super.channels, super.slots, super.segment_sectors);
+    }
+
+    segs = malloc((size_t)super.slots * sizeof *segs);
+    data = malloc((size_t)super.segment_sectors * RAW_SECTOR_BYTES);
+    if (segs == NULL || data == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (uint32_t s = 0; s < super.slots; s++) {
+        off_t at = (start + raw_seg_sector(&super, s)) * RAW_SECTOR_BYTES;
+        if (pread(fd, sector, sizeof sector, at) == sizeof sector) {
+            memcpy(&segs[count].h, sector, sizeof segs[count].h);
+            if (raw_seg_check(&segs[count].h, &super)) {
+                segs[count++].slot = s;
+            }
+        }
+    }
+    qsort(segs, count, sizeof *segs, by_seq);
+    // The slot after the newest segment is where the recorder was writing
+    // when it stopped: the audio there is partly the next segment's, which
+    // never got its header, under the older one's
+    head = count > 0 ? (segs[count - 1].slot + 1) % super.slots : 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        const raw_seg_t *h = &segs[i].h;
+        size_t len = (size_t)h->frames * frame_bytes;
+        off_t at = (start + raw_slot_sector(&super, segs[i].slot)) * RAW_SECTOR_BYTES;
+        bool ok = pread(fd, data, len, at) == (ssize_t)len
+            && raw_crc32(0, data, len) == h->data_crc;
+
+        if (list) {
+            printf("%10u slot %-8u boot %-4u take %-4u position %-12" PRIu64 " %8u frames%s\n",
+                h->seq, segs[i].slot, h->boot, h->take, h->position, h->frames,
+                ok ? "" : "  DAMAGED");
+        }
+        if (!ok && segs[i].slot == head) {
+            if (!quiet) {
+                printf("segment %u (slot %u) partly overwritten when recording stopped, "
+                    "left out\n", h->seq, segs[i].slot);
+            }
+            overwritten++;
+            out_close();
+            continue;
+        } else if (!ok) {
+            fprintf(stderr, "segment %u (slot %u) damaged, left out\n", h->seq, segs[i].slot);
+            damaged++;
+            out_close();
+            continue;
+        }
+        if (list) {
+            continue;
+        }
+        // Carry on in the same file if this follows on, bar a short gap
+        if (out.f != NULL && (h->boot != out.boot || h->take != out.take
+                || h->position < out.end || h->position - out.end > gap_max
+                || (out.frames + (h->position - out.end) + h->frames) * frame_bytes
+                    > UINT32_MAX - WAV_HDR_BYTES - CUE_BYTES)) {
+            out_close();
+        }
+        if (out.f == NULL && !out_open(h)) {
+            continue;
+        }
+        if (h->position > out.end) {
+            if (out.num_cues < MAX_CUES) {
+                out.cues[out.num_cues++] = out.frames;
+            }
+            gaps++;
+            out_put(NULL, h->position - out.end);
+        }
+        if (!out_put(data, h->frames)) {
+            fprintf(stderr, "%s: failed to write\n", out.name);
+            failures++;
+        }
+        bytes += len;
+    }
+    out_close();
+    elapsed = now_s() - t0;
+
+    printf("%u segments, %u damaged, %u overwritten, %.1f MB of audio, %u files, "
+        "%u gaps filled, in %.3f s, %.1f MB/s\n", count, damaged, overwritten, bytes / 1e6,
+        files, gaps, elapsed,
+        bytes / 1e6 / elapsed);
+    free(segs);
+    free(data);
+    close(fd);
+    return count == 0 || failures > 0;
+}
@@ -0,0 +1,439 @@
+/* I2S recorder hardware abstraction, Linux implementation
+
+   Implements recorder_hal.h on Linux, for the host build; see
+   recorder_hal_linux.h for how it stands in for the hardware.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "recorder_config.h"
+#include "recorder_hal.h"
+#include "recorder_hal_linux.h"
+
+static const char *TAG = "hal_linux";
+
+#define SINE_FRAMES     (SAMPLE_RATE/1000)   // one period of 1 kHz
+#define MAX_BANKS       (128)   // what an 8 MB ESP32 has beyond its mapped 4 MB
+#define MAX_BANK_WINDOWS (4)
+#define RAW_PART_START  (2048)  // where a new image's partition starts, as fdisk would put it
+
+typedef struct linux_task {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned notified;
+    void (*fn)(void *);
+    void *arg;
+} linux_task_t;
+
+static __thread linux_task_t *self;
+static linux_task_t tasks[HAL_MAX_TASKS];
+static unsigned task_count;
+
+static struct {
+    uint64_t limit;             // frames to deliver
+    double speed;               // multiple of real time, 0 for unpaced
+    atomic_uint_fast64_t frames;// frames delivered (or lost) so far
+    uint32_t overflow_every;    // reads between simulated DMA overflows
+    uint32_t short_every;       // reads between simulated short reads
+    uint32_t burst_on;          // frames of sine in each burst
+    uint32_t burst_off;         // frames of silence after each, 0 for none
+    uint32_t reads;
+    bool overflowed;            // a DMA overflow is due before the next read
+    uint64_t lost;              // frames lost to simulated faults
+    int64_t start_epoch_us;     // hal_time_us() when the first frame arrived
+    int64_t clock_start_us;     // what to make that, 0 for the time of day
+    double clock_ppm;           // how fast the clock runs against the frames
+    int64_t start_mono_us;      // monotonic time then, for pacing
+    uint8_t sine[SINE_FRAMES * NUM_CHANNELS * I2S_SLOT_BYTES];
+} source;
+
+// Banks are pages of a temporary file, mapped over windows of address
+// space reserved up front, so anything left pointing into a window after
+// it's unmapped or remapped faults or reads the wrong bank, as it would on
+// the ESP32
+static struct {
+    pthread_mutex_t lock;
+    int fd;
+    uint32_t banks;
+    uint8_t *window[MAX_BANK_WINDOWS];
+    uint32_t window_banks;
+    uint32_t mapped_bank[MAX_BANK_WINDOWS];     // first bank in each window
+    uint32_t mapped_count[MAX_BANK_WINDOWS];    // and how many, 0 for none
+    int8_t in_window[MAX_BANKS];    // which window each bank is in, or -1
+} banks = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+// Copied through as on the ESP32, though any memory would do here
+uint8_t hal_stage[HAL_STAGE_BYTES];
+
+// The card, for hal_raw_*()
+static struct {
+    const char *path;
+    uint64_t bytes;
+    int fd;
+} raw = { .path = "sdcard.img", .bytes = 1ULL << 30, .fd = -1 };
+
+static int64_t mono_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void hal_linux_source_config(uint64_t frames, double speed) {
+    source.limit = frames;
+    source.speed = speed;
+}
+
+void hal_linux_fault_config(uint32_t overflow_every, uint32_t short_every) {
+    source.overflow_every = overflow_every;
+    source.short_every = short_every;
+}
+
+void hal_linux_burst_config(uint32_t on_frames, uint32_t off_frames) {
+    source.burst_on = on_frames;
+    source.burst_off = off_frames;
+}
+
+uint64_t hal_linux_frames_read(void) {
+    return atomic_load(&source.frames);
+}
+
+void hal_linux_clock_config(int64_t start_us, double ppm) {
+    source.clock_start_us = start_us;
+    source.clock_ppm = ppm;
+}
+
+void hal_linux_raw_config(const char *path, uint64_t bytes) {
+    raw.path = path;
+    raw.bytes = bytes;
+}
+
+esp_err_t hal_i2s_init(void) {
+    struct timeval tv;
+
+    // One period of a half-scale sine, in I2S slot format: 16-bit slots, or
+    // 24-bit samples left-justified in 32-bit slots
+    for (int i = 0; i < SINE_FRAMES; i++) {
+        double v = 0.5 * sin(2 * M_PI * i / SINE_FRAMES);
+        for (int c = 0; c < NUM_CHANNELS; c++) {
+            uint8_t *p = source.sine + (i * NUM_CHANNELS + c) * I2S_SLOT_BYTES;
+#if I2S_SLOT_BYTES == 4
+            int32_t s = (int32_t)(v * 8388607) << 8;
+#else
+            int16_t s = (int16_t)(v * 32767);
+#endif
+            memcpy(p, &s, sizeof s);
+        }
+    }
+
+    gettimeofday(&tv, NULL);
+    source.start_epoch_us = source.clock_start_us != 0
+        ? source.clock_start_us : (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    source.start_mono_us = mono_us();
+    return ESP_OK;
+}
+
+esp_err_t hal_i2s_read(void *dest, size_t size, size_t *bytes_read, uint32_t timeout_ms) {
+    const size_t slot_frame_bytes = NUM_CHANNELS * I2S_SLOT_BYTES;
+    uint64_t frames = atomic_load(&source.frames);
+    uint64_t n = size / slot_frame_bytes;
+    uint8_t *d = dest;
+
+    uint64_t skip = 0;
+    esp_err_t rc = ESP_OK;
+
+    *bytes_read = 0;
+    if (frames >= source.limit) {
+        // The source has run dry; behave like a silent bus
+        usleep(timeout_ms * 1000);
+        return ESP_ERR_TIMEOUT;
+    }
+
+    // Simulated faults. An overflow loses one DMA buffer after this read,
+    // as the real driver would if the next one didn't come in time; it's
+    // counted when hal_i2s_frames_lost() is next called, between reads. A
+    // short read delivers half of what was asked for and times out, the
+    // rest lost.
+    source.reads++;
+    if (source.overflow_every && source.reads % source.overflow_every == 0) {
+        source.overflowed = true;
+    }
+    if (source.short_every && source.reads % source.short_every == 0) {
+        skip = n - n / 2;
+        n /= 2;
+        rc = ESP_ERR_TIMEOUT;
+    }
+    if (n > source.limit - frames) {
+        n = source.limit - frames;
+    }
+    if (skip > source.limit - frames - n) {
+        skip = source.limit - frames - n;
+    }
+    source.lost += skip;
+
+    // Hold back until real time (times speed) catches up with the source
+    if (source.speed > 0) {
+        int64_t due = source.start_mono_us
+            + (int64_t)((frames + n + skip) * 1000000 / SAMPLE_RATE / source.speed);
+        int64_t now = mono_us();
+        if (due > now) {
+            usleep(due - now);
+        }
+    }
+
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t frame = frames + i;
+        uint8_t *p = d + i * slot_frame_bytes;
+        if (source.burst_off != 0
+            && frame % (source.burst_on + source.burst_off) >= source.burst_on) {
+            memset(p, 0, slot_frame_bytes);
+        } else {
+            // The sine, bar the last channel, which counts frames
+#if I2S_SLOT_BYTES == 4
+            uint32_t count = (uint32_t)frame << 8;
+#else
+            uint16_t count = (uint16_t)frame;
+#endif
+            memcpy(p, source.sine + frame % SINE_FRAMES * slot_frame_bytes, slot_frame_bytes);
+            memcpy(p + (NUM_CHANNELS - 1) * I2S_SLOT_BYTES, &count, sizeof count);
+        }
+    }
+    atomic_fetch_add(&source.frames, n + skip);
+    *bytes_read = n * slot_frame_bytes;
+    return rc;
+}
+
+uint64_t hal_i2s_frames_lost(void) {
+    uint64_t frames = atomic_load(&source.frames);
+
+    if (source.overflowed && frames < source.limit) {
+        uint64_t lost = MAX_SAMPLES;
+        if (lost > source.limit - frames) {
+            lost = source.limit - frames;
+        }
+        atomic_fetch_add(&source.frames, lost);
+        source.lost += lost;
+    }
+    source.overflowed = false;
+    return source.lost;
+}
+
+esp_err_t hal_fs_mount(const char *mount_point) {
+    if (mkdir(mount_point, 0755) != 0 && errno != EEXIST) {
+        ESP_LOGE(TAG, "Failed to create %s, %s", mount_point, strerror(errno));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t hal_raw_init(uint64_t *sectors) {
+    struct stat st;
+
+    raw.fd = open(raw.path, O_RDWR);
+    if (raw.fd < 0 && errno == ENOENT) {
+        // A new card, sparse, partitioned with nothing on it
+        uint8_t mbr[HAL_SECTOR_BYTES] = { 0 };
+        uint32_t start = RAW_PART_START;
+        uint32_t count = raw.bytes / HAL_SECTOR_BYTES - start;
+        uint8_t *e = mbr + 446;
+
+        e[4] = 0xda;
+        for (int i = 0; i < 4; i++) {
+            e[8 + i] = start >> (8 * i);
+            e[12 + i] = count >> (8 * i);
+        }
+        mbr[510] = 0x55;
+        mbr[511] = 0xaa;
+        raw.fd = open(raw.path, O_RDWR | O_CREAT | O_EXCL, 0666);
+        if (raw.fd >= 0 && (ftruncate(raw.fd, raw.bytes) != 0
+                || pwrite(raw.fd, mbr, sizeof mbr, 0) != sizeof mbr)) {
+            close(raw.fd);
+            raw.fd = -1;
+        }
+    }
+    if (raw.fd < 0 || fstat(raw.fd, &st) != 0) {
+        ESP_LOGE(TAG, "Failed to open card image %s, %s", raw.path, strerror(errno));
+        return ESP_FAIL;
+    }
+    *sectors = st.st_size / HAL_SECTOR_BYTES;
+    return ESP_OK;
+}
+
+esp_err_t hal_raw_read(uint64_t sector, void *dest, uint32_t count) {
+    size_t len = (size_t)count * HAL_SECTOR_BYTES;
+
+    return pread(raw.fd, dest, len, sector * HAL_SECTOR_BYTES) == (ssize_t)len ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t hal_raw_write(uint64_t sector, const void *src, uint32_t count) {
+    size_t len = (size_t)count * HAL_SECTOR_BYTES;
+
+    return pwrite(raw.fd, src, len, sector * HAL_SECTOR_BYTES) == (ssize_t)len ? ESP_OK : ESP_FAIL;
+}
+
+bool hal_bank_init(uint32_t count, unsigned windows, uint32_t window_banks) {
+    FILE *f;
+
+    if (count > MAX_BANKS || windows > MAX_BANK_WINDOWS) {
+        ESP_LOGE(TAG, "Can't reserve %u banks and %u windows", count, windows);
+        return false;
+    }
+    if ((f = tmpfile()) == NULL
+        || (banks.fd = dup(fileno(f))) < 0
+        || ftruncate(banks.fd, (off_t)count * HAL_BANK_BYTES) != 0) {
+        ESP_LOGE(TAG, "Failed to create the banks, %s", strerror(errno));
+        return false;
+    }
+    fclose(f);
+    for (unsigned w = 0; w < windows; w++) {
+        banks.window[w] = mmap(NULL, (size_t)window_banks * HAL_BANK_BYTES, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (banks.window[w] == MAP_FAILED) {
+            ESP_LOGE(TAG, "Failed to reserve a window, %s", strerror(errno));
+            return false;
+        }
+        banks.mapped_count[w] = 0;
+    }
+    memset(banks.in_window, -1, sizeof banks.in_window);
+    banks.banks = count;
+    banks.window_banks = window_banks;
+    return true;
+}
+
+// hal_bank_map(), with banks.lock held and the window empty
+static void *bank_map_locked(unsigned window, uint32_t bank, uint32_t count) {
+    void *addr;
+
+    if (bank + count > banks.banks || count > banks.window_banks) {
+        ESP_LOGE(TAG, "Banks %u-%u don't fit", bank, bank + count - 1);
+        return NULL;
+    }
+    for (uint32_t b = bank; b < bank + count; b++) {
+        if (banks.in_window[b] >= 0) {
+            ESP_LOGE(TAG, "Bank %u is already in window %d", b, banks.in_window[b]);
+            return NULL;
+        }
+    }
+    addr = mmap(banks.window[window], (size_t)count * HAL_BANK_BYTES, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_FIXED, banks.fd, (off_t)bank * HAL_BANK_BYTES);
+    if (addr == MAP_FAILED) {
+        ESP_LOGE(TAG, "Failed to map banks %u-%u, %s", bank, bank + count - 1, strerror(errno));
+        return NULL;
+    }
+    for (uint32_t b = bank; b < bank + count; b++) {
+        banks.in_window[b] = window;
+    }
+    banks.mapped_bank[window] = bank;
+    banks.mapped_count[window] = count;
+    return addr;
+}
+
+void *hal_bank_map(unsigned window, uint32_t bank, uint32_t count) {
+    void *addr;
+
+    hal_bank_unmap(window);
+    pthread_mutex_lock(&banks.lock);
+    addr = bank_map_locked(window, bank, count);
+    pthread_mutex_unlock(&banks.lock);
+    return addr;
+}
+
+void hal_bank_unmap(unsigned window) {
+    pthread_mutex_lock(&banks.lock);
+    if (banks.mapped_count[window] > 0) {
+        mmap(banks.window[window], (size_t)banks.mapped_count[window] * HAL_BANK_BYTES, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        for (uint32_t b = 0; b < banks.mapped_count[window]; b++) {
+            banks.in_window[banks.mapped_bank[window] + b] = -1;
+        }
+        banks.mapped_count[window] = 0;
+    }
+    pthread_mutex_unlock(&banks.lock);
+}
+
+static void *task_main(void *arg) {
+    self = arg;
+    self->fn(self->arg);
+    return NULL;
+}
+
+// Threads get the host's own stacks, priorities and cores. The stack is
+// left alone: a few KB is plenty on the ESP32, but not for glibc, so the
+// thread gets one of its own, from mmap() rather than the heap.
+hal_task_t hal_task_create(void (*fn)(void *), const char *name, void *stack, uint32_t stack_size,
+    void *arg, int priority, int core) {
+    linux_task_t *t;
+
+    (void)stack;
+    (void)stack_size;
+    (void)priority;
+    (void)core;
+    if (task_count == HAL_MAX_TASKS) {
+        ESP_LOGE(TAG, "Failed to create task %s, too many tasks", name);
+        return NULL;
+    }
+    t = &tasks[task_count];
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    t->fn = fn;
+    t->arg = arg;
+    if (pthread_create(&t->thread, NULL, task_main, t) != 0) {
+        ESP_LOGE(TAG, "Failed to create task %s", name);
+        return NULL;
+    }
+    task_count++;
+    return t;
+}
+
+void hal_task_notify(hal_task_t task) {
+    linux_task_t *t = task;
+
+    pthread_mutex_lock(&t->lock);
+    t->notified++;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+}
+
+bool hal_task_wait(uint32_t timeout_ms) {
+    struct timespec until;
+    bool notified;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&self->lock);
+    while (self->notified == 0) {
+        if (pthread_cond_timedwait(&self->cond, &self->lock, &until) == ETIMEDOUT) {
+            break;
+        }
+    }
+    notified = self->notified != 0;
+    self->notified = 0;
+    pthread_mutex_unlock(&self->lock);
+    return notified;
+}
+
+int64_t hal_time_us(void) {
+    return source.start_epoch_us
+        + (int64_t)(atomic_load(&source.frames) * (1e6 + source.clock_ppm) / SAMPLE_RATE);
+}
+
+int64_t hal_uptime_us(void) {
+    return mono_us();
+}
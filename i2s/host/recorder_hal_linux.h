@@ -0,0 +1,41 @@
+/* I2S recorder hardware abstraction, Linux implementation
+
+   The I2S input is synthetic, continuous or in bursts: a 1 kHz sine,
+   except in the last channel, which holds a frame counter, wrapping at
+   the sample size, so a frame that reaches a file out of place can be
+   spotted (wavcheck -c). It is delivered as fast as the recorder takes it
+   or paced at a multiple of real time, and stopped after a set number of
+   frames. The clock runs off the frames delivered, so timestamps and
+   filenames advance as they would in a real recording, and can be set to
+   start at a given time and to drift against the sample clock, as an RTC
+   does against a crystal.
+   Recordings go to a directory, or with SD_RAW, to a card image: a file
+   with an MBR and one partition, of type 0xda, created if it isn't there.
+   Banks of himem are pages of a temporary file, mapped into windows with
+   mmap().
+*/
+#pragma once
+
+#include <stdint.h>
+
+// Deliver frames frames, at speed times real time (0 for unpaced)
+void hal_linux_source_config(uint64_t frames, double speed);
+
+// Simulate a DMA overflow every overflow_every reads, and a short read every
+// short_every reads; 0 for never
+void hal_linux_fault_config(uint32_t overflow_every, uint32_t short_every);
+
+// Make the source come in bursts: on_frames of sine and counter, then
+// off_frames of silence, over and over; 0 off_frames for no silence
+void hal_linux_burst_config(uint32_t on_frames, uint32_t off_frames);
+
+// Frames delivered (or lost to faults) so far
+uint64_t hal_linux_frames_read(void);
+
+// Start the clock at start_us since the epoch (0 for the time of day) and
+// run it ppm parts per million fast (or negative, slow) against the frames
+void hal_linux_clock_config(int64_t start_us, double ppm);
+
+// The card image hal_raw_init() opens (default "sdcard.img"), and the size
+// to make it if it has to create it (default 1 GB)
+void hal_linux_raw_config(const char *path, uint64_t bytes);
@@ -0,0 +1,315 @@
+/* Pre-roll ring benchmark and tests
+
+   Without -t, times what trigger capture adds to each record buffer:
+   sd_task's copy of a slot into the record buffer it writes from, as a
+   share of one host core at real time, and i2s_task's claim and publish
+   of a slot, on average while another thread copies slots out as fast
+   as it can.
+
+   With -t, checks the ring: that it wraps round, giving back exactly the
+   last slots-worth of what was published, then that copies taken while a
+   writer thread goes round and round as fast as it can are either
+   consistent or reported as lost. Exits non-zero if any check fails,
+   e.g. for "make ringcheck".
+
+   Usage: ringbench [-t] [-s seconds]
+*/
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "preroll_ring.h"
+
+#define SLOT_BYTES      (192000)        // CONFIG_RECORDER_CHUNK_SIZE
+#define SLOT_FRAMES     (SLOT_BYTES / 4)
+#define SLOTS           (16)
+#define RATE            (48000)
+
+static double now_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fill a slot with words that say which slot it is, and where in it
+static void fill(uint8_t *slot, size_t bytes, unsigned seq) {
+    uint32_t *w = (uint32_t *)slot;
+
+    for (size_t i = 0; i < bytes / 4; i++) {
+        w[i] = seq * 2654435761u + i;
+    }
+}
+
+static bool filled(const uint8_t *slot, size_t bytes, unsigned seq) {
+    const uint32_t *w = (const uint32_t *)slot;
+
+    for (size_t i = 0; i < bytes / 4; i++) {
+        if (w[i] != seq * 2654435761u + i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A ring of slots slots of bytes each, in memory of its own
+static bool ring_init(preroll_ring_t *r, unsigned slots, size_t bytes) {
+    uint8_t *data = malloc(slots * bytes);
+    recbuf_desc_t *descs = malloc(slots * sizeof *descs);
+
+    if (data == NULL || descs == NULL) {
+        free(data);
+        free(descs);
+        return false;
+    }
+    preroll_ring_init(r, data, descs, slots, bytes);
+    return true;
+}
+
+static void put(preroll_ring_t *r, unsigned seq, uint32_t frames) {
+    recbuf_desc_t d = { .position = (uint64_t)seq * frames, .frames = frames };
+
+    fill(preroll_ring_claim(r), r->slot_bytes, seq);
+    preroll_ring_publish(r, &d);
+}
+
+// Publish slot after slot, checking after each that exactly the last
+// slots-worth can be read, then that claiming the next one takes the
+// oldest away before anything is captured over it
+static const char *test_wrap(void) {
+    const unsigned slots = 5;
+    const size_t bytes = 256;
+    preroll_ring_t r;
+    uint8_t copy[256];
+    static char text[128];
+
+    if (!ring_init(&r, slots, bytes)) {
+        return "out of memory";
+    }
+    for (unsigned n = 1; n <= 4 * slots + 3; n++) {
+        unsigned tail = n > slots ? n - slots : 0;
+
+        put(&r, n - 1, 64);
+        if (preroll_ring_head(&r) != n || preroll_ring_tail(&r) != tail) {
+            snprintf(text, sizeof text, "after %u slots, head %u tail %u, not %u and %u",
+                n, preroll_ring_head(&r), preroll_ring_tail(&r), n, tail);
+            return text;
+        }
+        for (unsigned seq = 0; seq < n + 2; seq++) {
+            recbuf_desc_t d;
+            bool ok = preroll_ring_read(&r, seq, &d, copy);
+
+            if (ok != (seq >= tail && seq < n)) {
+                snprintf(text, sizeof text, "after %u slots, slot %u %s", n, seq,
+                    ok ? "could be read" : "couldn't be read");
+                return text;
+            }
+            if (ok && (d.position != seq * 64u || !filled(copy, bytes, seq))) {
+                snprintf(text, sizeof text, "after %u slots, slot %u held the wrong audio", n, seq);
+                return text;
+            }
+        }
+        if (n >= slots) {
+            recbuf_desc_t d;
+
+            preroll_ring_claim(&r);
+            if (preroll_ring_read(&r, n - slots, &d, copy)) {
+                snprintf(text, sizeof text, "slot %u could be read while claimed", n - slots);
+                return text;
+            }
+        }
+    }
+    free(r.data);
+    free(r.descs);
+    return NULL;
+}
+
+typedef struct race {
+    preroll_ring_t ring;
+    atomic_bool stop;
+    atomic_uint torn;           // copies read as good that weren't
+    atomic_uint good;
+    atomic_uint lost;
+    atomic_uint caught;         // lost copies that were in fact torn
+    double put_s;               // time in claim and publish, without the capture
+    unsigned puts;
+} race_t;
+
+static void *writer(void *arg) {
+    race_t *race = arg;
+
+    for (unsigned seq = 0; !atomic_load(&race->stop); seq++) {
+        recbuf_desc_t d = { .position = (uint64_t)seq * SLOT_FRAMES, .frames = SLOT_FRAMES };
+        double t = now_s();
+        uint8_t *slot = preroll_ring_claim(&race->ring);
+        double put_s = now_s() - t;
+
+        fill(slot, race->ring.slot_bytes, seq);
+        t = now_s();
+        preroll_ring_publish(&race->ring, &d);
+        race->put_s += put_s + now_s() - t;
+        race->puts++;
+    }
+    return NULL;
+}
+
+// Copy slots at the tail, where the writer is about to go, and anywhere
+// else now and then
+static void *reader(void *arg) {
+    race_t *race = arg;
+    uint8_t *copy = malloc(race->ring.slot_bytes);
+    unsigned pick = 1;
+
+    while (!atomic_load(&race->stop)) {
+        unsigned tail = preroll_ring_tail(&race->ring);
+        unsigned head = preroll_ring_head(&race->ring);
+        unsigned seq;
+        recbuf_desc_t d;
+
+        pick = pick * 1664525 + 1013904223;
+        seq = (pick >> 24) < 192 || head == tail ? tail : tail + (pick >> 8) % (head - tail);
+        if (!preroll_ring_read(&race->ring, seq, &d, copy)) {
+            atomic_fetch_add(&race->lost, 1);
+            if (d.position != (uint64_t)seq * SLOT_FRAMES
+                || !filled(copy, race->ring.slot_bytes, seq)) {
+                atomic_fetch_add(&race->caught, 1);
+            }
+        } else if (d.position != (uint64_t)seq * SLOT_FRAMES
+            || !filled(copy, race->ring.slot_bytes, seq)) {
+            atomic_fetch_add(&race->torn, 1);
+        } else {
+            atomic_fetch_add(&race->good, 1);
+        }
+    }
+    free(copy);
+    return NULL;
+}
+
+static const char *test_race(double seconds, unsigned slots, size_t bytes, unsigned readers) {
+    static race_t race;
+    pthread_t w, r[4];
+    static char text[160];
+
+    memset(&race, 0, sizeof race);
+    if (!ring_init(&race.ring, slots, bytes)) {
+        return "out of memory";
+    }
+    pthread_create(&w, NULL, writer, &race);
+    for (unsigned i = 0; i < readers; i++) {
+        pthread_create(&r[i], NULL, reader, &race);
+    }
+    usleep(seconds * 1e6);
+    atomic_store(&race.stop, true);
+    pthread_join(w, NULL);
+    for (unsigned i = 0; i < readers; i++) {
+        pthread_join(r[i], NULL);
+    }
+    free(race.ring.data);
+    free(race.ring.descs);
+
+    printf("  %u slots of %zu bytes: %u copies good, %u lost (%u of them torn), %u torn\n",
+        slots, bytes, atomic_load(&race.good), atomic_load(&race.lost),
+        atomic_load(&race.caught), atomic_load(&race.torn));
+    if (atomic_load(&race.torn) > 0) {
+        snprintf(text, sizeof text, "%u torn copies were taken as good", atomic_load(&race.torn));
+        return text;
+    }
+    if (atomic_load(&race.good) == 0) {
+        return "no copy was ever good";
+    }
+    return NULL;
+}
+
+static int run_tests(double seconds) {
+    const char *problem;
+    int failed = 0;
+
+    problem = test_wrap();
+    printf("%-28s %s%s\n", "wraparound", problem ? "FAIL, " : "ok", problem ? problem : "");
+    failed += problem != NULL;
+
+    // A small ring of small slots crosses all the time; one of record
+    // buffers, as recorded, now and then
+    printf("copies while overwritten\n");
+    problem = test_race(seconds / 2, 2, 4096, 2);
+    problem = problem ? problem : test_race(seconds / 2, 4, SLOT_BYTES, 2);
+    printf("%-28s %s%s\n", "copies while overwritten", problem ? "FAIL, " : "ok", problem ? problem : "");
+    failed += problem != NULL;
+    return failed ? 1 : 0;
+}
+
+static int bench(double seconds) {
+    static race_t race;
+    preroll_ring_t *r = &race.ring;
+    uint8_t *copy = malloc(SLOT_BYTES);
+    unsigned copies = 0;
+    double start, elapsed;
+    pthread_t w, rd;
+
+    if (copy == NULL || !ring_init(r, SLOTS, SLOT_BYTES)) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (unsigned seq = 0; seq < SLOTS; seq++) {
+        put(r, seq, SLOT_FRAMES);
+    }
+
+    // sd_task's copy out of the ring, slot after slot, as a snapshot does
+    start = now_s();
+    do {
+        recbuf_desc_t d;
+
+        preroll_ring_read(r, copies % SLOTS, &d, copy);
+        copies++;
+    } while ((elapsed = now_s() - start) < seconds / 2);
+    printf("%-24s %12s %10s %7s\n", "", "MB/s", "realtime", "core%");
+    printf("%-24s %12.1f %10.1f %7.3f\n", "copy out of the ring",
+        copies * (double)SLOT_BYTES / elapsed / 1e6,
+        copies * (double)SLOT_FRAMES / elapsed / RATE,
+        100.0 * elapsed * RATE / (copies * (double)SLOT_FRAMES));
+    free(copy);
+    free(r->data);
+    free(r->descs);
+
+    // i2s_task's claim and publish, while a reader copies out flat out
+    memset(&race, 0, sizeof race);
+    if (!ring_init(&race.ring, SLOTS, SLOT_BYTES)) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    pthread_create(&w, NULL, writer, &race);
+    pthread_create(&rd, NULL, reader, &race);
+    usleep(seconds / 2 * 1e6);
+    atomic_store(&race.stop, true);
+    pthread_join(w, NULL);
+    pthread_join(rd, NULL);
+    printf("claim and publish        %.3f us on average, over %u slots, with %u copies taken meanwhile\n",
+        race.put_s / race.puts * 1e6, race.puts, atomic_load(&race.good) + atomic_load(&race.lost));
+    free(race.ring.data);
+    free(race.ring.descs);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    double seconds = 2;
+    bool test = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ts:")) != -1) {
+        switch (opt) {
+        case 't':
+            test = true;
+            break;
+        case 's':
+            seconds = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t] [-s seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+    return test ? run_tests(seconds) : bench(seconds);
+}
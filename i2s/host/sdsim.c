@@ -0,0 +1,190 @@
+/* SD card latency simulator
+
+   Runs the real recorder pipeline against the synthetic I2S source, with
+   the latency of a slow or stalling SD card injected into every write()
+   and fsync() sd_task makes, and reports how many record buffers (and how
+   much PSRAM) it takes to get through without dropping audio, and how
+   much of the recording's time the card was busy, which is what is left
+   of its throughput. Time is scaled by the source speed, so a 2 second
+   stall at 100x costs 20 ms.
+
+   It is built with a large buffer pool (see the Makefile), so the pool
+   never runs out and the high-water mark of outstanding buffers is the
+   smallest pool that would have been enough. Each run prints one row of
+   the sizing table; "make sizing" runs a set of traces and formats, and
+   "make chunks" a set of traces and record buffer sizes.
+
+   Usage: sdsim [-H] [-t trace] [-s seconds] [-x speed] [-b MB/s] [-r seed]
+     -H  print the table header and exit
+     -t  latency trace, added to every write on top of the bandwidth cost:
+           none                 bandwidth only (default)
+           periodic:MS:SECONDS  stall for MS every SECONDS of recording
+           pareto:MS:ALPHA      heavy-tailed stalls, minimum MS, shape ALPHA
+           file:PATH            replay latencies in ms from PATH, one per
+                                write, cycled
+     -s  seconds of audio to record (default 600)
+     -x  run at this multiple of real time (default 50)
+     -b  card write bandwidth (default 1.5 MB/s)
+     -r  random seed for pareto (default 1)
+*/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "recorder.h"
+#include "recorder_config.h"
+#include "recorder_hal.h"
+#include "recorder_hal_linux.h"
+
+#define MAX_TRACE   (100000)
+#define MAX_STALL_MS (30000.0)
+
+static struct {
+    enum { TRACE_NONE, TRACE_PERIODIC, TRACE_PARETO, TRACE_FILE } type;
+    double a, b;            // stall and period, or minimum and shape
+    double *file;           // replayed latencies
+    size_t file_len, next;
+    int64_t next_stall_us;  // recording time of the next periodic stall
+} trace;
+
+static double speed = 50;
+static double bandwidth = 1.5e6;
+static double worst_ms;
+static double card_ms;      // card time so far
+
+ssize_t __real_write(int fd, const void *buf, size_t n);
+int __real_fsync(int fd);
+
+// Extra latency, in ms, for the next write
+static double trace_next(void) {
+    switch (trace.type) {
+    case TRACE_PERIODIC: {
+        int64_t now = hal_time_us();
+        if (now >= trace.next_stall_us) {
+            trace.next_stall_us = now + (int64_t)(trace.b * 1e6);
+            return trace.a;
+        }
+        return 0;
+    }
+    case TRACE_PARETO: {
+        double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+        double ms = trace.a / pow(u, 1 / trace.b);
+        return ms < MAX_STALL_MS ? ms : MAX_STALL_MS;
+    }
+    case TRACE_FILE:
+        return trace.file[trace.next++ % trace.file_len];
+    default:
+        return 0;
+    }
+}
+
+// Hold up the caller for ms of card time, scaled to the simulation
+static void card_delay(double ms) {
+    if (ms > worst_ms) {
+        worst_ms = ms;
+    }
+    card_ms += ms;
+    usleep((useconds_t)(ms * 1000 / speed));
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t n) {
+    card_delay(n / bandwidth * 1000 + trace_next());
+    return __real_write(fd, buf, n);
+}
+
+int __wrap_fsync(int fd) {
+    card_delay(trace_next());
+    return __real_fsync(fd);
+}
+
+static int parse_trace(const char *spec) {
+    if (strcmp(spec, "none") == 0) {
+        trace.type = TRACE_NONE;
+    } else if (sscanf(spec, "periodic:%lf:%lf", &trace.a, &trace.b) == 2) {
+        trace.type = TRACE_PERIODIC;
+    } else if (sscanf(spec, "pareto:%lf:%lf", &trace.a, &trace.b) == 2) {
+        trace.type = TRACE_PARETO;
+    } else if (strncmp(spec, "file:", 5) == 0) {
+        FILE *f = fopen(spec + 5, "r");
+        double ms;
+        if (f == NULL) {
+            perror(spec + 5);
+            return -1;
+        }
+        trace.file = malloc(MAX_TRACE * sizeof *trace.file);
+        while (trace.file_len < MAX_TRACE && fscanf(f, "%lf", &ms) == 1) {
+            trace.file[trace.file_len++] = ms;
+        }
+        fclose(f);
+        if (trace.file_len == 0) {
+            fprintf(stderr, "%s: no latencies\n", spec + 5);
+            return -1;
+        }
+        trace.type = TRACE_FILE;
+    } else {
+        fprintf(stderr, "unknown trace: %s\n", spec);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *spec = "none";
+    double seconds = 600;
+    uint64_t frames;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "Ht:s:x:b:r:")) != -1) {
+        switch (opt) {
+        case 'H':
+            printf("%-7s %-5s %-22s %9s %9s %8s %10s %7s\n",
+                "rate", "bits", "trace", "worst ms", "buf ms", "buffers", "PSRAM KB", "card%");
+            return 0;
+        case 't':
+            spec = optarg;
+            break;
+        case 's':
+            seconds = atof(optarg);
+            break;
+        case 'x':
+            speed = atof(optarg);
+            break;
+        case 'b':
+            bandwidth = atof(optarg) * 1e6;
+            break;
+        case 'r':
+            srand(atoi(optarg));
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-H] [-t trace] [-s seconds] [-x speed] [-b MB/s] [-r seed]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+    if (parse_trace(spec) != 0) {
+        return 1;
+    }
+    frames = (uint64_t)(seconds * SAMPLE_RATE);
+    hal_linux_source_config(frames, speed);
+
+    recorder_start();
+    while (sd_stats.frames_written + recbuf_stats.dropped_frames
+            + recbuf_stats.lost_frames < frames) {
+        usleep(1000);
+    }
+
+    // Outstanding buffers include the one being captured, so that is the
+    // pool size needed. If even the whole pool overflowed, say so.
+    if (recbuf_stats.dropped_frames > 0) {
+        printf("%-7d %-5d %-22s %9.0f %9d %7s%d %10s %7.1f\n",
+            SAMPLE_RATE, FILE_BITS_PER_SAMPLE, spec, worst_ms, RECBUF_MS,
+            ">", NUM_RECBUFS, "-", card_ms / seconds / 10);
+    } else {
+        printf("%-7d %-5d %-22s %9.0f %9d %8u %10u %7.1f\n",
+            SAMPLE_RATE, FILE_BITS_PER_SAMPLE, spec, worst_ms, RECBUF_MS,
+            recbuf_stats.max_outstanding,
+            recbuf_stats.max_outstanding * RECBUF_SIZE / 1024, card_ms / seconds / 10);
+    }
+    return 0;
+}
@@ -0,0 +1,116 @@
+/* Capture timestamp benchmark
+
+   Compares what i2s_task spends timestamping each record buffer: the
+   original get_timestamps(), which set TZ to UTC and called tzset() for
+   every buffer, then formatted the filename with localtime_r() and
+   strftime() and copied it into the queue message, with reading the
+   clock into 64-bit epoch microseconds, as hal_time_us() does, and
+   working back to the buffer's first frame. The filename is now formatted
+   by sd_task when it opens a file, once a minute, which is shown
+   alongside, spread over the buffers in a file. The costs are the host C
+   library's, not newlib's, but the work is the same.
+
+   Usage: timebench [-n buffers]
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include "recorder_config.h"
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// The original, called by i2s_task for every buffer
+static void get_timestamps(int *seconds, char *datetime, size_t datetime_size) {
+    time_t now;
+    struct tm timeinfo;
+
+    time(&now);
+    // Set timezone to Universal Cooordinated Time
+    setenv("TZ", "UTC", 1);
+    tzset();
+
+    localtime_r(&now, &timeinfo);
+    strftime(datetime, datetime_size, "%Y%m%d-%H%M", &timeinfo);
+    *seconds = timeinfo.tm_sec;
+}
+
+// hal_time_us() on the ESP32
+static int64_t time_us(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// format_timestamp() in recorder.c, once per file
+static void format_timestamp(time_t timestamp, char *datetime, size_t datetime_size) {
+    struct tm timeinfo;
+
+    localtime_r(&timestamp, &timeinfo);
+    strftime(datetime, datetime_size, "%Y%m%d-%H%M", &timeinfo);
+}
+
+int main(int argc, char **argv) {
+    long buffers = 1000000;
+    const long per_file = FRAMES_PER_FILE / RECBUF_FRAMES;
+    double old_ns, new_ns, file_ns, start;
+    volatile int64_t sink = 0;
+    char filename[128];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            buffers = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n buffers]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    start = now_ns();
+    for (long i = 0; i < buffers; i++) {
+        // And the copy of the filename into the 128-byte queue message
+        struct { char filename[128]; int seqno; } m;
+        char datetime[32];
+        int seconds;
+
+        get_timestamps(&seconds, datetime, sizeof datetime);
+        strncpy(m.filename, datetime, sizeof m.filename);
+        m.seqno = seconds;
+        sink += m.filename[0] + m.seqno;
+    }
+    old_ns = (now_ns() - start) / buffers;
+
+    setenv("TZ", "UTC", 1);
+    tzset();
+    start = now_ns();
+    for (long i = 0; i < buffers; i++) {
+        sink += time_us() - (int64_t)RECBUF_FRAMES * 1000000 / SAMPLE_RATE;
+    }
+    new_ns = (now_ns() - start) / buffers;
+
+    start = now_ns();
+    for (long i = 0; i < buffers; i++) {
+        format_timestamp(time(NULL), filename, sizeof filename);
+        sink += filename[0];
+    }
+    file_ns = (now_ns() - start) / buffers;
+
+    printf("get_timestamps()   %8.1f ns/buffer, in i2s_task\n", old_ns);
+    printf("hal_time_us()      %8.1f ns/buffer, in i2s_task\n", new_ns);
+    printf("format_timestamp() %8.1f ns/file in sd_task, %.1f ns/buffer over %ld buffers\n",
+        file_ns, file_ns / per_file, per_file);
+    printf("speedup            %.0fx in i2s_task\n", old_ns / new_ns);
+    return 0;
+}
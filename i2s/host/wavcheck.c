@@ -0,0 +1,460 @@
+/* WAV file checker
+
+   Checks that recorder output is well formed: RIFF or RF64 sizes that
+   match the file, a sane PCM or IMA-ADPCM fmt chunk, whole frames (or
+   blocks) of audio, a fact chunk that agrees with them for IMA-ADPCM, and
+   cue points inside the audio. Prints a line per file, with the Broadcast WAV
+   start time if there is one, and checks that each file starts, to the
+   frame, where the one before it (in the order given) ended.
+
+   With -c, it also checks the audio itself is what the host build's
+   synthetic source sent (../host/recorder_hal_linux.h): the last channel
+   has to count up a frame at a time, through the silence filled in for a
+   gap from its cue point on, and on from one file to the next where they
+   follow on. So a buffer written twice, out of order, or overwritten
+   while it waited to be written shows up. PCM only, with no bursts.
+
+   With -f, it also checks the files were rotated every so many seconds as
+   the recorder does it, by counting frames against the Broadcast WAV start
+   time: a file that doesn't follow on from a full one before it has to
+   end on the next boundary, to the frame, or before it, and be named for
+   the second (or minute) it starts in. One that does follows on whatever
+   its start time, as the clock may have drifted against the audio, has to
+   hold no more than a full file's frames, and be named for the boundary
+   nearest its start.
+
+   Usage: wavcheck [-q] [-c] [-f seconds] file.wav...
+     -q  only print files with problems
+     -c  check the frame counter in the last channel
+     -f  check the files were rotated every this many seconds
+   Exits non-zero if any file has a problem.
+*/
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define MAX_CUES    (256)   // cue points kept for -c
+#define FULL_CUES   (32)    // the most the recorder marks in a file (SD_MAX_CUES)
+
+static uint32_t get_le16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t *p) {
+    return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+typedef struct wav_info {
+    bool rf64;
+    uint32_t rate, channels, bits, block_align;
+    uint32_t block_frames;      // frames in each block_align bytes, 1 unless IMA-ADPCM
+    bool adpcm;
+    bool has_fact;
+    uint32_t fact_frames;
+    uint64_t frames;
+    bool has_bext;
+    uint64_t time_reference;    // frames since midnight
+    uint32_t cues;
+    uint32_t cue_frame[MAX_CUES];   // where each cue point is, the first MAX_CUES
+    uint64_t data_off;
+} wav_info_t;
+
+// Check one file. Returns NULL if it is good, or what is wrong with it.
+static const char *check(const char *path, wav_info_t *info) {
+    static char problem[128];
+    uint8_t hdr[12], ch[8], buf[64];
+    uint64_t size, pos = 12, riff_size, data_size = 0, data_off = 0;
+    uint64_t ds64_riff = 0, ds64_data = 0;
+    bool have_fmt = false;
+    FILE *f = fopen(path, "rb");
+
+    memset(info, 0, sizeof *info);
+    if (f == NULL) {
+        return "can't open";
+    }
+    fseeko(f, 0, SEEK_END);
+    size = ftello(f);
+    rewind(f);
+    if (fread(hdr, 1, 12, f) != 12 || memcmp(hdr + 8, "WAVE", 4) != 0) {
+        fclose(f);
+        return "not a WAV file";
+    }
+    if (memcmp(hdr, "RF64", 4) == 0) {
+        info->rf64 = true;
+    } else if (memcmp(hdr, "RIFF", 4) != 0) {
+        fclose(f);
+        return "not a WAV file";
+    }
+    riff_size = get_le32(hdr + 4);
+
+    while (pos + 8 <= size) {
+        uint64_t len;
+
+        fseeko(f, pos, SEEK_SET);
+        if (fread(ch, 1, 8, f) != 8) {
+            break;
+        }
+        len = get_le32(ch + 4);
+        if (memcmp(ch, "ds64", 4) == 0) {
+            if (pos != 12 || len < 28 || fread(buf, 1, 28, f) != 28) {
+                snprintf(problem, sizeof problem, "bad ds64 chunk");
+                goto fail;
+            }
+            ds64_riff = get_le64(buf);
+            ds64_data = get_le64(buf + 8);
+        } else if (memcmp(ch, "fmt ", 4) == 0) {
+            if (len < 16 || fread(buf, 1, len < 20 ? 16 : 20, f) != (len < 20 ? 16 : 20)) {
+                snprintf(problem, sizeof problem, "short fmt chunk");
+                goto fail;
+            }
+            info->adpcm = get_le16(buf) == 0x11;
+            if (get_le16(buf) != 1 && !info->adpcm) {
+                snprintf(problem, sizeof problem, "format %u is not PCM or IMA-ADPCM", get_le16(buf));
+                goto fail;
+            }
+            info->channels = get_le16(buf + 2);
+            info->rate = get_le32(buf + 4);
+            info->block_align = get_le16(buf + 12);
+            info->bits = get_le16(buf + 14);
+            info->block_frames = 1;
+            if (info->adpcm) {
+                // 4 header bytes per channel, then 8 samples per 4 bytes
+                if (len < 20 || get_le16(buf + 16) < 2) {
+                    snprintf(problem, sizeof problem, "IMA-ADPCM fmt chunk without samples per block");
+                    goto fail;
+                }
+                info->block_frames = get_le16(buf + 18);
+                if (info->channels == 0 || info->bits != 4 || info->block_frames % 8 != 1
+                    || info->block_align != info->channels * (4 + (info->block_frames - 1) / 2)
+                    || get_le32(buf + 8) != (uint64_t)info->rate * info->block_align / info->block_frames) {
+                    snprintf(problem, sizeof problem, "inconsistent fmt chunk");
+                    goto fail;
+                }
+            } else if (info->channels == 0 || info->bits == 0
+                || info->block_align != info->channels * ((info->bits + 7) / 8)
+                || get_le32(buf + 8) != info->rate * info->block_align) {
+                snprintf(problem, sizeof problem, "inconsistent fmt chunk");
+                goto fail;
+            }
+            have_fmt = true;
+        } else if (memcmp(ch, "fact", 4) == 0) {
+            if (len < 4 || fread(buf, 1, 4, f) != 4) {
+                snprintf(problem, sizeof problem, "short fact chunk");
+                goto fail;
+            }
+            info->has_fact = true;
+            info->fact_frames = get_le32(buf);
+        } else if (memcmp(ch, "bext", 4) == 0) {
+            uint8_t bext[602];
+            if (len < 602 || fread(bext, 1, 602, f) != 602) {
+                snprintf(problem, sizeof problem, "short bext chunk");
+                goto fail;
+            }
+            info->has_bext = true;
+            info->time_reference = get_le64(bext + 338);
+        } else if (memcmp(ch, "data", 4) == 0) {
+            data_off = pos + 8;
+            if (info->rf64) {
+                if (len != UINT32_MAX) {
+                    snprintf(problem, sizeof problem, "RF64 data size isn't -1");
+                    goto fail;
+                }
+                len = ds64_data;
+            }
+            data_size = len;
+        } else if (memcmp(ch, "cue ", 4) == 0) {
+            if (len < 4 || fread(buf, 1, 4, f) != 4) {
+                snprintf(problem, sizeof problem, "short cue chunk");
+                goto fail;
+            }
+            info->cues = get_le32(buf);
+            if (len < 4 + 24ull * info->cues) {
+                snprintf(problem, sizeof problem, "cue chunk too short for %u cues", info->cues);
+                goto fail;
+            }
+            for (uint32_t i = 0; i < info->cues; i++) {
+                if (fread(buf, 1, 24, f) != 24) {
+                    snprintf(problem, sizeof problem, "short cue chunk");
+                    goto fail;
+                }
+                if (info->block_align
+                    && get_le32(buf + 20) > data_size / info->block_align * info->block_frames) {
+                    snprintf(problem, sizeof problem, "cue %u is past the end of the audio", i + 1);
+                    goto fail;
+                }
+                if (i < MAX_CUES) {
+                    info->cue_frame[i] = get_le32(buf + 20);
+                }
+            }
+        }
+        pos += 8 + len + (len & 1);
+    }
+
+    if (info->rf64) {
+        if (ds64_riff == 0) {
+            snprintf(problem, sizeof problem, "RF64 without a ds64 chunk");
+            goto fail;
+        }
+        if (riff_size != UINT32_MAX) {
+            snprintf(problem, sizeof problem, "RF64 size isn't -1");
+            goto fail;
+        }
+        riff_size = ds64_riff;
+    }
+    if (riff_size != size - 8) {
+        snprintf(problem, sizeof problem, "RIFF size %" PRIu64 " but file is %" PRIu64 " bytes",
+            riff_size, size);
+        goto fail;
+    }
+    if (pos != size) {
+        snprintf(problem, sizeof problem, "chunks run past the end of the file");
+        goto fail;
+    }
+    if (!have_fmt || data_off == 0) {
+        snprintf(problem, sizeof problem, "no %s chunk", have_fmt ? "data" : "fmt");
+        goto fail;
+    }
+    if (data_size % info->block_align != 0) {
+        snprintf(problem, sizeof problem, "data isn't whole frames");
+        goto fail;
+    }
+    if (!info->rf64 && data_off + data_size > UINT32_MAX) {
+        snprintf(problem, sizeof problem, "over 4 GB but not RF64");
+        goto fail;
+    }
+    info->frames = data_size / info->block_align * info->block_frames;
+    info->data_off = data_off;
+    if (info->adpcm) {
+        // The last block may be padded out; fact says where the audio ends
+        if (!info->has_fact) {
+            snprintf(problem, sizeof problem, "IMA-ADPCM without a fact chunk");
+            goto fail;
+        }
+        if (info->fact_frames > info->frames
+            || (info->frames > 0 && info->fact_frames <= info->frames - info->block_frames)) {
+            snprintf(problem, sizeof problem, "fact says %u frames, but the data holds %" PRIu64,
+                info->fact_frames, info->frames);
+            goto fail;
+        }
+        info->frames = info->fact_frames;
+    }
+    fclose(f);
+    return NULL;
+
+fail:
+    fclose(f);
+    return problem;
+}
+
+// Check the frame counter in the last channel of a file check() has
+// passed. *first is the counter's first value, *next the one after its
+// last. Returns NULL if it counts as it should, or what is wrong.
+static const char *check_counter(const char *path, const wav_info_t *info, uint32_t *first,
+    uint32_t *next) {
+    static char problem[128];
+    static uint8_t buf[65536];
+    const uint32_t bytes = info->bits / 8, mask = (1u << info->bits) - 1;
+    const uint32_t frame_bytes = info->block_align;
+    uint32_t expect = 0, cue = 0;
+    uint64_t frame = 0;
+    bool filling = false;
+    FILE *f;
+
+    if (info->adpcm || (info->bits != 16 && info->bits != 24) || info->channels < 2) {
+        return "no frame counter in this format";
+    }
+    if ((f = fopen(path, "rb")) == NULL) {
+        return "can't open";
+    }
+    fseeko(f, info->data_off, SEEK_SET);
+    while (frame < info->frames) {
+        uint64_t n = sizeof buf / frame_bytes;
+        if (n > info->frames - frame) {
+            n = info->frames - frame;
+        }
+        if (fread(buf, frame_bytes, n, f) != n) {
+            snprintf(problem, sizeof problem, "can't read the audio");
+            fclose(f);
+            return problem;
+        }
+        for (uint64_t i = 0; i < n; i++, frame++) {
+            const uint8_t *p = buf + i * frame_bytes;
+            const uint8_t *c = p + frame_bytes - bytes;
+            uint32_t v = bytes == 3 ? c[0] | (c[1] << 8) | (c[2] << 16) : get_le16(c);
+            bool silent = true;
+
+            for (uint32_t b = 0; b < frame_bytes; b++) {
+                silent = silent && p[b] == 0;
+            }
+            if (frame == 0) {
+                expect = *first = v;
+            }
+            // Silence filled in for a gap starts at a cue point, and lasts
+            // as long as the audio that went missing. Once the recorder has
+            // marked as many gaps as it can, the rest go unmarked.
+            while (cue < info->cues && cue < MAX_CUES && info->cue_frame[cue] <= frame) {
+                filling = info->cue_frame[cue++] == frame;
+            }
+            if (cue >= FULL_CUES && cue == info->cues && silent) {
+                filling = true;
+            }
+            filling = filling && silent;
+            if (v != expect && !filling) {
+                snprintf(problem, sizeof problem, "frame %" PRIu64 " counts %u, not %u",
+                    frame, v, expect);
+                fclose(f);
+                return problem;
+            }
+            expect = (expect + 1) & mask;
+        }
+    }
+    fclose(f);
+    *next = expect;
+    return NULL;
+}
+
+// Check where a file check() has passed starts and ends, and its name,
+// for files rotated every seconds. aligned says whether it follows on
+// from a full file, and *full is set if it is one. Returns NULL if it is
+// as it should be, or what is wrong.
+static const char *check_rotation(const char *path, const wav_info_t *info, uint32_t seconds,
+    bool aligned, bool *full) {
+    static char problem[128];
+    const uint64_t period = (uint64_t)seconds * info->rate;
+    const uint64_t into = info->time_reference % period;
+    const char *base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    const char *hms = strchr(base, '-');
+    uint32_t start_s = info->time_reference / info->rate;
+    uint32_t name_s, digits = 0;
+
+    *full = false;
+    if (!info->has_bext) {
+        return "no Broadcast WAV start time";
+    }
+    while (hms != NULL && hms[1 + digits] >= '0' && hms[1 + digits] <= '9') {
+        digits++;
+    }
+    if (digits != 4 && digits != 6) {
+        return "not named for when it starts";
+    }
+    name_s = strtoul(hms + 1, NULL, 10);
+    name_s = digits == 4 ? name_s / 100 * 3600 + name_s % 100 * 60
+        : name_s / 10000 * 3600 + name_s / 100 % 100 * 60 + name_s % 100;
+    if (aligned) {
+        if (info->frames > period) {
+            snprintf(problem, sizeof problem, "%" PRIu64 " frames, more than a file holds",
+                info->frames);
+            return problem;
+        }
+        start_s = (start_s + seconds / 2) / seconds * seconds % 86400;
+        *full = info->frames == period;
+    } else {
+        if (into + info->frames > period) {
+            snprintf(problem, sizeof problem, "runs %" PRIu64 " frames past the boundary",
+                into + info->frames - period);
+            return problem;
+        }
+        start_s -= digits == 4 ? start_s % 60 : 0;
+        *full = into + info->frames == period;
+    }
+    if (name_s != start_s) {
+        snprintf(problem, sizeof problem, "named for %02u:%02u:%02u, not %02u:%02u:%02u",
+            name_s / 3600, name_s / 60 % 60, name_s % 60,
+            start_s / 3600, start_s / 60 % 60, start_s % 60);
+        return problem;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    bool quiet = false;
+    bool counter = false;
+    bool have_prev = false;
+    uint64_t expect = 0;    // TimeReference the next file should have
+    uint32_t count = 0;     // and the frame counter, with -c
+    uint32_t rotate_s = 0;  // seconds between files, with -f
+    bool prev_full = false; // the file before was a full one, with -f
+    int failed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "qcf:")) != -1) {
+        switch (opt) {
+        case 'q':
+            quiet = true;
+            break;
+        case 'c':
+            counter = true;
+            break;
+        case 'f':
+            rotate_s = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-q] [-c] [-f seconds] file.wav...\n", argv[0]);
+            return 2;
+        }
+    }
+
+    for (int i = optind; i < argc; i++) {
+        wav_info_t info;
+        const char *problem = check(argv[i], &info);
+        bool rotated = have_prev && rotate_s != 0 && prev_full;
+        bool follows = rotated || (have_prev && info.has_bext
+            && info.time_reference == expect % (86400ull * info.rate));
+        uint32_t first = 0, next = 0;
+        uint64_t day = 0;
+
+        if (problem == NULL && rotate_s != 0) {
+            problem = check_rotation(argv[i], &info, rotate_s, rotated, &prev_full);
+        }
+        if (problem == NULL && counter && info.frames > 0) {
+            problem = check_counter(argv[i], &info, &first, &next);
+            if (problem == NULL && follows && first != count) {
+                problem = "frame counter doesn't follow on from the file before";
+            }
+            count = next;
+        }
+        if (problem != NULL) {
+            printf("%s: FAIL, %s\n", argv[i], problem);
+            failed++;
+            have_prev = false;
+            continue;
+        }
+        if (info.has_bext) {
+            day = 86400ull * info.rate;
+            if (have_prev && !follows) {
+                // Not necessarily wrong, there may be a gap between files,
+                // but say so
+                printf("%s: starts %+" PRId64 " frames from the end of the file before\n",
+                    argv[i], (int64_t)(info.time_reference - expect % day));
+            }
+            expect = info.time_reference + info.frames;
+            have_prev = true;
+        }
+        if (!quiet) {
+            printf("%s: OK, %s %u Hz %u-bit%s %u ch, %" PRIu64 " frames (%.1f s)",
+                argv[i], info.rf64 ? "RF64" : "RIFF", info.rate, info.bits,
+                info.adpcm ? " IMA-ADPCM" : "", info.channels,
+                info.frames, (double)info.frames / info.rate);
+            if (info.has_bext) {
+                uint64_t t = info.time_reference;
+                printf(", starts %02u:%02u:%02u+%u",
+                    (unsigned)(t / info.rate / 3600), (unsigned)(t / info.rate / 60 % 60),
+                    (unsigned)(t / info.rate % 60), (unsigned)(t % info.rate));
+            }
+            if (info.cues) {
+                printf(", %u dropouts marked", info.cues);
+            }
+            printf("\n");
+        }
+    }
+    return failed ? 1 : 0;
+}
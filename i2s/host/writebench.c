@@ -0,0 +1,484 @@
+/* SD write pattern benchmark
+
+   Writes record buffers to files the ways sd_task has done it, and times
+   each buffer, together with whatever opening, syncing and closing goes
+   with it:
+     reopen  the original sd_task: fopen(), fwrite() and fclose() for
+             every buffer. FATFS's f_close() syncs the file, so each close
+             here is preceded by an fsync().
+     open    the file kept open until it rotates, synced every
+             SD_FLUSH_INTERVAL frames
+     prealloc  the same, with each file's clusters allocated in one go
+             when it's created, as sd_preallocate() does (SD_PREALLOCATE)
+   Files rotate every FRAMES_PER_FILE frames, as the recorder's do. The
+   host build has no FATFS, so this measures whatever filesystem dir is
+   on; pointed at a FAT-formatted card mounted on Linux, it measures FAT
+   on a real card. Linux's FAT driver fills in the gap with zeros when a
+   file is grown by writing its last byte, as sd_preallocate() does, where
+   FATFS only allocates the clusters, so prealloc uses fallocate() to
+   allocate them without growing the file, which the FAT driver does the
+   same way. Neither looks for clusters in a row: they are only contiguous
+   if the free space is. The files are removed afterwards.
+
+   With -f, nothing is written. Instead, each mode is played through a
+   model of FATFS on a freshly formatted FAT32 card with 32 KB clusters:
+   the sectors of FAT, directory and data that FATFS reads and writes for
+   each call, with its one-sector window onto the FAT and directory and
+   its one-sector file buffer, as FF_FS_TINY 0 has them. Each read or
+   write of a run of sectors is a command to the card, which costs a
+   fixed time on top of the card's bandwidth, as in drainbench. The
+   times are the card's, not the host's.
+
+   Usage: writebench [-f] [-c ms] [-b MB/s] [-d dir] [-s seconds] [mode...]
+     -f  model FATFS on a card instead of writing files
+     -c  with -f, cost of each command to the card (default 4 ms)
+     -b  with -f, card bandwidth (default 1.5 MB/s)
+     -d  directory to write in (default sdcard)
+     -s  seconds of audio to write (default 300)
+   Runs every mode if none is given.
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "recorder_config.h"
+
+#define HDR_BYTES   (44)    // a plain WAV header
+
+typedef enum { MODE_REOPEN, MODE_OPEN, MODE_PREALLOC } write_mode_t;
+
+static const char *mode_names[] = { "reopen", "open", "prealloc" };
+#define NUM_MODES   (sizeof mode_names / sizeof mode_names[0])
+
+static const char *dir = "sdcard";
+static uint8_t buffer[RECBUF_SIZE];
+static const uint8_t hdr[HDR_BYTES];
+
+static double now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int by_value(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// The original sd_task's buffer: append to the file, opened by name
+static int put_reopen(const char *name, bool first) {
+    FILE *f;
+
+    if (first) {
+        if ((f = fopen(name, "w")) == NULL || fwrite(hdr, 1, sizeof hdr, f) != sizeof hdr) {
+            return -1;
+        }
+        fclose(f);
+    }
+    if ((f = fopen(name, "a")) == NULL) {
+        return -1;
+    }
+    if (fwrite(buffer, 1, sizeof buffer, f) != sizeof buffer
+        || fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        fclose(f);
+        return -1;
+    }
+    return fclose(f);
+}
+
+// The FATFS model, for -f
+#define SECTOR_BYTES    (512)
+#define CLUSTER_SECTORS (64)
+#define CLUSTER_BYTES   (CLUSTER_SECTORS * SECTOR_BYTES)
+#define FAT_PER_SECTOR  (SECTOR_BYTES / 4)      // FAT32 entries in a sector
+#define DIR_PER_SECTOR  (SECTOR_BYTES / 32 / 3) // a long name takes 3 entries
+// Sector numbers, only ever compared, for the FAT, the root directory
+// and the data area
+#define FAT_SECTOR(c)   (1000000 + (int64_t)(c) / FAT_PER_SECTOR)
+#define DIR_SECTOR(f)   (2000000 + (int64_t)(f) / DIR_PER_SECTOR)
+
+static struct {
+    double command_ms;
+    double bandwidth;
+    double ms;              // card time so far
+    uint64_t commands;      // commands so far
+    int64_t win;            // sector in the window, -1 for none
+    bool win_dirty;
+    bool fsinfo_dirty;      // the free cluster count has changed
+    uint32_t next_free;     // as fs->last_clst; a fresh card fills up in order
+    // The open file: its clusters are in a row, as it's the only one
+    // growing
+    uint32_t file;          // its number, for its directory entry
+    uint32_t first;         // first cluster
+    uint32_t clusters;      // clusters in its chain
+    uint64_t size, fptr;
+    bool buf_dirty;         // the file buffer holds a sector not yet written
+    bool modified;          // written since it was last synced
+} fat = { .command_ms = 4, .bandwidth = 1.5e6, .win = -1, .next_free = 2 };
+
+// One command to the card, reading or writing sectors in a row
+static void fat_card(uint32_t sectors) {
+    fat.ms += fat.command_ms + sectors * SECTOR_BYTES / fat.bandwidth * 1000;
+    fat.commands++;
+}
+
+// move_window(): write the window back if need be, to both FATs if it
+// holds a FAT sector, and read sector into it
+static void fat_window(int64_t sector) {
+    if (fat.win == sector) {
+        return;
+    }
+    if (fat.win_dirty) {
+        fat_card(1);
+        if (fat.win < DIR_SECTOR(0)) {
+            fat_card(1);
+        }
+        fat.win_dirty = false;
+    }
+    fat_card(1);
+    fat.win = sector;
+}
+
+// create_chain(): take the next free cluster, mark it the end of the
+// file's chain and link the chain's last cluster to it
+static void fat_grow(void) {
+    uint32_t c = fat.next_free++;
+
+    fat_window(FAT_SECTOR(c));
+    fat.win_dirty = true;
+    if (fat.clusters == 0) {
+        fat.first = c;
+    } else {
+        fat_window(FAT_SECTOR(c - 1));
+        fat.win_dirty = true;
+    }
+    fat.clusters++;
+    fat.fsinfo_dirty = true;
+}
+
+// f_open() with FA_CREATE_ALWAYS: a new directory entry, in the window
+static void fat_create(uint32_t file) {
+    fat_window(DIR_SECTOR(file));
+    fat.win_dirty = true;
+    fat.file = file;
+    fat.clusters = 0;
+    fat.size = fat.fptr = 0;
+    fat.buf_dirty = false;
+    fat.modified = true;
+}
+
+// f_lseek() to ofs, in a file opened for writing: follow the chain from
+// the start, or from the current cluster if ofs is in or after it,
+// growing it if ofs is past the end, and read the sector ofs is in into
+// the file buffer if ofs isn't at the start of one
+static void fat_seek(uint64_t ofs) {
+    uint32_t from = ofs >= fat.fptr && fat.fptr > 0 ? (uint32_t)((fat.fptr - 1) / CLUSTER_BYTES) : 0;
+    uint32_t to = ofs > 0 ? (uint32_t)((ofs - 1) / CLUSTER_BYTES) : 0;
+
+    for (uint32_t c = from + 1; c <= to; c++) {
+        if (c < fat.clusters) {
+            fat_window(FAT_SECTOR(fat.first + c - 1));
+        } else {
+            fat_grow();
+        }
+    }
+    if (ofs % SECTOR_BYTES != 0 && ofs / SECTOR_BYTES != fat.fptr / SECTOR_BYTES) {
+        if (fat.buf_dirty) {
+            fat_card(1);
+            fat.buf_dirty = false;
+        }
+        fat_card(1);
+    }
+    fat.fptr = ofs;
+    if (fat.fptr > fat.size) {
+        fat.size = fat.fptr;
+        fat.modified = true;
+    }
+}
+
+// f_open() of the file, then f_lseek() to its end, as "a" does
+static void fat_append(void) {
+    fat_window(DIR_SECTOR(fat.file));
+    fat.fptr = 0;
+    fat.buf_dirty = false;
+    fat_seek(fat.size);
+}
+
+// f_write(): part sectors through the file buffer, reading a sector in
+// first if it's inside the file already; whole sectors straight to the
+// card, as far as the end of the cluster; a new cluster at each cluster
+// boundary, or the next one looked up in the FAT
+static void fat_write(size_t len) {
+    while (len > 0) {
+        size_t n;
+
+        if (fat.fptr % SECTOR_BYTES == 0) {
+            uint32_t sectors = (uint32_t)(len / SECTOR_BYTES);
+            uint32_t in_cluster = (uint32_t)(fat.fptr / SECTOR_BYTES % CLUSTER_SECTORS);
+
+            if (in_cluster == 0) {
+                uint32_t c = (uint32_t)(fat.fptr / CLUSTER_BYTES);
+                if (c >= fat.clusters) {
+                    fat_grow();
+                } else if (c > 0) {
+                    fat_window(FAT_SECTOR(fat.first + c - 1));
+                }
+            }
+            if (fat.buf_dirty) {
+                fat_card(1);
+                fat.buf_dirty = false;
+            }
+            if (sectors > CLUSTER_SECTORS - in_cluster) {
+                sectors = CLUSTER_SECTORS - in_cluster;
+            }
+            if (sectors > 0) {
+                fat_card(sectors);
+                n = (size_t)sectors * SECTOR_BYTES;
+                fat.fptr += n;
+                len -= n;
+                continue;
+            }
+            if (fat.fptr < fat.size) {
+                fat_card(1);
+            }
+        }
+        n = SECTOR_BYTES - fat.fptr % SECTOR_BYTES;
+        n = n < len ? n : len;
+        fat.buf_dirty = true;
+        fat.fptr += n;
+        len -= n;
+    }
+    if (fat.fptr > fat.size) {
+        fat.size = fat.fptr;
+    }
+    fat.modified = true;
+}
+
+// f_sync(), and so f_close(): the file buffer, the directory entry, which
+// takes the window from the FAT, and the FSInfo sector's free count
+static void fat_sync(void) {
+    if (!fat.modified) {
+        return;
+    }
+    if (fat.buf_dirty) {
+        fat_card(1);
+        fat.buf_dirty = false;
+    }
+    fat_window(DIR_SECTOR(fat.file));
+    fat_card(1);
+    fat.win_dirty = false;
+    if (fat.fsinfo_dirty) {
+        fat_card(1);
+        fat.fsinfo_dirty = false;
+    }
+    fat.modified = false;
+}
+
+// Play seconds of audio in mode through the model, and print its row of
+// the table
+static void run_model(write_mode_t mode, double seconds) {
+    uint32_t buffers = (uint32_t)(seconds * SAMPLE_RATE / RECBUF_FRAMES);
+    double *ms = malloc(buffers * sizeof *ms);
+    uint64_t frames = 0, synced = 0, commands = fat.commands;
+    uint32_t files = 0;
+    double total = 0;
+
+    if (ms == NULL) {
+        return;
+    }
+    fat.ms = 0;
+    for (uint32_t b = 0; b < buffers; b++) {
+        bool first = frames % FRAMES_PER_FILE < RECBUF_FRAMES;
+        double t0 = fat.ms;
+
+        switch (mode) {
+        case MODE_REOPEN:
+            if (first) {
+                fat_create(files++);
+                fat_write(HDR_BYTES);
+                fat_sync();
+            }
+            fat_append();
+            fat_write(RECBUF_SIZE);
+            fat_sync();
+            break;
+        case MODE_OPEN:
+            if (first) {
+                fat_sync();
+                fat_create(files++);
+                fat_write(HDR_BYTES);
+                synced = frames;
+            }
+            fat_write(RECBUF_SIZE);
+            if (frames + RECBUF_FRAMES - synced >= SD_FLUSH_INTERVAL) {
+                fat_sync();
+                synced = frames + RECBUF_FRAMES;
+            }
+            break;
+        case MODE_PREALLOC:
+            if (first) {
+                fat_sync();
+                fat_create(files++);
+                fat_write(HDR_BYTES);
+                // sd_preallocate(): write the last byte, and seek back
+                fat_seek(HDR_BYTES + DATA_BYTES(FRAMES_PER_FILE) - 1);
+                fat_write(1);
+                fat_seek(HDR_BYTES);
+                synced = frames;
+            }
+            fat_write(RECBUF_SIZE);
+            if (frames + RECBUF_FRAMES - synced >= SD_FLUSH_INTERVAL) {
+                fat_sync();
+                synced = frames + RECBUF_FRAMES;
+            }
+            break;
+        }
+        ms[b] = fat.ms - t0;
+        total += ms[b];
+        frames += RECBUF_FRAMES;
+    }
+    fat_sync();
+    qsort(ms, buffers, sizeof *ms, by_value);
+    printf("%-8s %8u %9.3f %9.3f %9.3f %9.3f %9.1f\n", mode_names[mode], buffers, total / buffers,
+        ms[buffers * 99 / 100], ms[buffers - 1], (double)buffers * RECBUF_SIZE / 1e3 / fat.ms,
+        (double)(fat.commands - commands) / buffers);
+    free(ms);
+}
+
+// Write seconds of audio in mode, and print its row of the table.
+// Returns non-zero if a write fails.
+static int run(write_mode_t mode, double seconds) {
+    uint32_t buffers = (uint32_t)(seconds * SAMPLE_RATE / RECBUF_FRAMES);
+    double *ms = malloc(buffers * sizeof *ms);
+    double total = 0, start = now_ms();
+    uint64_t frames = 0, synced = 0;
+    uint32_t files = 0;
+    char name[256];
+    int fd = -1;
+
+    if (ms == NULL) {
+        return -1;
+    }
+    for (uint32_t b = 0; b < buffers; b++) {
+        bool first = frames % FRAMES_PER_FILE < RECBUF_FRAMES;   // a file starts in it
+        double t0 = now_ms();
+        int rc = 0;
+
+        if (first) {
+            snprintf(name, sizeof name, "%s/wb%04u.wav", dir, files++);
+        }
+        switch (mode) {
+        case MODE_REOPEN:
+            rc = put_reopen(name, first);
+            break;
+        case MODE_OPEN:
+        case MODE_PREALLOC:
+            if (first) {
+                if (fd >= 0 && (fsync(fd) != 0 || close(fd) != 0)) {
+                    rc = -1;
+                }
+                fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                if (fd < 0 || write(fd, hdr, sizeof hdr) != sizeof hdr) {
+                    rc = -1;
+                }
+                if (rc == 0 && mode == MODE_PREALLOC && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0,
+                        HDR_BYTES + DATA_BYTES(FRAMES_PER_FILE)) != 0) {
+                    rc = -1;
+                }
+                synced = frames;
+            }
+            if (rc == 0 && write(fd, buffer, sizeof buffer) != sizeof buffer) {
+                rc = -1;
+            }
+            if (rc == 0 && frames + RECBUF_FRAMES - synced >= SD_FLUSH_INTERVAL) {
+                rc = fsync(fd);
+                synced = frames + RECBUF_FRAMES;
+            }
+            break;
+        }
+        if (rc != 0) {
+            fprintf(stderr, "%s: %s failed, %s\n", mode_names[mode], name, strerror(errno));
+            free(ms);
+            return -1;
+        }
+        ms[b] = now_ms() - t0;
+        total += ms[b];
+        frames += RECBUF_FRAMES;
+    }
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    qsort(ms, buffers, sizeof *ms, by_value);
+    printf("%-8s %8u %9.3f %9.3f %9.3f %9.1f\n", mode_names[mode], buffers, total / buffers,
+        ms[buffers * 99 / 100], ms[buffers - 1],
+        (double)buffers * RECBUF_SIZE / 1e3 / (now_ms() - start));
+    while (files-- > 0) {
+        snprintf(name, sizeof name, "%s/wb%04u.wav", dir, files);
+        unlink(name);
+    }
+    free(ms);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    double seconds = 300;
+    bool model = false;
+    int failed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "fc:b:d:s:")) != -1) {
+        switch (opt) {
+        case 'f':
+            model = true;
+            break;
+        case 'c':
+            fat.command_ms = atof(optarg);
+            break;
+        case 'b':
+            fat.bandwidth = atof(optarg) * 1e6;
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 's':
+            seconds = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-f] [-c ms] [-b MB/s] [-d dir] [-s seconds] [mode...]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+    if (model) {
+        printf("%-8s %8s %9s %9s %9s %9s %9s\n",
+            "mode", "buffers", "mean ms", "p99 ms", "worst ms", "MB/s", "commands");
+    } else if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror(dir);
+        return 1;
+    } else {
+        printf("%-8s %8s %9s %9s %9s %9s\n",
+            "mode", "buffers", "mean ms", "p99 ms", "worst ms", "MB/s");
+    }
+    for (unsigned m = 0; m < NUM_MODES; m++) {
+        bool wanted = optind == argc;
+        for (int i = optind; i < argc; i++) {
+            wanted = wanted || strcmp(argv[i], mode_names[m]) == 0;
+        }
+        if (wanted && model) {
+            run_model((write_mode_t)m, seconds);
+        } else if (wanted) {
+            failed |= run((write_mode_t)m, seconds);
+        }
+    }
+    return failed != 0;
+}
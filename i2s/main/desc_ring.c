@@ -0,0 +1,55 @@
+/* Record buffer descriptor ring
+
+*/
+#include "desc_ring.h"
+
+void desc_ring_init(desc_ring_t *ring, recbuf_desc_t *slots, unsigned size) {
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->size = size;
+    ring->slots = slots;
+}
+
+bool desc_ring_push(desc_ring_t *ring, const recbuf_desc_t *desc) {
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail >= ring->size) {
+        return false;
+    }
+    ring->slots[head & (ring->size - 1)] = *desc;
+
+    // Publish the slot contents before the new head
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+bool desc_ring_pop(desc_ring_t *ring, recbuf_desc_t *desc) {
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    while (true) {
+        unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail == head) {
+            return false;
+        }
+
+        // Copy the slot out first, then claim it. If another popper got
+        // there first the copy may be stale, but then the claim fails and
+        // we go round again with the tail it left us.
+        *desc = ring->slots[tail & (ring->size - 1)];
+        if (atomic_compare_exchange_weak_explicit(
+                &ring->tail,
+                &tail,
+                tail + 1,
+                memory_order_acq_rel,
+                memory_order_acquire)) {
+            return true;
+        }
+    }
+}
+
+unsigned desc_ring_count(desc_ring_t *ring) {
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    return head - tail;
+}
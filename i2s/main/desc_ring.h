@@ -0,0 +1,48 @@
+/* Record buffer descriptor ring
+
+   Lock-free ring of record buffer descriptors, used to pass buffers
+   between i2s_task, flac_task and sd_task without a FreeRTOS queue.
+*/
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// One record buffer's worth of audio
+typedef struct recbuf_desc {
+    uint64_t position;  // absolute frame number of the first frame
+    int64_t timestamp;  // wall-clock time of the first frame, epoch microseconds
+    uint32_t frames;    // number of frames in the buffer
+    uint8_t buf_index;  // which record buffer holds them
+    uint8_t flags;      // DESC_FILE_START etc.
+    uint32_t offset;    // frames into the buffer the first one is, if only part of it is meant
+    // Encoded buffers (SD_FLAC) only
+    uint32_t bytes;     // bytes of FLAC frames in the buffer
+    uint32_t silence;   // frames of silence among frames, filling gaps
+} recbuf_desc_t;
+
+#define DESC_FILE_START (1 << 0)    // the first frame starts a new file
+#define DESC_FILE_END   (1 << 1)    // the last frame ends the file
+#define DESC_ALIGNED    (1 << 2)    // the file starts on a SD_FILE_SECONDS boundary
+#define DESC_AFTER_GAP  (1 << 3)    // the file starts after a gap too long to fill
+
+// A single producer pushes at head. Pops advance tail with a compare and
+// swap, so besides the consumer the producer may also pop, e.g. to reclaim
+// the oldest entry; no other combination of callers is safe.
+typedef struct desc_ring {
+    atomic_uint head;       // count of descriptors ever pushed
+    atomic_uint tail;       // count of descriptors ever popped
+    unsigned size;          // number of slots, a power of two
+    recbuf_desc_t *slots;
+} desc_ring_t;
+
+void desc_ring_init(desc_ring_t *ring, recbuf_desc_t *slots, unsigned size);
+
+// Returns false if the ring is full
+bool desc_ring_push(desc_ring_t *ring, const recbuf_desc_t *desc);
+
+// Returns false if the ring is empty
+bool desc_ring_pop(desc_ring_t *ring, recbuf_desc_t *desc);
+
+unsigned desc_ring_count(desc_ring_t *ring);
@@ -0,0 +1,103 @@
+/* Deferred event log
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include "evt_log.h"
+#include "recorder_hal.h"
+
+
+static const struct {
+    bool error;
+    const char *format;
+} evt_formats[EVT_COUNT] = {
+    [EVT_I2S_READ]              = { false, "i2s_read(): rc=%d  bytes=%d, buf_index=%d" },
+    [EVT_I2S_READ_FAILED]       = { true,  "i2s_read(): rc=%d  bytes=%d, buf_index=%d" },
+    [EVT_I2S_MAX_OUTSTANDING]   = { false, "i2s: max outstanding buffers: %d" },
+    [EVT_I2S_DROP_OLDEST]       = { true,  "i2s: overrun, dropped oldest, dropped frames: %d" },
+    [EVT_I2S_DROP_NEWEST]       = { true,  "i2s: overrun, dropped newest, dropped frames: %d" },
+    [EVT_I2S_NO_RECLAIM]        = { true,  "i2s: no buffer to reclaim, dropped frames: %d" },
+    [EVT_I2S_OVERFLOW]          = { true,  "i2s: DMA overflow, %d frames lost, lost frames: %d" },
+    [EVT_I2S_SHORT_READ]        = { true,  "i2s: short read, %d of %d bytes" },
+    [EVT_SD_WROTE]              = { false, "sd_task: Wrote bytes: %d, frames to go: %d" },
+    [EVT_SD_WROTE_FLAC]         = { false, "sd_task: Wrote FLAC bytes: %d, frames: %d" },
+};
+
+static struct {
+    atomic_uint head;       // count of records ever claimed
+    atomic_uint tail;       // count of records ever popped
+    atomic_uint dropped;
+    evt_rec_t *slots;       // EVT_LOG_SIZE of them, in PSRAM like the record buffers
+} ring;
+
+void evt_log_init(evt_rec_t *slots) {
+    for (unsigned i = 0; i < EVT_LOG_SIZE; i++) {
+        atomic_init(&slots[i].seq, 0);
+    }
+    ring.slots = slots;
+}
+
+void evt_log(evt_id_t id, int32_t a0, int32_t a1, int32_t a2, int32_t a3) {
+    unsigned head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+    evt_rec_t *rec;
+
+    if (ring.slots == NULL) {
+        atomic_fetch_add_explicit(&ring.dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    // Claim a slot. A slot is free once the consumer has moved tail past
+    // the record that was in it.
+    do {
+        if (head - atomic_load_explicit(&ring.tail, memory_order_acquire) >= EVT_LOG_SIZE) {
+            atomic_fetch_add_explicit(&ring.dropped, 1, memory_order_relaxed);
+            return;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(
+        &ring.head, &head, head + 1, memory_order_relaxed, memory_order_relaxed));
+
+    rec = &ring.slots[head & (EVT_LOG_SIZE - 1)];
+    rec->id = id;
+    rec->time_us = hal_uptime_us();
+    rec->arg[0] = a0;
+    rec->arg[1] = a1;
+    rec->arg[2] = a2;
+    rec->arg[3] = a3;
+    // Publish it. Records may complete out of order; the consumer waits at
+    // the first incomplete one.
+    atomic_store_explicit(&rec->seq, head + 1, memory_order_release);
+}
+
+bool evt_log_pop(evt_rec_t *rec) {
+    unsigned tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+    evt_rec_t *slot;
+
+    if (ring.slots == NULL) {
+        return false;
+    }
+    slot = &ring.slots[tail & (EVT_LOG_SIZE - 1)];
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != tail + 1) {
+        return false;
+    }
+    rec->id = slot->id;
+    rec->time_us = slot->time_us;
+    for (int i = 0; i < EVT_LOG_ARGS; i++) {
+        rec->arg[i] = slot->arg[i];
+    }
+    atomic_store_explicit(&ring.tail, tail + 1, memory_order_release);
+    return true;
+}
+
+bool evt_log_format(const evt_rec_t *rec, char *text, size_t size) {
+    if (rec->id >= EVT_COUNT) {
+        snprintf(text, size, "unknown event %u", rec->id);
+        return true;
+    }
+    snprintf(text, size, evt_formats[rec->id].format,
+        rec->arg[0], rec->arg[1], rec->arg[2], rec->arg[3]);
+    return evt_formats[rec->id].error;
+}
+
+uint32_t evt_log_dropped(void) {
+    return atomic_load_explicit(&ring.dropped, memory_order_relaxed);
+}
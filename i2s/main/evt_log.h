@@ -0,0 +1,57 @@
+/* Deferred event log
+
+   A cheap stand-in for ESP_LOGx on the hot path. Logging an event just
+   copies its id, a timestamp and up to four integer arguments into a
+   fixed-size record in a lock-free ring; no formatting, no UART. A low
+   priority task pops the records later and formats them with printf
+   formats from a table, so the output reads as it did with ESP_LOGx.
+*/
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define EVT_LOG_SIZE    (1024)  // records, a power of two
+#define EVT_LOG_ARGS    (4)
+
+typedef enum evt_id {
+    EVT_I2S_READ,           // rc, bytes, buf_index
+    EVT_I2S_READ_FAILED,    // rc, bytes, buf_index
+    EVT_I2S_MAX_OUTSTANDING,// outstanding
+    EVT_I2S_DROP_OLDEST,    // dropped frames so far
+    EVT_I2S_DROP_NEWEST,    // dropped frames so far
+    EVT_I2S_NO_RECLAIM,     // dropped frames so far
+    EVT_I2S_OVERFLOW,       // frames lost, lost frames so far
+    EVT_I2S_SHORT_READ,     // bytes, bytes asked for
+    EVT_SD_WROTE,           // bytes, frames to go
+    EVT_SD_WROTE_FLAC,      // bytes, frames
+    EVT_COUNT
+} evt_id_t;
+
+typedef struct evt_rec {
+    atomic_uint seq;        // 1 + the ring position, once the record is complete
+    uint16_t id;
+    uint16_t reserved;
+    int64_t time_us;        // hal_uptime_us() when it was logged
+    int32_t arg[EVT_LOG_ARGS];
+} evt_rec_t;
+
+// Start the ring in slots, EVT_LOG_SIZE records of the caller's. Events
+// logged before this are dropped.
+void evt_log_init(evt_rec_t *slots);
+
+// Log an event. Safe from any number of tasks at once; if the ring is full
+// the event is counted and dropped rather than waiting.
+void evt_log(evt_id_t id, int32_t a0, int32_t a1, int32_t a2, int32_t a3);
+
+// Take the oldest event. Only one task may pop. Returns false if empty.
+bool evt_log_pop(evt_rec_t *rec);
+
+// Format rec as text, without the timestamp. Returns true if it is an
+// error rather than information.
+bool evt_log_format(const evt_rec_t *rec, char *text, size_t size);
+
+// Events dropped because the ring was full
+uint32_t evt_log_dropped(void);
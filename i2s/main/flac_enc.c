@@ -0,0 +1,689 @@
+/* FLAC encoder
+
+*/
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flac_enc.h"
+
+#define VENDOR_STRING   "i2s_recorder flac_enc"
+
+static uint8_t crc8_table[256];
+static uint16_t crc16_table[256];
+
+// Big-endian bit writer. acc holds the n bits not yet stored.
+typedef struct bitw {
+    uint8_t *p;
+    uint64_t acc;
+    unsigned n;
+} bitw_t;
+
+// Store the low bits of v, up to 32 of them; the rest of v must be 0
+static inline void put_bits(bitw_t *w, uint32_t v, unsigned bits) {
+    w->acc = (w->acc << bits) | v;
+    w->n += bits;
+    while (w->n >= 8) {
+        w->n -= 8;
+        *w->p++ = (uint8_t)(w->acc >> w->n);
+    }
+}
+
+static inline void put_signed(bitw_t *w, int32_t v, unsigned bits) {
+    put_bits(w, (uint32_t)v & (0xffffffffu >> (32 - bits)), bits);
+}
+
+// Pad with zero bits to a byte boundary
+static void put_align(bitw_t *w) {
+    if (w->n > 0) {
+        put_bits(w, 0, 8 - w->n);
+    }
+}
+
+// Frame numbers are coded like UTF-8, up to 31 bits in 6 bytes
+static void put_utf8(bitw_t *w, uint32_t v) {
+    unsigned bytes;
+
+    if (v < 0x80) {
+        put_bits(w, v, 8);
+        return;
+    }
+    bytes = v < 0x800 ? 2 : v < 0x10000 ? 3 : v < 0x200000 ? 4 : v < 0x4000000 ? 5 : 6;
+    put_bits(w, ((0xff00 >> bytes) & 0xff) | (v >> (6 * (bytes - 1))), 8);
+    for (int i = bytes - 2; i >= 0; i--) {
+        put_bits(w, 0x80 | ((v >> (6 * i)) & 0x3f), 8);
+    }
+}
+
+// A residual of 0 bits, then a 1, then the low k bits of u, with u >> k
+// zeros in front: Rice coding of the zigzagged residual.
+static inline void put_rice(bitw_t *w, uint32_t u, unsigned k) {
+    uint32_t q = u >> k;
+
+    while (q >= 32) {
+        put_bits(w, 0, 32);
+        q -= 32;
+    }
+    if (q + 1 + k <= 32) {
+        put_bits(w, (1u << k) | (u & ((1u << k) - 1)), q + 1 + k);
+    } else {
+        put_bits(w, 1, q + 1);
+        put_bits(w, u & ((1u << k) - 1), k);
+    }
+}
+
+static inline uint32_t zigzag(int32_t r) {
+    return ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+}
+
+static void crc_init(void) {
+    for (unsigned i = 0; i < 256; i++) {
+        uint8_t c8 = i;
+        uint16_t c16 = i << 8;
+
+        for (int b = 0; b < 8; b++) {
+            c8 = (c8 & 0x80) ? (c8 << 1) ^ 0x07 : c8 << 1;
+            c16 = (c16 & 0x8000) ? (c16 << 1) ^ 0x8005 : c16 << 1;
+        }
+        crc8_table[i] = c8;
+        crc16_table[i] = c16;
+    }
+}
+
+static uint8_t crc8(const uint8_t *p, size_t len) {
+    uint8_t crc = 0;
+
+    while (len-- > 0) {
+        crc = crc8_table[crc ^ *p++];
+    }
+    return crc;
+}
+
+static uint16_t crc16(const uint8_t *p, size_t len) {
+    uint16_t crc = 0;
+
+    while (len-- > 0) {
+        crc = (crc << 8) ^ crc16_table[(crc >> 8) ^ *p++];
+    }
+    return crc;
+}
+
+bool flac_enc_init(flac_enc_t *e, int32_t *work, uint32_t sample_rate, unsigned channels,
+    unsigned bits, uint32_t block_frames) {
+    memset(e, 0, sizeof *e);
+    if (channels < 1 || channels > FLAC_MAX_CHANNELS || bits < 4 || bits > 24
+        || block_frames < 16 || block_frames > 65535) {
+        return false;
+    }
+    e->sample_rate = sample_rate;
+    e->channels = channels;
+    e->bits = bits;
+    e->block_frames = block_frames;
+    e->mid = work;
+    e->side = work + block_frames;
+    e->residual[0] = work + 2 * block_frames;
+    e->residual[1] = work + 3 * block_frames;
+    crc_init();
+    return true;
+}
+
+void flac_enc_reset(flac_enc_t *e) {
+    e->frame_number = 0;
+}
+
+// Which of the fixed polynomial predictors, orders 0 to 4, leaves the
+// smallest residual, judged by the sum of its magnitudes. All five are
+// worked out together, each as the difference of the one before.
+static unsigned fixed_best_order(const int32_t *x, uint32_t n, uint64_t *best_sum) {
+    uint64_t sum[5] = { 0 };
+    int32_t e0, e1, e2, e3, e4;
+    int32_t l0 = x[3];
+    int32_t l1 = x[3] - x[2];
+    int32_t l2 = l1 - (x[2] - x[1]);
+    int32_t l3 = l2 - (x[2] - x[1]) + (x[1] - x[0]);
+    unsigned order = 0;
+
+    for (uint32_t i = 4; i < n; i++) {
+        e0 = x[i];
+        e1 = e0 - l0;
+        e2 = e1 - l1;
+        e3 = e2 - l2;
+        e4 = e3 - l3;
+        sum[0] += abs(e0);
+        sum[1] += abs(e1);
+        sum[2] += abs(e2);
+        sum[3] += abs(e3);
+        sum[4] += abs(e4);
+        l0 = e0;
+        l1 = e1;
+        l2 = e2;
+        l3 = e3;
+    }
+    for (unsigned o = 1; o < 5; o++) {
+        if (sum[o] < sum[order]) {
+            order = o;
+        }
+    }
+    *best_sum = sum[order];
+    return order;
+}
+
+static void fixed_residual(const int32_t *x, uint32_t n, unsigned order, int32_t *res) {
+    switch (order) {
+    case 0:
+        memcpy(res, x, n * sizeof *x);
+        break;
+    case 1:
+        for (uint32_t i = 1; i < n; i++) {
+            res[i] = x[i] - x[i-1];
+        }
+        break;
+    case 2:
+        for (uint32_t i = 2; i < n; i++) {
+            res[i] = x[i] - 2 * x[i-1] + x[i-2];
+        }
+        break;
+    case 3:
+        for (uint32_t i = 3; i < n; i++) {
+            res[i] = x[i] - 3 * x[i-1] + 3 * x[i-2] - x[i-3];
+        }
+        break;
+    default:
+        for (uint32_t i = 4; i < n; i++) {
+            res[i] = x[i] - 4 * x[i-1] + 6 * x[i-2] - 4 * x[i-3] + x[i-4];
+        }
+        break;
+    }
+}
+
+// Best Rice parameter for a partition whose zigzagged residuals add up to
+// sum, and the bits it would take. count * (k + 1) + (sum >> k) is never
+// less than the real size, as sum >> k is at least the sum of the
+// quotients.
+static unsigned rice_param(uint64_t sum, uint32_t count, uint64_t *bits) {
+    unsigned k = 0, best;
+    uint64_t best_bits = UINT64_MAX;
+
+    while (k < 30 && ((uint64_t)count << (k + 1)) <= sum) {
+        k++;
+    }
+    best = k;
+    for (unsigned t = k > 0 ? k - 1 : 0; t <= k + 1 && t <= 30; t++) {
+        uint64_t b = (uint64_t)count * (t + 1) + (sum >> t);
+        if (b < best_bits) {
+            best_bits = b;
+            best = t;
+        }
+    }
+    *bits = best_bits;
+    return best;
+}
+
+// Choose the partition order and parameters to Rice code res[order..n-1],
+// and return how many bits the residual section would take, at most.
+// Sums for the finest partitioning are worked out once, and then merged
+// in pairs for each coarser one.
+static uint64_t rice_plan(flac_enc_t *e, const int32_t *res, uint32_t n, unsigned order,
+    flac_rice_t *plan) {
+    unsigned pmax = FLAC_MAX_PARTITION_ORDER;
+    uint64_t best = UINT64_MAX;
+    flac_rice_t trial;
+
+    while (pmax > 0 && ((n & ((1u << pmax) - 1)) != 0 || (n >> pmax) <= order)) {
+        pmax--;
+    }
+    for (unsigned j = 0; j < (1u << pmax); j++) {
+        uint32_t end = (j + 1) * (n >> pmax);
+        uint64_t sum = 0;
+
+        for (uint32_t i = j == 0 ? order : j * (n >> pmax); i < end; i++) {
+            sum += zigzag(res[i]);
+        }
+        e->sums[j] = sum;
+    }
+
+    for (int p = pmax; p >= 0; p--) {
+        unsigned parts = 1u << p;
+        uint64_t bits = 2 + 4, param_bits;
+        unsigned kmax = 0;
+
+        trial.porder = p;
+        for (unsigned j = 0; j < parts; j++) {
+            uint32_t count = (n >> p) - (j == 0 ? order : 0);
+            trial.k[j] = rice_param(e->sums[j], count, &param_bits);
+            bits += param_bits;
+            if (trial.k[j] > kmax) {
+                kmax = trial.k[j];
+            }
+        }
+        trial.rice2 = kmax > 14;
+        bits += parts * (trial.rice2 ? 5 : 4);
+        if (bits < best) {
+            best = bits;
+            plan->porder = trial.porder;
+            plan->rice2 = trial.rice2;
+            memcpy(plan->k, trial.k, parts);
+        }
+        for (unsigned j = 0; j < parts / 2; j++) {
+            e->sums[j] = e->sums[2 * j] + e->sums[2 * j + 1];
+        }
+    }
+    return best;
+}
+
+static void put_residual(bitw_t *w, const int32_t *res, uint32_t n, unsigned order,
+    const flac_rice_t *plan) {
+    unsigned parts = 1u << plan->porder;
+    uint32_t i = order;
+
+    put_bits(w, plan->rice2, 2);
+    put_bits(w, plan->porder, 4);
+    for (unsigned j = 0; j < parts; j++) {
+        uint32_t end = (j + 1) * (n >> plan->porder);
+        unsigned k = plan->k[j];
+
+        put_bits(w, k, plan->rice2 ? 5 : 4);
+        for (; i < end; i++) {
+            put_rice(w, zigzag(res[i]), k);
+        }
+    }
+}
+
+// Work out quantized LPC coefficients for x. The autocorrelation is taken
+// in integers, with the block scaled down so each product fits 32 bits;
+// the order is whichever the Levinson recursion suggests will take the
+// fewest bits. Returns the order, or 0 if prediction isn't worth trying.
+static unsigned lpc_coefs(const int32_t *x, uint32_t n, unsigned bps, unsigned precision,
+    int32_t *qlp, int *shift_out) {
+    int64_t autoc[FLAC_MAX_LPC_ORDER + 1] = { 0 };
+    float lpc[FLAC_MAX_LPC_ORDER][FLAC_MAX_LPC_ORDER];
+    float err[FLAC_MAX_LPC_ORDER + 1];
+    float a[FLAC_MAX_LPC_ORDER], tmp[FLAC_MAX_LPC_ORDER];
+    unsigned max_order = FLAC_MAX_LPC_ORDER, order = 0;
+    uint32_t peak = 0;
+    unsigned scale = 0;
+    float best_bits, cmax = 0, qerr = 0;
+    int log2cmax, shift;
+    int32_t qmax = (1 << (precision - 1)) - 1;
+
+    if (n <= 2 * max_order) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t m = abs(x[i]);
+        if (m > peak) {
+            peak = m;
+        }
+    }
+    while ((peak >> scale) >= (1u << 15)) {
+        scale++;
+    }
+    for (unsigned lag = 0; lag <= max_order; lag++) {
+        int64_t sum = 0;
+        for (uint32_t i = lag; i < n; i++) {
+            sum += (int32_t)((x[i] >> scale) * (x[i - lag] >> scale));
+        }
+        autoc[lag] = sum;
+    }
+    if (autoc[0] == 0) {
+        return 0;
+    }
+
+    // Levinson-Durbin: a[] predicts x[i] as the sum of a[j] * x[i-1-j]
+    err[0] = (float)autoc[0];
+    for (unsigned i = 0; i < max_order; i++) {
+        float r = (float)autoc[i + 1];
+        float k;
+
+        for (unsigned j = 0; j < i; j++) {
+            r -= a[j] * (float)autoc[i - j];
+        }
+        k = r / err[i];
+        for (unsigned j = 0; j < i; j++) {
+            tmp[j] = a[j] - k * a[i - 1 - j];
+        }
+        memcpy(a, tmp, i * sizeof *a);
+        a[i] = k;
+        err[i + 1] = err[i] * (1 - k * k);
+        memcpy(lpc[i], a, (i + 1) * sizeof *a);
+        if (err[i + 1] <= 0) {
+            max_order = i + 1;
+            break;
+        }
+    }
+
+    // Expected bits: about half of log2 of the residual energy per sample,
+    // plus the warm-up samples and coefficients
+    best_bits = (float)n * bps;
+    for (unsigned o = 1; o <= max_order; o++) {
+        float e = err[o] > 1 ? err[o] / n : 1;
+        float per_sample = 0.5f * log2f(e) + scale;
+        float bits = (n - o) * (per_sample > 0 ? per_sample : 0) + o * (bps + precision);
+        if (bits < best_bits) {
+            best_bits = bits;
+            order = o;
+        }
+    }
+    if (order == 0) {
+        return 0;
+    }
+
+    // Quantize to precision bits with the largest shift that fits, carrying
+    // the rounding error from each coefficient into the next
+    for (unsigned j = 0; j < order; j++) {
+        if (fabsf(lpc[order - 1][j]) > cmax) {
+            cmax = fabsf(lpc[order - 1][j]);
+        }
+    }
+    if (cmax <= 0) {
+        return 0;
+    }
+    frexpf(cmax, &log2cmax);
+    shift = (int)precision - 1 - log2cmax;
+    if (shift > 15) {
+        shift = 15;
+    }
+    if (shift < 0) {
+        return 0;
+    }
+    for (unsigned j = 0; j < order; j++) {
+        int32_t q;
+        qerr += lpc[order - 1][j] * (float)(1 << shift);
+        q = lroundf(qerr);
+        if (q > qmax) {
+            q = qmax;
+        } else if (q < -qmax - 1) {
+            q = -qmax - 1;
+        }
+        qlp[j] = q;
+        qerr -= q;
+    }
+    *shift_out = shift;
+    return order;
+}
+
+// Residual of the LPC prediction, as the decoder will make it. Returns
+// false if any of it is too big to Rice code.
+static bool lpc_residual(const int32_t *x, uint32_t n, unsigned bps, unsigned precision,
+    const int32_t *qlp, unsigned order, int shift, int32_t *res) {
+    const int32_t limit = 1 << 30;
+
+    if (bps + precision <= 29) {
+        // Each sum fits in 32 bits
+        for (uint32_t i = order; i < n; i++) {
+            int32_t sum = 0;
+            for (unsigned j = 0; j < order; j++) {
+                sum += qlp[j] * x[i - 1 - j];
+            }
+            res[i] = x[i] - (sum >> shift);
+            if (res[i] >= limit || res[i] <= -limit) {
+                return false;
+            }
+        }
+    } else {
+        for (uint32_t i = order; i < n; i++) {
+            int64_t sum = 0;
+            int64_t r;
+            for (unsigned j = 0; j < order; j++) {
+                sum += (int64_t)qlp[j] * x[i - 1 - j];
+            }
+            r = x[i] - (sum >> shift);
+            if (r >= limit || r <= -limit) {
+                return false;
+            }
+            res[i] = r;
+        }
+    }
+    return true;
+}
+
+// Encode one channel of a block, as whichever of constant, verbatim,
+// fixed and LPC prediction takes the fewest bits
+static void put_subframe(flac_enc_t *e, bitw_t *w, const int32_t *x, uint32_t n,
+    unsigned bps, unsigned fixed_order) {
+    unsigned precision = bps <= 17 ? 12 : 14;
+    int32_t qlp[FLAC_MAX_LPC_ORDER];
+    unsigned lpc_order;
+    int shift = 0;
+    uint64_t verbatim_bits = (uint64_t)n * bps;
+    uint64_t fixed_bits = UINT64_MAX, lpc_bits = UINT64_MAX;
+    uint32_t i;
+
+    for (i = 1; i < n && x[i] == x[0]; i++) {
+    }
+    if (i == n) {
+        put_bits(w, 0x00, 8);
+        put_signed(w, x[0], bps);
+        return;
+    }
+
+    if (n > FLAC_MAX_LPC_ORDER) {
+        fixed_residual(x, n, fixed_order, e->residual[0]);
+        fixed_bits = fixed_order * bps
+            + rice_plan(e, e->residual[0], n, fixed_order, &e->rice[0]);
+        lpc_order = lpc_coefs(x, n, bps, precision, qlp, &shift);
+        if (lpc_order > 0
+            && lpc_residual(x, n, bps, precision, qlp, lpc_order, shift, e->residual[1])) {
+            lpc_bits = lpc_order * (bps + precision) + 4 + 5
+                + rice_plan(e, e->residual[1], n, lpc_order, &e->rice[1]);
+        }
+    }
+
+    if (lpc_bits < fixed_bits && lpc_bits < verbatim_bits) {
+        put_bits(w, (0x20 | (lpc_order - 1)) << 1, 8);
+        for (i = 0; i < lpc_order; i++) {
+            put_signed(w, x[i], bps);
+        }
+        put_bits(w, precision - 1, 4);
+        put_signed(w, shift, 5);
+        for (i = 0; i < lpc_order; i++) {
+            put_signed(w, qlp[i], precision);
+        }
+        put_residual(w, e->residual[1], n, lpc_order, &e->rice[1]);
+    } else if (fixed_bits < verbatim_bits) {
+        put_bits(w, (0x08 | fixed_order) << 1, 8);
+        for (i = 0; i < fixed_order; i++) {
+            put_signed(w, x[i], bps);
+        }
+        put_residual(w, e->residual[0], n, fixed_order, &e->rice[0]);
+    } else {
+        put_bits(w, 0x01 << 1, 8);
+        for (i = 0; i < n; i++) {
+            put_signed(w, x[i], bps);
+        }
+    }
+}
+
+static unsigned block_size_code(uint32_t n) {
+    if (n == 192) {
+        return 1;
+    }
+    for (unsigned c = 2; c <= 5; c++) {
+        if (n == 576u << (c - 2)) {
+            return c;
+        }
+    }
+    for (unsigned c = 8; c <= 15; c++) {
+        if (n == 256u << (c - 8)) {
+            return c;
+        }
+    }
+    return n <= 256 ? 6 : 7;
+}
+
+static unsigned sample_rate_code(uint32_t rate) {
+    static const uint32_t rates[12] = {
+        0, 88200, 176400, 192000, 8000, 16000, 22050, 24000, 32000, 44100, 48000, 96000
+    };
+
+    for (unsigned c = 1; c < 12; c++) {
+        if (rate == rates[c]) {
+            return c;
+        }
+    }
+    if (rate % 1000 == 0 && rate / 1000 <= 255) {
+        return 12;
+    }
+    return rate <= 65535 ? 13 : 0;
+}
+
+static unsigned sample_size_code(unsigned bits) {
+    switch (bits) {
+    case 8: return 1;
+    case 12: return 2;
+    case 16: return 4;
+    case 20: return 5;
+    case 24: return 6;
+    default: return 0;
+    }
+}
+
+size_t flac_enc_block(flac_enc_t *e, int32_t *const pcm[], uint32_t n, uint8_t *out) {
+    bitw_t w = { out, 0, 0 };
+    unsigned bs_code = block_size_code(n);
+    unsigned sr_code = sample_rate_code(e->sample_rate);
+    unsigned order[4] = { 0 };
+    const int32_t *sub[2] = { pcm[0], e->channels > 1 ? pcm[1] : NULL };
+    unsigned sub_bps[2] = { e->bits, e->bits };
+    unsigned sub_order[2] = { 0, 0 };
+    unsigned assignment = e->channels - 1;  // independent channels
+
+    // Pick the cheapest pair of left, right, mid and side to code a stereo
+    // block with, going by their best fixed predictors
+    if (n > 4) {
+        uint64_t sum[4];
+
+        order[0] = fixed_best_order(pcm[0], n, &sum[0]);
+        if (e->channels == 2) {
+            uint64_t best;
+
+            for (uint32_t i = 0; i < n; i++) {
+                e->mid[i] = (pcm[0][i] + pcm[1][i]) >> 1;
+                e->side[i] = pcm[0][i] - pcm[1][i];
+            }
+            order[1] = fixed_best_order(pcm[1], n, &sum[1]);
+            order[2] = fixed_best_order(e->mid, n, &sum[2]);
+            order[3] = fixed_best_order(e->side, n, &sum[3]);
+            best = sum[0] + sum[1];
+            sub_order[0] = order[0];
+            sub_order[1] = order[1];
+            if (sum[0] + sum[3] < best) {
+                // left, side
+                best = sum[0] + sum[3];
+                assignment = 8;
+                sub[1] = e->side;
+                sub_bps[1] = e->bits + 1;
+                sub_order[1] = order[3];
+            }
+            if (sum[3] + sum[1] < best) {
+                // side, right
+                best = sum[3] + sum[1];
+                assignment = 9;
+                sub[0] = e->side;
+                sub[1] = pcm[1];
+                sub_bps[0] = e->bits + 1;
+                sub_bps[1] = e->bits;
+                sub_order[0] = order[3];
+                sub_order[1] = order[1];
+            }
+            if (sum[2] + sum[3] < best) {
+                // mid, side
+                assignment = 10;
+                sub[0] = e->mid;
+                sub[1] = e->side;
+                sub_bps[0] = e->bits;
+                sub_bps[1] = e->bits + 1;
+                sub_order[0] = order[2];
+                sub_order[1] = order[3];
+            }
+        } else {
+            sub_order[0] = order[0];
+        }
+    }
+
+    // Frame header, fixed block size
+    put_bits(&w, 0xfff8, 16);
+    put_bits(&w, bs_code, 4);
+    put_bits(&w, sr_code, 4);
+    put_bits(&w, assignment, 4);
+    put_bits(&w, sample_size_code(e->bits), 3);
+    put_bits(&w, 0, 1);
+    put_utf8(&w, e->frame_number);
+    if (bs_code == 6) {
+        put_bits(&w, n - 1, 8);
+    } else if (bs_code == 7) {
+        put_bits(&w, n - 1, 16);
+    }
+    if (sr_code == 12) {
+        put_bits(&w, e->sample_rate / 1000, 8);
+    } else if (sr_code == 13) {
+        put_bits(&w, e->sample_rate, 16);
+    }
+    put_bits(&w, crc8(out, w.p - out), 8);
+
+    for (unsigned c = 0; c < e->channels; c++) {
+        put_subframe(e, &w, sub[c], n, sub_bps[c], sub_order[c]);
+    }
+    put_align(&w);
+    put_bits(&w, crc16(out, w.p - out), 16);
+
+    e->frame_number++;
+    return w.p - out;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+size_t flac_enc_header(const flac_enc_t *e, uint64_t total_frames,
+    const char *const tags[], unsigned num_tags, uint8_t *out, size_t size) {
+    bitw_t w = { out, 0, 0 };
+    size_t comment_bytes = 4 + strlen(VENDOR_STRING) + 4;
+    uint8_t *p;
+
+    for (unsigned i = 0; i < num_tags; i++) {
+        comment_bytes += 4 + strlen(tags[i]);
+    }
+    if (FLAC_STREAMINFO_BYTES + (num_tags > 0 ? 4 + comment_bytes : 0) > size) {
+        return 0;
+    }
+
+    memcpy(w.p, "fLaC", 4);
+    w.p += 4;
+    put_bits(&w, num_tags == 0, 1);
+    put_bits(&w, 0, 7);                         // STREAMINFO
+    put_bits(&w, 34, 24);
+    put_bits(&w, e->block_frames, 16);          // smallest block, bar the last
+    put_bits(&w, e->block_frames, 16);          // largest block
+    put_bits(&w, 0, 24);                        // smallest frame, not known
+    put_bits(&w, 0, 24);                        // largest frame, not known
+    put_bits(&w, e->sample_rate, 20);
+    put_bits(&w, e->channels - 1, 3);
+    put_bits(&w, e->bits - 1, 5);
+    put_bits(&w, (uint32_t)(total_frames >> 32) & 0xf, 4);
+    put_bits(&w, (uint32_t)total_frames, 32);
+    memset(w.p, 0, 16);                         // MD5 of the audio, not known
+    w.p += 16;
+    if (num_tags == 0) {
+        return w.p - out;
+    }
+
+    // VORBIS_COMMENT, whose lengths are little-endian
+    put_bits(&w, 1, 1);
+    put_bits(&w, 4, 7);
+    put_bits(&w, comment_bytes, 24);
+    p = w.p;
+    put_le32(p, strlen(VENDOR_STRING));
+    memcpy(p + 4, VENDOR_STRING, strlen(VENDOR_STRING));
+    p += 4 + strlen(VENDOR_STRING);
+    put_le32(p, num_tags);
+    p += 4;
+    for (unsigned i = 0; i < num_tags; i++) {
+        put_le32(p, strlen(tags[i]));
+        memcpy(p + 4, tags[i], strlen(tags[i]));
+        p += 4 + strlen(tags[i]);
+    }
+    return p - out;
+}
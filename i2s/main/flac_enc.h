@@ -0,0 +1,70 @@
+/* FLAC encoder
+
+   A streaming encoder for fixed-size blocks of integer PCM, small enough
+   for a microcontroller. Channel decorrelation, prediction and Rice coding
+   are integer arithmetic; only the Levinson recursion that turns each
+   block's autocorrelation into LPC coefficients, a few dozen operations
+   per block, is done in single precision. Nothing is allocated per block.
+
+   Format reference: https://xiph.org/flac/format.html
+*/
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FLAC_MAX_CHANNELS       (2)
+#define FLAC_MAX_LPC_ORDER      (8)
+#define FLAC_MAX_PARTITION_ORDER (8)
+#define FLAC_STREAMINFO_BYTES   (4 + 4 + 34)   // "fLaC", block header, STREAMINFO
+
+// Most bytes one FLAC frame of n audio frames can take. Every subframe is
+// at worst stored verbatim, the side channel with one bit more per sample.
+#define FLAC_FRAME_MAX(n, channels, bits) \
+    (18 + (channels) * (1 + ((uint32_t)(n) * ((bits) + 1) + 7) / 8))
+
+// Words of working buffers an encoder of blocks of n frames needs
+#define FLAC_ENC_WORK_WORDS(n)  (4 * (uint32_t)(n))
+
+typedef struct flac_rice {
+    uint8_t porder;             // partition order
+    uint8_t rice2;              // 1 if the parameters need 5 bits
+    uint8_t k[1 << FLAC_MAX_PARTITION_ORDER];
+} flac_rice_t;
+
+typedef struct flac_enc {
+    uint32_t sample_rate;
+    unsigned channels;
+    unsigned bits;              // bits per sample, up to 24
+    uint32_t block_frames;      // frames per block; only a stream's last block may be shorter
+    uint32_t frame_number;      // blocks encoded since flac_enc_reset()
+    int32_t *mid, *side;        // block_frames each
+    int32_t *residual[2];       // candidate residuals, block_frames each
+    flac_rice_t rice[2];        // and how each would be coded
+    uint64_t sums[1 << FLAC_MAX_PARTITION_ORDER];
+} flac_enc_t;
+
+// Set up an encoder, with its working buffers in the caller's work,
+// FLAC_ENC_WORK_WORDS(block_frames) of it. Returns false if the settings
+// are out of range.
+bool flac_enc_init(flac_enc_t *e, int32_t *work, uint32_t sample_rate, unsigned channels,
+    unsigned bits, uint32_t block_frames);
+
+// Start a new stream: frame numbers start again from 0
+void flac_enc_reset(flac_enc_t *e);
+
+// Encode one block of frames (at most block_frames) as a FLAC frame. pcm
+// holds a pointer to each channel's samples, which are left alone. out
+// must have room for FLAC_FRAME_MAX(frames, channels, bits) bytes. Returns
+// the number of bytes written.
+size_t flac_enc_block(flac_enc_t *e, int32_t *const pcm[], uint32_t frames, uint8_t *out);
+
+// Write the start of a FLAC file: the "fLaC" marker, STREAMINFO for
+// total_frames frames (0 if not known yet), and a VORBIS_COMMENT block
+// holding tags, each "NAME=value", if there are any. The size only depends
+// on the tags, so the header can be rewritten in place once the total is
+// known. Returns the number of bytes written, or 0 if it needs more than
+// size bytes.
+size_t flac_enc_header(const flac_enc_t *e, uint64_t total_frames,
+    const char *const tags[], unsigned num_tags, uint8_t *out, size_t size);
@@ -0,0 +1,105 @@
+/* IMA-ADPCM encoder
+
+*/
+#include "ima_adpcm.h"
+
+static const int16_t step_table[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+    19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+    130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+    876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+    5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t index_table[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+void ima_adpcm_init(ima_adpcm_t *e, unsigned channels, uint32_t block_bytes) {
+    e->channels = channels;
+    e->block_bytes = block_bytes;
+    e->block_frames = IMA_ADPCM_BLOCK_FRAMES(block_bytes, channels);
+    for (unsigned c = 0; c < IMA_ADPCM_MAX_CHANNELS; c++) {
+        e->index[c] = 0;
+    }
+}
+
+// The quantiser works out each bit of the code from the top down, adding
+// up the difference the decoder will reconstruct as it goes, so encoder
+// and decoder track the same prediction without a multiply or divide.
+// Each bit is a mask rather than a branch: the bits of real audio are
+// close to random, so branches on them are mispredicted about half the
+// time on a CPU that predicts, and stall either way on one that doesn't.
+// Prediction and step index stay in registers for a channel's group.
+void ima_adpcm_block(ima_adpcm_t *e, const int16_t *pcm, uint8_t *out) {
+    const unsigned channels = e->channels;
+    const uint32_t groups = (e->block_frames - 1) / 8;
+    int32_t pred[IMA_ADPCM_MAX_CHANNELS];
+    int32_t index[IMA_ADPCM_MAX_CHANNELS];
+
+    // Block header: the first frame goes in as it is
+    for (unsigned c = 0; c < channels; c++) {
+        pred[c] = pcm[c];
+        index[c] = e->index[c];
+        out[0] = (uint8_t)pcm[c];
+        out[1] = (uint8_t)((uint16_t)pcm[c] >> 8);
+        out[2] = index[c];
+        out[3] = 0;
+        out += 4;
+    }
+    pcm += channels;
+
+    for (uint32_t g = 0; g < groups; g++) {
+        for (unsigned c = 0; c < channels; c++) {
+            const int16_t *s = pcm + c;
+            int32_t p = pred[c];
+            int32_t i = index[c];
+            uint32_t word = 0;
+
+            for (unsigned k = 0; k < 8; k++) {
+                int32_t step = step_table[i];
+                int32_t diff = *s - p;
+                int32_t sign = diff >> 31;          // -1 if negative, else 0
+                int32_t delta = step >> 3;
+                int32_t ge;                         // -1 if diff >= step, else 0
+                uint32_t code = sign & 8;
+
+                s += channels;
+                diff = (diff ^ sign) - sign;
+                ge = (step - 1 - diff) >> 31;
+                code |= ge & 4;
+                diff -= step & ge;
+                delta += step & ge;
+                step >>= 1;
+                ge = (step - 1 - diff) >> 31;
+                code |= ge & 2;
+                diff -= step & ge;
+                delta += step & ge;
+                step >>= 1;
+                ge = (step - 1 - diff) >> 31;
+                code |= ge & 1;
+                delta += step & ge;
+
+                p += (delta ^ sign) - sign;
+                p = p > 32767 ? 32767 : p < -32768 ? -32768 : p;
+                i += index_table[code & 7];
+                i = i < 0 ? 0 : i > 88 ? 88 : i;
+                word |= code << (4 * k);
+            }
+            out[0] = word;
+            out[1] = word >> 8;
+            out[2] = word >> 16;
+            out[3] = word >> 24;
+            out += 4;
+            pred[c] = p;
+            index[c] = i;
+        }
+        pcm += 8 * channels;
+    }
+
+    for (unsigned c = 0; c < channels; c++) {
+        e->index[c] = index[c];
+    }
+}
@@ -0,0 +1,38 @@
+/* IMA-ADPCM encoder
+
+   Encodes 16-bit PCM as 4-bit IMA-ADPCM, in the block layout of WAV
+   format 0x11 (Microsoft's "IMA ADPCM"). Each block starts with a 4-byte
+   header per channel, holding its first sample and step index, followed
+   by the rest of its samples at 4 bits each, low nibble first, in groups
+   of 8 samples (4 bytes) per channel in turn. Blocks are coded on their
+   own, bar the step index, which carries over from the block before.
+
+   Format reference: IMA Digital Audio Focus and Technical Working Groups,
+   "Recommended Practices for Enhancing Digital Audio Compatibility in
+   Multimedia Systems", rev. 3.00, 1992, and Microsoft's "Multimedia
+   Standards Update", rev. 3.0, 1994 (the WAV layout).
+*/
+#pragma once
+
+#include <stdint.h>
+
+#define IMA_ADPCM_MAX_CHANNELS  (2)
+
+// Frames in a block of block_bytes. block_bytes must be a multiple of
+// 4 * channels, so every channel's samples fill whole groups of 8.
+#define IMA_ADPCM_BLOCK_FRAMES(block_bytes, channels) \
+    (((block_bytes) / (channels) - 4) * 2 + 1)
+
+typedef struct ima_adpcm {
+    unsigned channels;
+    uint32_t block_bytes;
+    uint32_t block_frames;
+    uint8_t index[IMA_ADPCM_MAX_CHANNELS];  // step index each channel carries into the next block
+} ima_adpcm_t;
+
+// Set up an encoder for blocks of block_bytes
+void ima_adpcm_init(ima_adpcm_t *e, unsigned channels, uint32_t block_bytes);
+
+// Encode one block of block_frames frames of interleaved pcm into
+// block_bytes at out. A short last block must be padded out by the caller.
+void ima_adpcm_block(ima_adpcm_t *e, const int16_t *pcm, uint8_t *out);
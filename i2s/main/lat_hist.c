@@ -0,0 +1,116 @@
+/* Latency histograms
+
+*/
+#include <inttypes.h>
+#include <time.h>
+#include "lat_hist.h"
+
+
+unsigned lat_hist_bucket(uint32_t us) {
+    unsigned b = 0;
+
+    while (us > 1 && b < LAT_HIST_BUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    return b;
+}
+
+void lat_hist_record(lat_hist_t *hist, lat_stall_log_t *stalls, uint8_t op,
+    int64_t when, uint32_t us) {
+
+    atomic_fetch_add_explicit(&hist->count[lat_hist_bucket(us)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->total_us, us, memory_order_relaxed);
+    // Single recorder, so there's no race between the load and the store
+    if (us > atomic_load_explicit(&hist->max_us, memory_order_relaxed)) {
+        atomic_store_explicit(&hist->max_us, us, memory_order_relaxed);
+    }
+
+    if (us >= LAT_STALL_US && stalls != NULL) {
+        unsigned n = atomic_load_explicit(&stalls->count, memory_order_relaxed);
+        lat_stall_t *e = &stalls->entry[n & (LAT_STALL_LOG - 1)];
+        unsigned seq = atomic_load_explicit(&e->seq, memory_order_relaxed);
+
+        // A reader that sees the same even seq either side of its copy got
+        // a consistent entry
+        atomic_store_explicit(&e->seq, seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        e->when = when;
+        e->us = us;
+        e->op = op;
+        atomic_store_explicit(&e->seq, seq + 2, memory_order_release);
+        atomic_store_explicit(&stalls->count, n + 1, memory_order_release);
+    }
+}
+
+uint32_t lat_hist_percentile(lat_hist_t *hist, unsigned pct) {
+    uint64_t total = 0, seen = 0;
+    unsigned b;
+
+    for (b = 0; b < LAT_HIST_BUCKETS; b++) {
+        total += atomic_load_explicit(&hist->count[b], memory_order_relaxed);
+    }
+    if (total == 0) {
+        return 0;
+    }
+    for (b = 0; b < LAT_HIST_BUCKETS - 1; b++) {
+        seen += atomic_load_explicit(&hist->count[b], memory_order_relaxed);
+        if (seen * 100 >= total * pct) {
+            break;
+        }
+    }
+    return (2u << b) - 1;
+}
+
+void lat_hist_reset(lat_hist_t *hist) {
+    for (unsigned b = 0; b < LAT_HIST_BUCKETS; b++) {
+        atomic_store_explicit(&hist->count[b], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&hist->total_us, 0, memory_order_relaxed);
+    atomic_store_explicit(&hist->max_us, 0, memory_order_relaxed);
+}
+
+void lat_hist_dump(FILE *out, const char *name, lat_hist_t *hist) {
+    uint64_t total = 0;
+    unsigned b;
+
+    for (b = 0; b < LAT_HIST_BUCKETS; b++) {
+        total += atomic_load_explicit(&hist->count[b], memory_order_relaxed);
+    }
+    fprintf(out, "%-10s n=%" PRIu64 " mean=%" PRIu64 "us p50<%" PRIu32 "us p99<%" PRIu32
+        "us max=%uus\n",
+        name, total,
+        total ? (uint64_t)atomic_load_explicit(&hist->total_us, memory_order_relaxed) / total : 0,
+        lat_hist_percentile(hist, 50), lat_hist_percentile(hist, 99),
+        atomic_load_explicit(&hist->max_us, memory_order_relaxed));
+    for (b = 0; b < LAT_HIST_BUCKETS; b++) {
+        unsigned n = atomic_load_explicit(&hist->count[b], memory_order_relaxed);
+
+        if (n != 0) {
+            fprintf(out, "  %10uus+ %u\n", b ? 1u << b : 0, n);
+        }
+    }
+}
+
+void lat_stall_dump(FILE *out, lat_stall_log_t *stalls, const char *const *op_names) {
+    unsigned n = atomic_load_explicit(&stalls->count, memory_order_acquire);
+    unsigned i;
+
+    fprintf(out, "stalls     %u of %dms or more\n", n, LAT_STALL_US / 1000);
+    for (i = 0; i < n && i < LAT_STALL_LOG; i++) {
+        lat_stall_t *e = &stalls->entry[(n - 1 - i) & (LAT_STALL_LOG - 1)];
+        unsigned seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+        lat_stall_t copy = { .when = e->when, .us = e->us, .op = e->op };
+        char datetime[32];
+        time_t t;
+
+        atomic_thread_fence(memory_order_acquire);
+        if ((seq & 1) || atomic_load_explicit(&e->seq, memory_order_relaxed) != seq) {
+            continue;       // being overwritten right now
+        }
+        t = copy.when / 1000000;
+        strftime(datetime, sizeof datetime, "%Y%m%d-%H%M%S", gmtime(&t));
+        fprintf(out, "  %s.%06d %-8s %uus\n",
+            datetime, (int)(copy.when % 1000000), op_names[copy.op], copy.us);
+    }
+}
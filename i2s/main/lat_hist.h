@@ -0,0 +1,55 @@
+/* Latency histograms
+
+   Log-bucketed latency histograms, plus a short log of the worst stalls.
+   Recording is lock-free and allocation-free: one task records, and any
+   other task may read at any time. Plain C, so it builds on the host too.
+*/
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Bucket 0 counts latencies under 2us, bucket i counts [2^i, 2^(i+1)) us,
+// and the last bucket counts everything from about 16 s up.
+#define LAT_HIST_BUCKETS    (25)
+
+// Latencies at or above this are stalls, and are logged individually
+#define LAT_STALL_US        (100000)
+#define LAT_STALL_LOG       (8)     // most recent stalls kept, a power of two
+
+typedef struct lat_stall {
+    atomic_uint seq;        // odd while the entry is being written
+    int64_t when;           // wall-clock start of the operation, epoch us
+    uint32_t us;
+    uint8_t op;
+} lat_stall_t;
+
+typedef struct lat_hist {
+    atomic_uint count[LAT_HIST_BUCKETS];
+    atomic_ullong total_us;
+    atomic_uint max_us;
+} lat_hist_t;
+
+typedef struct lat_stall_log {
+    atomic_uint count;      // stalls ever logged
+    lat_stall_t entry[LAT_STALL_LOG];
+} lat_stall_log_t;
+
+unsigned lat_hist_bucket(uint32_t us);
+
+// Add one operation of op that started at when (epoch us) and took us.
+// Only one task may record into a given histogram and stall log.
+void lat_hist_record(lat_hist_t *hist, lat_stall_log_t *stalls, uint8_t op,
+    int64_t when, uint32_t us);
+
+// Upper bound of the bucket holding the pct'th percentile, in us
+uint32_t lat_hist_percentile(lat_hist_t *hist, unsigned pct);
+
+void lat_hist_reset(lat_hist_t *hist);
+
+// Print one line of summary for hist, then its non-empty buckets
+void lat_hist_dump(FILE *out, const char *name, lat_hist_t *hist);
+
+// Print the stall log, newest first, naming ops from op_names
+void lat_stall_dump(FILE *out, lat_stall_log_t *stalls, const char *const *op_names);
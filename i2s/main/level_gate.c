@@ -0,0 +1,112 @@
+/* Level gate
+
+*/
+#include <math.h>
+#include "level_gate.h"
+
+// Two samples per pass, to halve the loop overhead and let the loads of
+// one overlap the arithmetic of the other
+void level_measure_s16(const int16_t *pcm, size_t n, level_t *lv) {
+    uint32_t peak = 0;
+    uint64_t energy = 0;
+
+    for (; n >= 2; n -= 2, pcm += 2) {
+        int32_t a = pcm[0], b = pcm[1];
+        uint32_t ma = a < 0 ? -a : a, mb = b < 0 ? -b : b;
+
+        peak = ma > peak ? ma : peak;
+        peak = mb > peak ? mb : peak;
+        // Each square is under 2^30, so the pair fits in 32 bits
+        energy += (uint32_t)(a * a) + (uint32_t)(b * b);
+    }
+    if (n > 0) {
+        int32_t a = pcm[0];
+        uint32_t ma = a < 0 ? -a : a;
+
+        peak = ma > peak ? ma : peak;
+        energy += (uint32_t)(a * a);
+    }
+    lv->peak = peak;
+    lv->energy = energy;
+}
+
+void level_measure_s24(const uint8_t *pcm, size_t n, level_t *lv) {
+    uint32_t peak = 0;
+    uint64_t energy = 0;
+
+    for (; n > 0; n--, pcm += 3) {
+        int32_t a = (int32_t)((pcm[0] << 8) | (pcm[1] << 16) | ((uint32_t)pcm[2] << 24)) >> 8;
+        uint32_t ma = a < 0 ? -a : a;
+
+        peak = ma > peak ? ma : peak;
+        energy += (uint64_t)((int64_t)a * a);
+    }
+    lv->peak = peak;
+    lv->energy = energy;
+}
+
+void level_gate_init(level_gate_t *g, unsigned channels, unsigned bits, uint32_t block_frames,
+    bool rms, float threshold_dbfs, uint32_t hangover_frames) {
+    float full = (float)((1 << (bits - 1)) - 1);
+    float threshold = full * powf(10.0f, threshold_dbfs / 20.0f);
+
+    g->channels = channels;
+    g->bits = bits;
+    g->block_frames = block_frames;
+    g->rms = rms;
+    g->peak_threshold = (uint32_t)ceilf(threshold);
+    g->energy_threshold = (uint64_t)ceilf(threshold * threshold);
+    g->hangover_frames = hangover_frames;
+    g->open = false;
+    g->close_at = 0;
+}
+
+static bool loud(const level_gate_t *g, const void *pcm, size_t samples) {
+    level_t lv;
+
+    if (g->bits == 16) {
+        level_measure_s16(pcm, samples, &lv);
+    } else {
+        level_measure_s24(pcm, samples, &lv);
+    }
+    return g->rms ? lv.energy >= g->energy_threshold * samples : lv.peak >= g->peak_threshold;
+}
+
+void level_gate_run(level_gate_t *g, uint64_t position, const void *pcm, uint32_t frames,
+    level_span_t *span) {
+    const size_t frame_bytes = g->channels * (g->bits / 8);
+    uint32_t offset = 0;
+
+    span->start = frames;
+    span->end = frames;
+    span->opened = false;
+    span->closed = false;
+    if (g->open) {
+        span->start = 0;
+    }
+
+    while (offset < frames) {
+        uint32_t n = frames - offset < g->block_frames ? frames - offset : g->block_frames;
+
+        // Quiet since close_at, which may be partway through the block
+        // before: close there
+        if (g->open && g->close_at <= position + offset) {
+            break;
+        }
+        if (loud(g, (const uint8_t *)pcm + offset * frame_bytes, n * g->channels)) {
+            if (!g->open) {
+                g->open = true;
+                span->start = offset;
+                span->opened = true;
+            }
+            g->close_at = position + offset + n + g->hangover_frames;
+        }
+        offset += n;
+    }
+
+    if (g->open && g->close_at <= position + frames) {
+        g->open = false;
+        span->end = g->close_at > position + span->start ? g->close_at - position : span->start;
+        span->closed = true;
+    }
+}
@@ -0,0 +1,61 @@
+/* Level gate
+
+   Decides which stretches of the audio are worth recording. The audio is
+   measured in short blocks, by peak or RMS level; the gate opens at the
+   first block that reaches the threshold, and closes once the audio has
+   stayed under it for the hangover time. Measuring a block is one pass
+   over its samples, with no multiplies for peak, and a 32-bit square and
+   64-bit sum for RMS.
+*/
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The level of a block of samples
+typedef struct level {
+    uint32_t peak;              // largest magnitude of any sample
+    uint64_t energy;            // sum of the squares of the samples
+} level_t;
+
+// Measure n samples of 16-bit PCM
+void level_measure_s16(const int16_t *pcm, size_t n, level_t *lv);
+
+// Measure n samples of packed little-endian 24-bit PCM
+void level_measure_s24(const uint8_t *pcm, size_t n, level_t *lv);
+
+typedef struct level_gate {
+    unsigned channels;
+    unsigned bits;              // 16, or 24 packed
+    uint32_t block_frames;      // frames per measurement
+    bool rms;                   // compare RMS rather than peak level
+    uint32_t peak_threshold;    // in sample units
+    uint64_t energy_threshold;  // per sample, squared, in sample units
+    uint32_t hangover_frames;   // quiet frames after the last loud block before it closes
+    bool open;
+    uint64_t close_at;          // while open, the position it closes at unless more is loud
+} level_gate_t;
+
+// What the gate made of the frames it was given: record [start, end) of
+// them. start is 0 unless the gate opened partway in; end is all of them
+// unless it closed partway in. With the gate shut throughout, start and
+// end are both the number of frames.
+typedef struct level_span {
+    uint32_t start;
+    uint32_t end;
+    bool opened;                // the gate opened at start
+    bool closed;                // the gate closed at end
+} level_span_t;
+
+// Set up a shut gate that opens at threshold_dbfs (peak, or RMS, relative
+// to full scale) and closes after hangover_frames quiet frames
+void level_gate_init(level_gate_t *g, unsigned channels, unsigned bits, uint32_t block_frames,
+    bool rms, float threshold_dbfs, uint32_t hangover_frames);
+
+// Run frames frames of interleaved pcm, the first at position in the
+// recording, through the gate, up to where it next closes. Blocks are
+// counted from the start of pcm. If the span closed before the end, call
+// again with what is left to find the next.
+void level_gate_run(level_gate_t *g, uint64_t position, const void *pcm, uint32_t frames,
+    level_span_t *span);
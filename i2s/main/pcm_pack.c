@@ -0,0 +1,49 @@
+/* PCM sample packing
+
+*/
+#include <string.h>
+#include "pcm_pack.h"
+
+// Store one sample's three bytes
+static inline uint8_t *pack_one(uint8_t *p, uint32_t v) {
+    p[0] = v >> 8;
+    p[1] = v >> 16;
+    p[2] = v >> 24;
+    return p + 3;
+}
+
+// Every 4 input samples become exactly 3 output words, so the main loop
+// works a word at a time instead of storing each byte separately. It does
+// 8 samples (6 words) per pass to keep loop overhead down. Word stores
+// fault on Xtensa unless they're aligned, and a read that ends part way
+// through a group of 4 samples leaves the next one's dst unaligned, so up
+// to 3 samples go a byte at a time first, to get dst onto a word.
+void pcm_pack_s32_to_s24(uint8_t *dst, const int32_t *src, size_t n) {
+    const uint32_t *s = (const uint32_t *)src;
+    uint32_t *d;
+
+    while (n > 0 && ((uintptr_t)dst & 3) != 0) {
+        dst = pack_one(dst, *s++);
+        n--;
+    }
+    d = (uint32_t *)dst;
+    while (n >= 8) {
+        uint32_t a = s[0] >> 8, b = s[1] >> 8, c = s[2] >> 8, e = s[3] >> 8;
+        uint32_t f = s[4] >> 8, g = s[5] >> 8, h = s[6] >> 8, i = s[7] >> 8;
+        d[0] = a | (b << 24);
+        d[1] = (b >> 8) | (c << 16);
+        d[2] = (c >> 16) | (e << 8);
+        d[3] = f | (g << 24);
+        d[4] = (g >> 8) | (h << 16);
+        d[5] = (h >> 16) | (i << 8);
+        s += 8;
+        d += 6;
+        n -= 8;
+    }
+
+    // Remaining 0..7 samples, a byte at a time
+    uint8_t *p = (uint8_t *)d;
+    while (n-- > 0) {
+        p = pack_one(p, *s++);
+    }
+}
@@ -0,0 +1,14 @@
+/* PCM sample packing
+
+   Convert samples as they arrive from the I2S DMA into the layout written
+   to the WAV file.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Pack n 32-bit I2S slots, each holding a 24-bit sample in its upper three
+// bytes, into 3n bytes of little-endian 24-bit PCM. dst can be anywhere,
+// but is quickest 4-byte aligned; src and dst must not overlap.
+void pcm_pack_s32_to_s24(uint8_t *dst, const int32_t *src, size_t n);
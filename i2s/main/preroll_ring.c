@@ -0,0 +1,64 @@
+/* Pre-roll ring
+
+*/
+#include <string.h>
+#include "preroll_ring.h"
+
+void preroll_ring_init(preroll_ring_t *r, uint8_t *data, recbuf_desc_t *descs, unsigned slots,
+    size_t slot_bytes) {
+    r->data = data;
+    r->descs = descs;
+    r->slots = slots;
+    r->slot_bytes = slot_bytes;
+    atomic_init(&r->claimed, 0);
+    atomic_init(&r->published, 0);
+}
+
+uint8_t *preroll_ring_claim(preroll_ring_t *r) {
+    unsigned seq = atomic_load_explicit(&r->published, memory_order_relaxed);
+
+    // The claim has to be seen before any of the audio captured over the
+    // slot, as it's what tells a reader its copy may be torn
+    atomic_store_explicit(&r->claimed, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    return r->data + (seq % r->slots) * r->slot_bytes;
+}
+
+void preroll_ring_publish(preroll_ring_t *r, const recbuf_desc_t *d) {
+    unsigned seq = atomic_load_explicit(&r->published, memory_order_relaxed);
+
+    r->descs[seq % r->slots] = *d;
+
+    // Publish the slot contents before the new head
+    atomic_store_explicit(&r->published, seq + 1, memory_order_release);
+}
+
+unsigned preroll_ring_head(preroll_ring_t *r) {
+    return atomic_load_explicit(&r->published, memory_order_acquire);
+}
+
+unsigned preroll_ring_tail(preroll_ring_t *r) {
+    unsigned claimed = atomic_load_explicit(&r->claimed, memory_order_acquire);
+
+    // Slot claimed - 1 is being captured into, over slot claimed - 1 - slots
+    return claimed > r->slots ? claimed - r->slots : 0;
+}
+
+bool preroll_ring_read(preroll_ring_t *r, unsigned seq, recbuf_desc_t *d, void *dest) {
+    unsigned published = atomic_load_explicit(&r->published, memory_order_acquire);
+    unsigned claimed;
+
+    if ((int)(published - seq) <= 0) {
+        return false;
+    }
+    *d = r->descs[seq % r->slots];
+    if (dest != NULL) {
+        memcpy(dest, r->data + (seq % r->slots) * r->slot_bytes, r->slot_bytes);
+    }
+
+    // Check the writer hadn't started on the slot again by the time the
+    // copy was done. If it had, some of the copy may be new audio.
+    atomic_thread_fence(memory_order_acquire);
+    claimed = atomic_load_explicit(&r->claimed, memory_order_relaxed);
+    return claimed - seq <= r->slots;
+}
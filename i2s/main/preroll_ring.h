@@ -0,0 +1,55 @@
+/* Pre-roll ring
+
+   A ring of record-buffer-sized slots that i2s_task captures into over
+   and over, so the last few seconds of audio can always be read back.
+   The writer never waits for a reader: it claims the slot after the last
+   one it filled, whatever is in it, captures into it and publishes it
+   with its descriptor. A reader copies a slot out, then checks that the
+   writer hadn't claimed it again meanwhile, so a copy is either
+   consistent or reported as lost, never torn.
+
+   Slots are numbered by a count of slots ever published, which wraps at
+   2^32 (over a century of one-second slots). One writer; any number of
+   readers.
+*/
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "desc_ring.h"
+
+typedef struct preroll_ring {
+    uint8_t *data;              // slots * slot_bytes of audio, in PSRAM
+    recbuf_desc_t *descs;       // what each slot holds
+    unsigned slots;
+    size_t slot_bytes;
+    atomic_uint claimed;        // slots the writer has started on
+    atomic_uint published;      // slots it has finished
+} preroll_ring_t;
+
+// Start an empty ring of slots slots of slot_bytes each, in the caller's
+// data, slots * slot_bytes of it, with a descriptor for each in descs
+void preroll_ring_init(preroll_ring_t *r, uint8_t *data, recbuf_desc_t *descs, unsigned slots,
+    size_t slot_bytes);
+
+// Writer: claim the next slot to capture into. Readers give up on
+// whatever it held from now on. Claiming again without publishing gives
+// the same slot.
+uint8_t *preroll_ring_claim(preroll_ring_t *r);
+
+// Writer: publish the slot claimed last, holding the audio d describes
+void preroll_ring_publish(preroll_ring_t *r, const recbuf_desc_t *d);
+
+// The number of the next slot to be published; those before it have been
+unsigned preroll_ring_head(preroll_ring_t *r);
+
+// The number of the oldest published slot that can still be read. It
+// moves on as the writer goes round.
+unsigned preroll_ring_tail(preroll_ring_t *r);
+
+// Copy slot seq's descriptor to d and, unless dest is NULL, its audio to
+// dest. Returns false if it isn't published yet, or has been claimed
+// again, in which case what was copied is to be thrown away.
+bool preroll_ring_read(preroll_ring_t *r, unsigned seq, recbuf_desc_t *d, void *dest);
@@ -0,0 +1,90 @@
+/* Raw recording log
+
+   The format SD_RAW records in: audio written straight to a partition of
+   the card set aside for it (MBR type RAW_PART_TYPE), with no filesystem
+   in the way. The partition starts with a superblock saying what the
+   audio is. The rest is divided into slots of segment_sectors sectors,
+   written in turn, round and round, over the oldest audio once the
+   partition is full. Each slot holds one segment: up to a slot's worth of
+   audio that follows on without a break, from the slot's first sector,
+   then in the slot's last sector, the segment's header. The header comes
+   last, once the audio is all written, so the card only ever sees
+   sequential writes, and a segment cut short by a reset just isn't there.
+
+   Each header carries a CRC of its audio, and of itself, and the
+   partition's volume number, which changes each time it is formatted, so
+   a stale segment from before then doesn't count. Segments are numbered
+   in the order they were written; the recorder finds where to carry on by
+   looking for the last one, and ../host/rawextract.c turns a card image
+   back into WAV files.
+
+   Everything on the card is little-endian.
+*/
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RAW_SECTOR_BYTES (512)
+#define RAW_PART_TYPE   (0xda)  // MBR partition type: non-filesystem data
+#define RAW_VERSION     (1)
+
+typedef struct __attribute__((packed)) raw_super {
+    char magic[8];              // "I2SRAWLG"
+    uint32_t version;           // RAW_VERSION
+    uint32_t volume;            // different every time the partition is formatted
+    uint32_t segment_sectors;   // sectors in each slot, the last the segment header
+    uint32_t slots;             // slots in the partition, after the superblock
+    uint32_t sample_rate;
+    uint16_t channels;
+    uint16_t bits;              // per sample, packed: 16 or 24
+    int64_t formatted_us;       // when, in microseconds since the epoch
+    uint32_t crc;               // of everything before it
+} raw_super_t;
+
+typedef struct __attribute__((packed)) raw_seg {
+    char magic[8];              // "I2SRAWSG"
+    uint32_t volume;            // the superblock's
+    uint32_t seq;               // segments written before it since formatting
+    uint32_t boot;              // recorder starts before it since formatting
+    uint32_t take;              // recordings before it since the recorder started
+    uint64_t position;          // its first frame, counted since the recorder started
+    int64_t timestamp_us;       // when that was, in microseconds since the epoch
+    uint32_t frames;            // of audio, from the start of the slot
+    uint32_t data_crc;          // of the audio
+    uint32_t crc;               // of everything before it
+} raw_seg_t;
+
+_Static_assert(sizeof(raw_super_t) <= RAW_SECTOR_BYTES && sizeof(raw_seg_t) <= RAW_SECTOR_BYTES,
+    "raw log headers must fit in a sector");
+
+// CRC-32 (as in zip and PNG) of len bytes of data, carrying on from crc,
+// which starts at 0
+uint32_t raw_crc32(uint32_t crc, const void *data, size_t len);
+
+// Find the first RAW_PART_TYPE partition in the card's MBR, its first
+// sector and length in sectors. Returns false if there isn't one.
+bool raw_partition(const uint8_t mbr[RAW_SECTOR_BYTES], uint64_t *start, uint64_t *sectors);
+
+// Fill in s's magic, version, slots, for a partition of sectors, and CRC,
+// the rest having been set. Returns false if there isn't room for a slot.
+bool raw_super_seal(raw_super_t *s, uint64_t sectors);
+
+// Whether s is a superblock, and one that hasn't been damaged
+bool raw_super_check(const raw_super_t *s);
+
+// Fill in h's magic and CRC, the rest having been set
+void raw_seg_seal(raw_seg_t *h);
+
+// Whether h is an undamaged segment header from the volume s describes.
+// The audio's CRC is for the caller to check, if it wants to.
+bool raw_seg_check(const raw_seg_t *h, const raw_super_t *s);
+
+// Frames of audio a slot holds
+uint32_t raw_seg_frames(const raw_super_t *s);
+
+// A slot's first sector, and the sector its header is in, from the start
+// of the partition
+uint64_t raw_slot_sector(const raw_super_t *s, uint32_t slot);
+uint64_t raw_seg_sector(const raw_super_t *s, uint32_t slot);
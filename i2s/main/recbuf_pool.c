@@ -0,0 +1,79 @@
+/* Record buffer pool
+
+*/
+#include "recbuf_pool.h"
+#include "recorder_hal.h"
+
+unsigned recbuf_pool_init(recbuf_pool_t *p, uint8_t *mem, unsigned mapped, unsigned banked,
+    size_t buf_bytes, recbuf_pool_policy_t policy) {
+    if (mapped > RECBUF_POOL_MAX) {
+        mapped = RECBUF_POOL_MAX;
+    }
+    if (banked > RECBUF_POOL_MAX - mapped) {
+        banked = RECBUF_POOL_MAX - mapped;
+    }
+    p->buf_bytes = buf_bytes;
+    p->buf_banks = (buf_bytes + HAL_BANK_BYTES - 1) / HAL_BANK_BYTES;
+    p->policy = policy;
+    for (p->mapped = 0; p->mapped < mapped; p->mapped++) {
+        p->addr[p->mapped] = mem + p->mapped * buf_bytes;
+    }
+    if (banked > 0 && !hal_bank_init(banked * p->buf_banks, RECBUF_WINDOWS, p->buf_banks)) {
+        banked = 0;
+    }
+    p->count = p->mapped + banked;
+
+    for (int i = 0; i < 2; i++) {
+        desc_ring_init(&p->free[i], p->free_slots[i], RECBUF_POOL_MAX);
+    }
+    for (int w = 0; w < RECBUF_WINDOWS; w++) {
+        p->window_buf[w] = -1;
+        p->window_addr[w] = NULL;
+        p->maps[w] = 0;
+    }
+    for (unsigned i = 0; i < p->count; i++) {
+        recbuf_pool_put(p, RECBUF_WINDOW_CAPTURE, &(recbuf_desc_t){ .buf_index = i });
+    }
+    return p->count;
+}
+
+bool recbuf_pool_get(recbuf_pool_t *p, recbuf_desc_t *d) {
+    return desc_ring_pop(&p->free[0], d) || desc_ring_pop(&p->free[1], d);
+}
+
+void recbuf_pool_put(recbuf_pool_t *p, unsigned window, const recbuf_desc_t *d) {
+    bool banked = d->buf_index >= p->mapped;
+
+    // Whoever takes it next maps it into a window of their own, and a bank
+    // can't be in two windows at once
+    if (banked && p->window_buf[window] == d->buf_index) {
+        recbuf_pool_unmap(p, window);
+    }
+    // Round robin keeps them all in the one ring, in the order they came back
+    desc_ring_push(&p->free[banked && p->policy == RECBUF_POOL_MAPPED_FIRST], d);
+}
+
+unsigned recbuf_pool_free(recbuf_pool_t *p) {
+    return desc_ring_count(&p->free[0]) + desc_ring_count(&p->free[1]);
+}
+
+void *recbuf_pool_map(recbuf_pool_t *p, unsigned window, unsigned index) {
+    if (index < p->mapped) {
+        return p->addr[index];
+    }
+    if (p->window_buf[window] != (int)index) {
+        p->window_addr[window] = hal_bank_map(window, (index - p->mapped) * p->buf_banks,
+            p->buf_banks);
+        p->window_buf[window] = p->window_addr[window] != NULL ? (int)index : -1;
+        p->maps[window]++;
+    }
+    return p->window_addr[window];
+}
+
+void recbuf_pool_unmap(recbuf_pool_t *p, unsigned window) {
+    if (p->window_buf[window] >= 0) {
+        hal_bank_unmap(window);
+        p->window_buf[window] = -1;
+        p->window_addr[window] = NULL;
+    }
+}
@@ -0,0 +1,77 @@
+/* Record buffer pool
+
+   The record buffers, wherever they are. The first few are ordinary
+   memory, in the 4 MB of PSRAM mapped into the address space; the rest
+   are in banks of PSRAM beyond it (himem), which a task has to map into
+   a window of its own to get at, through hal_bank_map(). i2s_task maps
+   a buffer into its window to capture into it, and unmaps it before
+   handing it on; the task that empties buffers (sd_task, or flac_task)
+   maps each into its window as it comes to it, and leaves it there until
+   the next one needs the window or the buffer is handed back, so looking
+   at the same buffer again costs nothing.
+
+   A bank switch costs a cache flush, so buffers are handed out from
+   ordinary memory while there are any, and from the banks only once a
+   stalled writer has held on to all of those. While the writer keeps up,
+   nothing is mapped at all.
+
+   Buffers are numbered 0 to count - 1, mapped ones first. Free buffers
+   go round in desc_ring_t rings, as the filled ones do: one task takes
+   them with recbuf_pool_get(), and whichever task has one hands it back
+   with recbuf_pool_put(), usually the one that empties them.
+*/
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "desc_ring.h"
+
+#define RECBUF_POOL_MAX     (64)    // buffers, a power of two
+#define RECBUF_WINDOW_CAPTURE (0)   // i2s_task's window
+#define RECBUF_WINDOW_DRAIN (1)     // the window of the task that empties buffers
+#define RECBUF_WINDOWS      (2)
+
+// Which free buffer recbuf_pool_get() hands out next
+typedef enum recbuf_pool_policy {
+    RECBUF_POOL_MAPPED_FIRST,   // one in ordinary memory if there is one
+    RECBUF_POOL_ROUND_ROBIN,    // the one handed back longest ago, wherever it is
+} recbuf_pool_policy_t;
+
+typedef struct recbuf_pool {
+    unsigned count;             // buffers
+    unsigned mapped;            // how many of them are in ordinary memory
+    size_t buf_bytes;
+    uint32_t buf_banks;         // banks each banked buffer takes up
+    recbuf_pool_policy_t policy;
+    void *addr[RECBUF_POOL_MAX];    // where each mapped buffer is
+    desc_ring_t free[2];        // free buffers, mapped and banked
+    recbuf_desc_t free_slots[2][RECBUF_POOL_MAX];
+    int window_buf[RECBUF_WINDOWS]; // the buffer in each window, or -1
+    void *window_addr[RECBUF_WINDOWS];
+    uint32_t maps[RECBUF_WINDOWS];  // bank switches through each window
+} recbuf_pool_t;
+
+// Set up a pool of buffers of buf_bytes, all free: mapped of them one
+// after another in the caller's mem, and banked ones beyond it. Returns the
+// number of buffers there are, fewer than asked for if there weren't the
+// banks.
+unsigned recbuf_pool_init(recbuf_pool_t *p, uint8_t *mem, unsigned mapped, unsigned banked,
+    size_t buf_bytes, recbuf_pool_policy_t policy);
+
+// Take a free buffer. Returns false if there are none.
+bool recbuf_pool_get(recbuf_pool_t *p, recbuf_desc_t *d);
+
+// Hand d's buffer back, unmapping it from window, the caller's own, if
+// it's there
+void recbuf_pool_put(recbuf_pool_t *p, unsigned window, const recbuf_desc_t *d);
+
+// Free buffers
+unsigned recbuf_pool_free(recbuf_pool_t *p);
+
+// Where buffer index is, mapping it into window if it's banked and isn't
+// there already. Returns NULL if it can't be mapped.
+void *recbuf_pool_map(recbuf_pool_t *p, unsigned window, unsigned index);
+
+// Unmap whatever is in window
+void recbuf_pool_unmap(recbuf_pool_t *p, unsigned window);
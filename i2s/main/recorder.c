@@ -0,0 +1,2298 @@
+/* I2S recorder
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "esp_attr.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "recorder.h"
+#include "recorder_config.h"
+#include "recorder_hal.h"
+#include "pcm_pack.h"
+#include "desc_ring.h"
+#include "evt_log.h"
+#include "flac_enc.h"
+#include "ima_adpcm.h"
+#include "level_gate.h"
+#include "preroll_ring.h"
+#include "raw_log.h"
+#include "recbuf_pool.h"
+#include "wav_repair.h"
+
+
+static const char *TAG = "i2s_recorder";
+
+static hal_task_t sd_task_handle;
+#if SD_FLAC
+static hal_task_t flac_task_handle;
+#endif
+
+static void i2s_task(void * pvParameters);
+static void sd_task(void * pvParameters);
+static void log_task(void * pvParameters);
+#if SD_FLAC
+static void flac_task(void * pvParameters);
+#endif
+static void sd_init(void);
+static esp_err_t i2s_capture(uint8_t *dest, size_t size, size_t *bytes_read, uint32_t timeout_ms);
+#if !SD_RAW
+static void format_timestamp(time_t timestamp, bool seconds, char *datetime, size_t datetime_size);
+static uint64_t file_frames(int64_t timestamp, bool aligned, time_t *start);
+#endif
+
+static desc_ring_t filled_ring;     // filled buffers, i2s_task -> sd_task
+static recbuf_desc_t filled_slots[RING_SIZE];
+static recbuf_pool_t pool;          // the record buffers, and the empty ones, sd_task -> i2s_task
+
+#if SD_FLAC
+// FLAC frames, flac_task -> sd_task, in a pool of their own
+static desc_ring_t coded_ring;      // filled encoded buffers, flac_task -> sd_task
+static desc_ring_t coded_free_ring; // empty encoded buffers, sd_task -> flac_task
+static recbuf_desc_t coded_slots[NUM_CODEDBUFS];
+static recbuf_desc_t coded_free_slots[NUM_CODEDBUFS];
+static flac_enc_t flac;             // only flac_task encodes; sd_task reads its settings
+static int32_t *flac_pcm[NUM_CHANNELS];     // the block flac_task is gathering
+
+_Static_assert(CODEDBUF_SIZE >= FLAC_FRAME_MAX(FLAC_BLOCK_FRAMES, NUM_CHANNELS, FILE_BITS_PER_SAMPLE),
+    "RECORDER_CHUNK_SIZE too small to hold a FLAC frame");
+#endif
+
+recbuf_stats_t recbuf_stats;
+sd_stats_t sd_stats;
+lat_hist_t sd_latency[SD_OP_COUNT];
+lat_stall_log_t sd_stalls;
+
+static const char *const sd_op_names[SD_OP_COUNT] = {
+    "open", "header", "prealloc", "write", "sync", "close"
+};
+
+#if SD_FLAC
+static void flac_write(const recbuf_desc_t *m);
+static void flac_emit_block(void);
+static void flac_end_file(bool on_time);
+static void flac_push(void);
+static void sd_write_flac(const recbuf_desc_t *m);
+static void sd_close_flac(int fd, const char *filename, uint64_t frames);
+static bool sd_write_flac_header(int fd, uint64_t frames);
+static void sd_stamp_flac(int64_t first_frame_us);
+#else
+static void sd_write(const recbuf_desc_t *m);
+#if !SD_LEVEL_TRIGGER && !SD_TRIGGER
+static void sd_write_batch(const recbuf_desc_t *m);
+static bool sd_batch_takes(const recbuf_desc_t *run, const recbuf_desc_t *next);
+#endif
+#if SD_LEVEL_TRIGGER
+static void gate_write(const recbuf_desc_t *m);
+static void gate_hold(const recbuf_desc_t *m);
+static void gate_preroll(uint64_t from);
+#endif
+#if SD_SEGMENTS
+static recbuf_desc_t desc_part(const recbuf_desc_t *m, uint32_t from, uint32_t to);
+#endif
+#if SD_TRIGGER
+static void snapshot_run(void);
+static uint64_t trigger_position(uint32_t low);
+#endif
+#if SD_RAW
+static void raw_init(void);
+static void raw_find_end(void);
+static bool raw_read_seg(uint32_t slot, raw_seg_t *h);
+static void raw_put(const uint8_t *src, size_t len);
+static void raw_sectors(const void *src, uint32_t count);
+static void raw_close(void);
+#else
+static void sd_preallocate(int fd, const char *filename, uint64_t size);
+static void sd_close(int fd, const char *filename, uint64_t audio_bytes,
+    const sd_cue_t *cues, uint32_t num_cues, uint32_t gap_frames);
+static bool sd_write_header(int fd, uint64_t audio_bytes, uint32_t trailer_bytes);
+static uint32_t sd_write_cues(int fd, const sd_cue_t *cues, uint32_t num_cues);
+static void sd_stamp_header(int64_t first_frame_us);
+#if SD_RF64 || SD_ADPCM
+static uint64_t wav_frames(uint64_t audio_bytes);
+#endif
+#if SD_ADPCM
+static bool adpcm_write(int fd, const uint8_t *src, uint32_t frames, size_t *written);
+static bool adpcm_put(int fd, uint32_t blocks, size_t *written);
+static bool adpcm_flush(int fd, size_t *written);
+#endif
+#endif
+#endif
+#if !SD_RAW
+static void sd_sync(int fd, const char *filename, uint64_t audio);
+static size_t sd_put(int fd, const void *data, size_t len);
+static int sd_open(const char *filename);
+#endif
+static void sd_timed(sd_op_t op, int64_t start_us);
+#if !SD_TRIGGER
+static int acquire_buffer(void);
+static uint32_t discard_buffer(void);
+#endif
+
+// structure of a WAV file header
+// WAV header spec information:
+//https://web.archive.org/web/20140327141505/https://ccrma.stanford.edu/courses/422/projects/WaveFormat/
+//http://www.topherlee.com/software/pcm-tut-wavformat.html
+// Broadcast WAV bext chunk, EBU Tech 3285:
+//https://tech.ebu.ch/docs/tech/tech3285.pdf
+// RF64, EBU Tech 3306:
+//https://tech.ebu.ch/docs/tech/tech3306v1_1.pdf
+
+// Written as a JUNK chunk, which readers skip, and turned into ds64 in
+// place if the file outgrows the 32-bit RIFF sizes.
+typedef struct __attribute__((packed)) ds64_chunk {
+    char ds64_header[4]; // Contains "JUNK", or "ds64" once the file is RF64
+    uint32_t ds64_chunk_size; // 28
+    uint64_t riff_size; // The real wav_size
+    uint64_t data_size; // The real data_bytes
+    uint64_t sample_count; // Frames in the file
+    uint32_t table_length; // 0, no other chunk sizes in the table
+} ds64_chunk;
+
+typedef struct __attribute__((packed)) bext_chunk {
+    char bext_header[4]; // Contains "bext"
+    uint32_t bext_chunk_size; // 602, the size of the rest of the chunk
+    char description[256]; // Free text, NUL padded like the rest
+    char originator[32]; // Who made it: CONFIG_RECORDER_NAME
+    char originator_reference[32]; // Unique to the file: recorder name and start time
+    char origination_date[10]; // yyyy-mm-dd, UTC
+    char origination_time[8]; // hh:mm:ss, UTC
+    uint32_t time_reference_low; // First frame, counted in frames since midnight UTC
+    uint32_t time_reference_high;
+    uint16_t version; // 1
+    uint8_t umid[64];
+    uint8_t reserved[190];
+} bext_chunk;
+_Static_assert(sizeof(bext_chunk) == 8 + 602, "bext chunk must be 602 bytes");
+// originator_reference holds the name, a dash and a 14-digit date and time
+_Static_assert(sizeof(CONFIG_RECORDER_NAME) <= 17, "CONFIG_RECORDER_NAME longer than 16 characters");
+
+typedef struct __attribute__((packed)) wav_header {
+    // RIFF Header
+    char riff_header[4]; // Contains "RIFF"
+    uint32_t wav_size; // Size of the wav portion of the file, which follows the first 8 bytes. File size - 8
+    char wave_header[4]; // Contains "WAVE"
+
+#if SD_RF64
+    // Room for RF64 sizes, if they turn out to be needed
+    ds64_chunk ds64;
+#endif
+
+#if SD_BWF
+    // Broadcast WAV extension, when the recording started
+    bext_chunk bext;
+#endif
+    
+    // Format Header
+    char fmt_header[4]; // Contains "fmt " (includes trailing space)
+    uint32_t fmt_chunk_size; // Should be 16 for PCM
+    uint16_t audio_format; // Should be 1 for PCM. 3 for IEEE Float
+    uint16_t num_channels;
+    uint32_t sample_rate;
+    uint32_t byte_rate; // Number of bytes per second. sample_rate * num_channels * Bytes Per Sample
+    uint16_t sample_alignment; // num_channels * Bytes Per Sample
+    uint16_t bit_depth; // Number of bits per sample
+#if SD_ADPCM
+    uint16_t extra_size; // 2, the bytes of format-specific fields that follow
+    uint16_t samples_per_block; // Frames in each block
+
+    // Fact chunk, which compressed formats need for the length in frames
+    char fact_header[4]; // Contains "fact"
+    uint32_t fact_chunk_size; // 4
+    uint32_t sample_length; // Frames in the file
+#endif
+    
+    // Data
+    char data_header[4]; // Contains "data"
+    uint32_t data_bytes; // Number of bytes in data. Number of samples * num_channels * sample byte size
+    // uint8_t bytes[]; // Remainder of wave file is bytes
+} wav_header;
+
+#if !SD_FLAC && !SD_RAW
+// Everything in the header that is the same for every file. sd_task copies
+// it to file_hdr for each new file and fills in the rest.
+static const wav_header wav_hdr = {
+    .riff_header = "RIFF", 
+    .wav_size = 0, 
+    .wave_header = "WAVE", 
+#if SD_RF64
+    .ds64 = {
+        .ds64_header = "JUNK",
+        .ds64_chunk_size = sizeof(ds64_chunk) - 8,
+    },
+#endif
+#if SD_BWF
+    .bext = {
+        .bext_header = "bext",
+        .bext_chunk_size = sizeof(bext_chunk) - 8,
+        .description = "I2S recorder",
+        .originator = CONFIG_RECORDER_NAME,
+        .version = 1,
+    },
+#endif
+    .fmt_header = "fmt ", 
+    .num_channels = NUM_CHANNELS, 
+    .sample_rate = SAMPLE_RATE, 
+#if SD_ADPCM
+    .fmt_chunk_size = 20, 
+    .audio_format = 0x11, 
+    .byte_rate = (uint64_t)SAMPLE_RATE*ADPCM_BLOCK_BYTES/ADPCM_BLOCK_FRAMES, 
+    .sample_alignment = ADPCM_BLOCK_BYTES, 
+    .bit_depth = 4, 
+    .extra_size = 2, 
+    .samples_per_block = ADPCM_BLOCK_FRAMES, 
+    .fact_header = "fact", 
+    .fact_chunk_size = 4, 
+#else
+    .fmt_chunk_size = 16, 
+    .audio_format = 1, 
+    .byte_rate = SAMPLE_RATE*FRAME_BYTES, 
+    .sample_alignment = FRAME_BYTES, 
+    .bit_depth = FILE_BITS_PER_SAMPLE, 
+#endif
+    .data_header = "data", 
+    .data_bytes = 0
+};
+
+// Header of the file sd_task has open
+static wav_header file_hdr;
+#if SD_PREALLOCATE
+static uint64_t file_prealloc_bytes;    // what sd_preallocate() grew it to
+#endif
+
+_Static_assert(SD_RF64 || DATA_BYTES(FRAMES_PER_FILE) < UINT32_MAX - 4096,
+    "Files this long need SD_RF64");
+_Static_assert(!SD_RF64 || sizeof(off_t) >= 8,
+    "SD_RF64 needs a 64-bit off_t; newlib's on the ESP32 stops at 2 GB");
+
+#if SD_ADPCM
+_Static_assert(FILE_BITS_PER_SAMPLE == 16, "SD_ADPCM encodes 16-bit audio");
+_Static_assert(ADPCM_BLOCK_BYTES % (4 * NUM_CHANNELS) == 0,
+    "ADPCM_BLOCK_BYTES must be whole groups of 8 samples per channel");
+
+// Most blocks one record buffer's frames can complete, written in one go
+#define ADPCM_OUT_BLOCKS (RECBUF_FRAMES / ADPCM_BLOCK_FRAMES + 1)
+
+// sd_task's ADPCM encoder. A record buffer doesn't hold whole blocks, so
+// the frames at the end of each wait in pcm for the rest of their block.
+static struct {
+    ima_adpcm_t enc;
+    int16_t *pcm;           // one block of frames
+    uint32_t pending;       // frames waiting in pcm
+    uint32_t padding;       // frames padding out the open file's last block, once it's written
+    uint8_t *out;           // ADPCM_OUT_BLOCKS blocks
+} adpcm;
+#endif
+#endif
+#if SD_FLAC && SD_ADPCM
+#error "SD_FLAC and SD_ADPCM don't mix"
+#endif
+
+#if SD_RAW
+#if SD_FLAC || SD_ADPCM
+#error "SD_RAW records PCM only"
+#endif
+#define RAW_SEGMENT_SECTORS (RAW_SEGMENT_BYTES / RAW_SECTOR_BYTES)
+_Static_assert(RAW_SEGMENT_SECTORS >= 2, "RAW_SEGMENT_BYTES too small for a segment");
+
+// The log sd_task records into, on the card's raw partition. A segment
+// is written into its slot as the audio comes, whole sectors straight from
+// the record buffers; a part sector at the end of a buffer waits in stage
+// for the rest of it.
+static struct {
+    bool ready;             // the log was found, or made, at start-up
+    uint64_t start;         // the partition's first sector
+    raw_super_t super;
+    uint32_t slot;          // the slot being written
+    raw_seg_t seg;          // the header of the segment in it so far, no frames if none
+    uint32_t sectors;       // sectors of audio written into the slot
+    uint32_t staged;        // bytes waiting in stage
+    uint8_t stage[RAW_SECTOR_BYTES];
+    bool started;           // next_position is where the next buffer should start
+    uint64_t next_position;
+} raw;
+#endif
+
+#if SD_LEVEL_TRIGGER
+#if SD_FLAC
+#error "SD_LEVEL_TRIGGER works with WAV files only"
+#endif
+_Static_assert(LEVEL_PREROLL_BUFS <= NUM_RECBUFS - 2,
+    "LEVEL_PREROLL_MS leaves i2s_task too few record buffers");
+
+// The level gate, and the buffers sd_task holds back while it's shut,
+// oldest first, the first of them possibly only the end of a buffer
+static level_gate_t gate;
+static recbuf_desc_t preroll[LEVEL_PREROLL_BUFS];
+static unsigned preroll_count;
+static uint64_t preroll_frames;     // frames in them
+#endif
+
+#if SD_TRIGGER
+#if SD_FLAC || SD_LEVEL_TRIGGER
+#error "SD_TRIGGER works with WAV files only, and not with SD_LEVEL_TRIGGER"
+#endif
+_Static_assert(TRIGGER_PREROLL_FRAMES <= (uint64_t)(TRIGGER_RING_SLOTS - 2) * RECBUF_FRAMES,
+    "TRIGGER_RING_BYTES too small for TRIGGER_PREROLL_MS");
+
+// The ring i2s_task captures into. Triggers are counted, and the latest
+// one's frame kept, to 32 bits, for sd_task to take up.
+static preroll_ring_t capture_ring;
+static atomic_uint trigger_count;
+static atomic_uint trigger_frame;
+static atomic_uint trigger_taken;       // trigger_count as sd_task last saw it
+static atomic_bool snapshot_active;     // sd_task is writing a snapshot
+#endif
+
+// Everything the recorder works in, sized from the configuration when it's
+// built, so that nothing is allocated once it's running, and a
+// configuration that doesn't fit fails to link rather than at boot. The
+// audio is in PSRAM (CONFIG_SPIRAM_ALLOW_BSS_SEG_EXTERNAL_MEMORY); task
+// stacks have to be in internal RAM.
+static EXT_RAM_ATTR struct {
+#if SD_TRIGGER
+    uint8_t capture[TRIGGER_RING_SLOTS][RECBUF_SIZE];
+    recbuf_desc_t capture_descs[TRIGGER_RING_SLOTS];
+    uint8_t recbufs[1][RECBUF_SIZE];
+#else
+    uint8_t recbufs[MAPPED_RECBUFS][RECBUF_SIZE];
+#endif
+#if SD_FLAC
+    uint8_t coded[NUM_CODEDBUFS][CODEDBUF_SIZE];
+    int32_t flac_pcm[NUM_CHANNELS][FLAC_BLOCK_FRAMES];
+    int32_t flac_work[FLAC_ENC_WORK_WORDS(FLAC_BLOCK_FRAMES)];
+#endif
+#if SD_ADPCM
+    int16_t adpcm_pcm[ADPCM_BLOCK_FRAMES * NUM_CHANNELS];
+    uint8_t adpcm_out[ADPCM_OUT_BLOCKS * ADPCM_BLOCK_BYTES];
+#endif
+    evt_rec_t events[EVT_LOG_SIZE];
+} arena;
+
+// In PSRAM, the arena shares the mapped 4 MB with the himem windows,
+// which take CONFIG_SPIRAM_BANKSWITCH_RESERVE banks of its address space,
+// and with whatever else is placed there or left to the PSRAM heap. The
+// host build's arena is ordinary memory, and its simulators make it big.
+#if CONFIG_SPIRAM_ALLOW_BSS_SEG_EXTERNAL_MEMORY
+#ifdef CONFIG_SPIRAM_BANKSWITCH_RESERVE
+#define HIMEM_WINDOW_BYTES  (CONFIG_SPIRAM_BANKSWITCH_RESERVE * HAL_BANK_BYTES)
+#else
+#define HIMEM_WINDOW_BYTES  (0)
+#endif
+#define PSRAM_SPARE_BYTES   (64*1024)
+_Static_assert(sizeof arena + HIMEM_WINDOW_BYTES + PSRAM_SPARE_BYTES <= HAL_MAPPED_PSRAM_BYTES,
+    "The arena doesn't fit in mapped PSRAM next to the himem windows; "
+    "lower RECORDER_NUM_CHUNKS or CONFIG_SPIRAM_BANKSWITCH_RESERVE");
+#endif
+
+static struct {
+    uint8_t sd[SD_TASK_STACK];
+#if SD_FLAC
+    uint8_t flac[FLAC_TASK_STACK];
+#endif
+    uint8_t i2s[I2S_TASK_STACK];
+    uint8_t log[LOG_TASK_STACK];
+} stacks;
+
+// Buffers sit back to back, so each has to leave the next word aligned
+_Static_assert(RECBUF_SIZE % 4 == 0 && CODEDBUF_SIZE % 4 == 0,
+    "RECORDER_CHUNK_SIZE has to be whole words of whole frames");
+
+
+
+
+void recorder_start(void)
+{
+    // Filenames are in Universal Coordinated Time. Set it once here, so that
+    // formatting a filename doesn't have to.
+    setenv("TZ", "UTC", 1);
+    tzset();
+
+#if SD_TRIGGER
+    // Audio is captured into the ring instead, and copied out of it into
+    // the one record buffer to be written
+    preroll_ring_init(&capture_ring, arena.capture[0], arena.capture_descs, TRIGGER_RING_SLOTS,
+        RECBUF_SIZE);
+    recbuf_pool_init(&pool, arena.recbufs[0], 1, 0, RECBUF_SIZE, RECBUF_POOL_MAPPED_FIRST);
+    ESP_LOGI(TAG, "Pre-roll ring of %d x %d bytes at %p", TRIGGER_RING_SLOTS, RECBUF_SIZE,
+        capture_ring.data);
+#else
+    // The record buffers, in PSRAM, with any in himem after them, all on
+    // the free list to start with. A buffer index is owned by exactly one
+    // of: the free list, i2s_task, the filled ring, sd_task.
+    if (recbuf_pool_init(&pool, arena.recbufs[0], MAPPED_RECBUFS, HIMEM_RECBUFS, RECBUF_SIZE,
+            RECBUF_POOL_MAPPED_FIRST) < NUM_RECBUFS) {
+        ESP_LOGE(TAG, "Failed to reserve himem record buffers, only got %u.", pool.count);
+    }
+    ESP_LOGI(TAG, "%u record buffers of %d bytes, %u of them in himem", pool.count, RECBUF_SIZE,
+        pool.count - pool.mapped);
+#endif
+    ESP_LOGI(TAG, "Arena of %u bytes, and %u of task stacks", (unsigned)sizeof arena,
+        (unsigned)sizeof stacks);
+
+    evt_log_init(arena.events);
+
+    // Set up the filled ring, which is big enough to take every buffer
+    _Static_assert(NUM_RECBUFS <= RING_SIZE && NUM_RECBUFS <= RECBUF_POOL_MAX,
+        "RING_SIZE too small");
+    desc_ring_init(&filled_ring, filled_slots, RING_SIZE);
+
+#if SD_FLAC
+    // The same again for encoded audio, plus the encoder and its block
+    desc_ring_init(&coded_ring, coded_slots, NUM_CODEDBUFS);
+    desc_ring_init(&coded_free_ring, coded_free_slots, NUM_CODEDBUFS);
+    for (uint8_t i=0; i<NUM_CODEDBUFS; i++) {
+        recbuf_desc_t d = { .buf_index = i };
+        desc_ring_push(&coded_free_ring, &d);
+    }
+    for (int c=0; c<NUM_CHANNELS; c++) {
+        flac_pcm[c] = arena.flac_pcm[c];
+    }
+    if (!flac_enc_init(&flac, arena.flac_work, SAMPLE_RATE, NUM_CHANNELS, FILE_BITS_PER_SAMPLE, FLAC_BLOCK_FRAMES)) {
+        ESP_LOGE(TAG, "Failed to set up the FLAC encoder.");
+    }
+#endif
+#if SD_ADPCM
+    // The encoder's staging block and output, in PSRAM like the audio
+    adpcm.pcm = arena.adpcm_pcm;
+    adpcm.out = arena.adpcm_out;
+    ima_adpcm_init(&adpcm.enc, NUM_CHANNELS, ADPCM_BLOCK_BYTES);
+#endif
+#if SD_LEVEL_TRIGGER
+    level_gate_init(&gate, NUM_CHANNELS, FILE_BITS_PER_SAMPLE, LEVEL_BLOCK_FRAMES, LEVEL_RMS,
+        LEVEL_THRESHOLD_DBFS, (uint64_t)LEVEL_HANGOVER_MS * SAMPLE_RATE / 1000);
+#endif
+
+    // Create two tasks on different cores:
+    // 1. Dedicated to writing data to SD card, lower priority
+    // 2. Dedicated to reading data from I2S, higher priority
+    // sd_task goes first, so i2s_task always has a handle to notify.
+    // log_task prints their events when there is nothing better to do.
+    // With SD_FLAC, flac_task sits between the two, sharing sd_task's core,
+    // which spends most of its time waiting on the card.
+    sd_task_handle = hal_task_create(sd_task, "sd_task", stacks.sd, sizeof stacks.sd, NULL, 1,
+        PRO_CPU);
+#if SD_FLAC
+    flac_task_handle = hal_task_create(flac_task, "flac_task", stacks.flac, sizeof stacks.flac,
+        NULL, 1, PRO_CPU);
+#endif
+    hal_task_create(i2s_task, "i2s_task", stacks.i2s, sizeof stacks.i2s, NULL, 2, APP_CPU);
+    hal_task_create(log_task, "log_task", stacks.log, sizeof stacks.log, NULL, 0, PRO_CPU);
+}
+
+// Print the events that i2s_task and sd_task log with evt_log(), stamped
+// with when they happened rather than when they got printed.
+static void log_task(void * pvParameters) {
+    uint32_t reported = 0;
+
+    while (true) {
+        evt_rec_t rec;
+        char text[128];
+
+        while (evt_log_pop(&rec)) {
+            if (evt_log_format(&rec, text, sizeof text)) {
+                ESP_LOGE(TAG, "[%lld.%06d] %s",
+                    (long long)(rec.time_us / 1000000), (int)(rec.time_us % 1000000), text);
+            } else {
+                ESP_LOGI(TAG, "[%lld.%06d] %s",
+                    (long long)(rec.time_us / 1000000), (int)(rec.time_us % 1000000), text);
+            }
+        }
+        if (evt_log_dropped() != reported) {
+            reported = evt_log_dropped();
+            ESP_LOGW(TAG, "Event log full, %u events lost", reported);
+        }
+        // Nothing notifies this task, so this just sleeps
+        hal_task_wait(100);
+    }
+}
+
+static void sd_task(void * pvParameters) {
+    ESP_LOGI(TAG, "sd_task, starting up.");
+
+    sd_init();
+
+    while (true) {
+#if SD_TRIGGER
+        // Nothing comes through the filled ring. Wake for a trigger, and
+        // while a snapshot is being written, for each buffer i2s_task
+        // captures.
+        hal_task_wait(2000);
+        snapshot_run();
+#else
+        recbuf_desc_t m;
+
+#if SD_FLAC
+        // The same as below, but for encoded buffers from flac_task
+        while (!desc_ring_pop(&coded_ring, &m)) {
+            if (!hal_task_wait(2000)) {
+                ESP_LOGI(TAG, "sd_task: nothing in ring.");
+            }
+        }
+        sd_write_flac(&m);
+        desc_ring_push(&coded_free_ring, &m);
+        hal_task_notify(flac_task_handle);
+#else
+        // Take a filled buffer from the ring. If there isn't one, sleep until
+        // i2s_task notifies us, waking every 2 seconds to check anyway.
+        while (!desc_ring_pop(&filled_ring, &m)) {
+            if (!hal_task_wait(2000)) {
+                // There's nothing in the ring, log an info, and try again
+                ESP_LOGI(TAG, "sd_task: nothing in ring.");
+            }
+        }
+
+#if SD_LEVEL_TRIGGER
+        // The gate decides what of it to write, and when to hand it back
+        gate_write(&m);
+#else
+        // Now we have got a buffer, write it to disk, with any waiting
+        // behind it that follow on, then hand them back to i2s_task
+        sd_write_batch(&m);
+#endif
+#endif
+#endif
+    }
+}
+
+#if !SD_FLAC && !SD_LEVEL_TRIGGER && !SD_TRIGGER
+// Write m, then hand its buffer back to i2s_task whether or not the write
+// worked. The free list is as big as the pool, so that can't fail.
+//
+// Once sd_task has fallen behind, the buffers waiting after m in the ring
+// usually hold the audio that follows m's, and are the buffers after m's
+// in memory, as the pool hands out the mapped ones in turn and they sit
+// back to back in the arena. As many of those as fit in SD_BATCH_BYTES
+// are taken too, and written with m as one run, in one write(), which
+// saves the card a command and the filesystem a part-sector for each
+// buffer after the first.
+static void sd_write_batch(const recbuf_desc_t *m) {
+    recbuf_desc_t run = *m;
+    recbuf_desc_t next;
+    uint32_t buffers = 1;
+
+    while (true) {
+        bool taken = false;
+
+        // Only pop if the run could take another buffer, as a buffer popped
+        // is written next either way
+        if ((buffers + 1) * RECBUF_SIZE <= SD_BATCH_BYTES
+            && run.buf_index < pool.mapped && !(run.flags & DESC_FILE_END)
+            && (taken = desc_ring_pop(&filled_ring, &next)) && sd_batch_takes(&run, &next)) {
+            run.frames += next.frames;
+            run.flags |= next.flags;
+            buffers++;
+            continue;
+        }
+        sd_write(&run);
+        if (buffers > 1) {
+            sd_stats.batches++;
+            sd_stats.batched += buffers;
+        }
+        for (uint32_t i = 0; i < buffers; i++) {
+            recbuf_pool_put(&pool, RECBUF_WINDOW_DRAIN,
+                &(recbuf_desc_t){ .buf_index = run.buf_index + i });
+        }
+        if (!taken) {
+            return;
+        }
+        // Waiting, but not part of the run: it starts the next one
+        run = next;
+        buffers = 1;
+    }
+}
+
+// Whether next holds the audio straight after run's, in the same file,
+// straight after it in memory. Only mapped buffers have addresses of their
+// own.
+static bool sd_batch_takes(const recbuf_desc_t *run, const recbuf_desc_t *next) {
+    const uint8_t *end = (const uint8_t *)recbuf_pool_map(&pool, RECBUF_WINDOW_DRAIN,
+        run->buf_index) + (uint64_t)(run->offset + run->frames) * FRAME_BYTES;
+
+    return next->buf_index < pool.mapped && !(next->flags & DESC_FILE_START)
+        && next->position == run->position + run->frames
+        && (const uint8_t *)recbuf_pool_map(&pool, RECBUF_WINDOW_DRAIN, next->buf_index)
+            + next->offset * FRAME_BYTES == end;
+}
+#endif
+
+#if !SD_FLAC && !SD_RAW
+// Write one queued buffer to the current file(s). Files are rotated as
+// file_frames() says, so a buffer that straddles a boundary is split
+// between two files. Files stay open from one buffer to the next.
+//
+// If the buffer doesn't start where the last one ended, the audio in
+// between was lost on the way (DMA overflow, or a buffer dropped for lack
+// of space). Either way everything after the gap stays at the right time,
+// and the gap is marked with a cue point. A short gap is filled with
+// silence. A longer one ends the file, as writing that much silence would
+// only put sd_task further behind, and the next file starts at the time
+// the audio picks up again, with a cue point at its start.
+//
+// A buffer marked DESC_FILE_END ends its file, and whatever comes next
+// has nothing to do with it: the next buffer starts a new file, wherever
+// it starts, named to the second.
+static void sd_write(const recbuf_desc_t *m) {
+    static int fd = -1;
+    static char cur_filename[256];
+    static uint64_t audio_bytes = 0;
+    static uint64_t audio_frames = 0;   // frames so far in the current file
+    static uint64_t frames_left = 0;    // frames still to go in the current file
+    static bool aligned = false;        // true once files start on a boundary
+    static uint32_t unflushed = 0;
+    static uint64_t next_position = 0;  // position the next buffer should start at
+    static bool started = false;
+    static sd_cue_t cues[SD_MAX_CUES];  // dropouts in the current file
+    static uint32_t num_cues = 0;
+    static uint32_t gap_frames = 0;     // frames lost in the current file
+#if !SD_ADPCM
+    static const uint8_t silence[4096];
+#endif
+    const uint8_t *data = recbuf_pool_map(&pool, RECBUF_WINDOW_DRAIN, m->buf_index);
+    uint32_t gap = 0;
+    uint32_t split_gap = 0;             // gap to mark at the start of the next file
+    size_t written;
+    int64_t t;
+
+    if (data == NULL) {
+        // Only if himem has gone wrong. The audio is lost, and will show
+        // up as a gap before the next buffer.
+        ESP_LOGE(TAG, "sd_task: Failed to map record buffer %u", m->buf_index);
+        return;
+    }
+    data += m->offset * FRAME_BYTES;
+
+    if (started && m->position > next_position) {
+        gap = m->position - next_position;
+        sd_stats.gaps++;
+        sd_stats.gap_frames += gap;
+        ESP_LOGW(TAG, "sd_task: %u frames lost before position %llu",
+            gap, (unsigned long long)m->position);
+        if (gap > SD_GAP_FILL_MAX) {
+            if (fd >= 0) {
+                sd_close(fd, cur_filename, audio_bytes, cues, num_cues, gap_frames);
+                fd = -1;
+            }
+            aligned = false;
+            split_gap = gap;
+            gap = 0;
+        }
+    }
+    started = true;
+    next_position = m->position + m->frames;
+
+    // First the gap, if any, then the audio
+    for (int part = 0; part < 2; part++) {
+        const uint8_t *src = part == 0 ? NULL : data;
+        uint32_t frames = part == 0 ? gap : m->frames;
+        int64_t timestamp = m->timestamp - (part == 0 ? (int64_t)gap * 1000000 / SAMPLE_RATE : 0);
+        uint32_t offset = 0;
+
+        while (offset < frames) {
+            uint64_t n;
+
+            // If there's no file open, this is the first frame of a new file,
+            // so work out its name and length, and write a WAV file header.
+            if (fd < 0) {
+                char datetime[32];
+                time_t start;
+
+                frames_left = file_frames(timestamp + (int64_t)offset * 1000000 / SAMPLE_RATE,
+                    aligned, &start);
+                // A file started after a gap shares its minute with the
+                // one before, so it needs the seconds to be told apart, as
+                // do segments, which start anywhere
+                format_timestamp(start, split_gap != 0 || SD_SEGMENTS, datetime,
+                    sizeof datetime);
+                sprintf(cur_filename, "%s/%s.wav", MOUNT_POINT, datetime);
+
+                // New file, truncate it
+                t = hal_uptime_us();
+                fd = sd_open(cur_filename);
+                sd_timed(SD_OP_OPEN, t);
+                if (fd < 0) {
+                    ESP_LOGE(TAG, "sd_task: Failed to open new file, %s", cur_filename);
+                    aligned = false;
+                    return;
+                }
+
+                audio_bytes = 0;
+                audio_frames = 0;
+                unflushed = 0;
+                num_cues = 0;
+                gap_frames = 0;
+                if (split_gap != 0) {
+                    cues[0].frame = 0;
+                    cues[0].frames = split_gap;
+                    num_cues = 1;
+                    gap_frames = split_gap;
+                    split_gap = 0;
+                }
+#if SD_ADPCM
+                adpcm.padding = 0;
+#endif
+                sd_stamp_header(timestamp + (int64_t)offset * 1000000 / SAMPLE_RATE);
+                t = hal_uptime_us();
+                written = sd_put(fd, &file_hdr, sizeof file_hdr);
+                sd_timed(SD_OP_HEADER, t);
+                if (written < sizeof file_hdr) {
+                    ESP_LOGE(TAG, "sd_task: Failed to write WAV header");
+                    close(fd);
+                    fd = -1;
+                    aligned = false;
+                    return;                 
+                } else {
+                    ESP_LOGI(TAG, "sd_task: Wrote WAV header");               
+                }
+#if SD_PREALLOCATE
+                t = hal_uptime_us();
+                sd_preallocate(fd, cur_filename, sizeof wav_hdr + DATA_BYTES(frames_left));
+                sd_timed(SD_OP_PREALLOC, t);
+#endif
+            }
+
+            n = frames - offset;
+            if (n > frames_left) {
+                n = frames_left;
+            }
+
+            if (src == NULL) {
+                // Lost audio. Mark where it goes in this file (a gap that
+                // runs over into the next file is marked in both), then
+                // pad it out.
+                // (Cue points are 32 bits, so one more than 2^32 frames
+                // into an RF64 file can't be marked.)
+                if (num_cues < SD_MAX_CUES && audio_frames <= UINT32_MAX) {
+                    cues[num_cues].frame = audio_frames;
+                    cues[num_cues].frames = n;
+                    num_cues++;
+                }
+                gap_frames += n;
+#if SD_ADPCM
+                if (!adpcm_write(fd, NULL, n, &written)) {
+                    ESP_LOGE(TAG, "sd_task: Failed to write silence");
+                }
+#else
+                written = 0;
+                for (uint64_t left = n * FRAME_BYTES; left > 0; ) {
+                    size_t len = left < sizeof silence ? left : sizeof silence;
+                    size_t done = sd_put(fd, silence, len);
+                    written += done;
+                    if (done < len) {
+                        ESP_LOGE(TAG, "sd_task: Failed to write silence");
+                        break;
+                    }
+                    left -= len;
+                }
+#endif
+            } else {
+                bool ok;
+
+                t = hal_uptime_us();
+#if SD_ADPCM
+                ok = adpcm_write(fd, src + offset * FRAME_BYTES, n, &written);
+#else
+                written = sd_put(fd, src + offset * FRAME_BYTES, n * FRAME_BYTES);
+                ok = written == n * FRAME_BYTES;
+#endif
+                sd_timed(SD_OP_WRITE, t);
+                if (!ok) {
+                    ESP_LOGE(
+                        TAG, 
+                        "sd_task: Failed to write all samples, len=%u, written=%u",
+                        (unsigned)(n * FRAME_BYTES),
+                        (unsigned)written);
+                } else {
+                    evt_log(EVT_SD_WROTE, written, frames_left - n, 0, 0);
+                }
+                sd_stats.frames_written += n;
+            }
+            audio_bytes += written;
+            audio_frames += n;
+            sd_stats.bytes_written += written;
+            frames_left -= n;
+            offset += n;
+
+            // That's the whole of this file, finish it off
+            if (frames_left == 0) {
+                sd_close(fd, cur_filename, audio_bytes, cues, num_cues, gap_frames);
+                fd = -1;
+                aligned = true;
+            }
+        }
+    }
+
+    if (m->flags & DESC_FILE_END) {
+        if (fd >= 0) {
+            sd_close(fd, cur_filename, audio_bytes, cues, num_cues, gap_frames);
+            fd = -1;
+        }
+        aligned = false;
+        started = false;
+        return;
+    }
+
+    // Push what we have so far out to the card every so often, so a reset
+    // loses at most SD_FLUSH_INTERVAL frames of audio.
+    unflushed += gap + m->frames;
+    if (fd >= 0 && unflushed >= SD_FLUSH_INTERVAL) {
+        sd_sync(fd, cur_filename, audio_bytes);
+        unflushed = 0;
+    }
+}
+#endif
+
+#if SD_RAW
+// Write one queued buffer into the raw log. A segment only holds audio
+// that follows on without a break, so a gap ends the one being written,
+// as does a buffer marked DESC_FILE_END, after which the next segment
+// starts a new take. Nothing is filled in: ../host/rawextract.c decides
+// what to do with the gaps when it makes the files.
+static void sd_write(const recbuf_desc_t *m) {
+    const uint8_t *data = recbuf_pool_map(&pool, RECBUF_WINDOW_DRAIN, m->buf_index);
+    uint32_t capacity = raw_seg_frames(&raw.super);
+    uint32_t offset = 0;
+
+    if (!raw.ready) {
+        return;
+    }
+    if (data == NULL) {
+        ESP_LOGE(TAG, "sd_task: Failed to map record buffer %u", m->buf_index);
+        return;
+    }
+    data += m->offset * FRAME_BYTES;
+
+    if (raw.started && m->position > raw.next_position) {
+        uint64_t gap = m->position - raw.next_position;
+        sd_stats.gaps++;
+        sd_stats.gap_frames += gap;
+        ESP_LOGW(TAG, "sd_task: %u frames lost before position %llu",
+            (uint32_t)gap, (unsigned long long)m->position);
+        raw_close();
+    }
+    raw.started = true;
+    raw.next_position = m->position + m->frames;
+
+    while (offset < m->frames) {
+        uint32_t n = m->frames - offset;
+
+        if (raw.seg.frames == 0) {
+            raw.seg.position = m->position + offset;
+            raw.seg.timestamp_us = m->timestamp + (int64_t)offset * 1000000 / SAMPLE_RATE;
+            raw.seg.data_crc = 0;
+        }
+        if (n > capacity - raw.seg.frames) {
+            n = capacity - raw.seg.frames;
+        }
+        raw_put(data + offset * FRAME_BYTES, n * FRAME_BYTES);
+        raw.seg.frames += n;
+        sd_stats.frames_written += n;
+        sd_stats.bytes_written += n * FRAME_BYTES;
+        offset += n;
+        if (raw.seg.frames == capacity) {
+            raw_close();
+        }
+    }
+
+    if (m->flags & DESC_FILE_END) {
+        raw_close();
+        raw.seg.take++;
+        raw.started = false;
+    }
+}
+
+// Add len bytes of audio to the segment being written. Whole sectors go
+// straight to the card; the part sector left over waits in stage.
+static void raw_put(const uint8_t *src, size_t len) {
+    raw.seg.data_crc = raw_crc32(raw.seg.data_crc, src, len);
+    if (raw.staged > 0) {
+        size_t n = RAW_SECTOR_BYTES - raw.staged;
+
+        if (n > len) {
+            n = len;
+        }
+        memcpy(raw.stage + raw.staged, src, n);
+        raw.staged += n;
+        src += n;
+        len -= n;
+        if (raw.staged < RAW_SECTOR_BYTES) {
+            return;
+        }
+        raw_sectors(raw.stage, 1);
+        raw.staged = 0;
+    }
+    if (len >= RAW_SECTOR_BYTES) {
+        uint32_t count = len / RAW_SECTOR_BYTES;
+
+        raw_sectors(src, count);
+        src += (size_t)count * RAW_SECTOR_BYTES;
+        len -= (size_t)count * RAW_SECTOR_BYTES;
+    }
+    memcpy(raw.stage, src, len);
+    raw.staged = len;
+}
+
+// Write count sectors of audio after what's in the slot already
+static void raw_sectors(const void *src, uint32_t count) {
+    uint64_t sector = raw.start + raw_slot_sector(&raw.super, raw.slot) + raw.sectors;
+    int64_t t = hal_uptime_us();
+
+    if (hal_raw_write(sector, src, count) != ESP_OK) {
+        ESP_LOGE(TAG, "sd_task: Failed to write %u sectors at %llu", count,
+            (unsigned long long)sector);
+    } else {
+        evt_log(EVT_SD_WROTE, count * RAW_SECTOR_BYTES,
+            raw_seg_frames(&raw.super) - raw.seg.frames, 0, 0);
+    }
+    sd_timed(SD_OP_WRITE, t);
+    raw.sectors += count;
+}
+
+// Finish the segment being written, if there is one: the last of its
+// audio, padded out to a sector, then its header, in the slot's last
+// sector. The next segment goes in the next slot round.
+static void raw_close(void) {
+    uint64_t sector = raw.start + raw_seg_sector(&raw.super, raw.slot);
+    int64_t t;
+
+    if (raw.seg.frames == 0) {
+        return;
+    }
+    if (raw.staged > 0) {
+        memset(raw.stage + raw.staged, 0, RAW_SECTOR_BYTES - raw.staged);
+        raw_sectors(raw.stage, 1);
+        raw.staged = 0;
+    }
+    raw_seg_seal(&raw.seg);
+    memset(raw.stage, 0, sizeof raw.stage);
+    memcpy(raw.stage, &raw.seg, sizeof raw.seg);
+    t = hal_uptime_us();
+    if (hal_raw_write(sector, raw.stage, 1) != ESP_OK) {
+        ESP_LOGE(TAG, "sd_task: Failed to write the header of segment %u", raw.seg.seq);
+    }
+    sd_timed(SD_OP_HEADER, t);
+    sd_stats.log_segments++;
+
+    raw.slot = (raw.slot + 1) % raw.super.slots;
+    raw.seg.seq++;
+    raw.seg.frames = 0;
+    raw.sectors = 0;
+}
+
+// Start the card, and find the log on it, formatting it if there isn't
+// one, or it's for audio of another format. Then find where to carry on.
+static void raw_init(void) {
+    uint64_t card_sectors, sectors;
+    raw_super_t found;
+
+    if (hal_raw_init(&card_sectors) != ESP_OK) {
+        return;
+    }
+    if (hal_raw_read(0, raw.stage, 1) != ESP_OK
+        || !raw_partition(raw.stage, &raw.start, &sectors)
+        || raw.start + sectors > card_sectors) {
+        ESP_LOGE(TAG, "No partition of type 0x%02x on the card to record to", RAW_PART_TYPE);
+        return;
+    }
+    if (hal_raw_read(raw.start, raw.stage, 1) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read the raw log's superblock");
+        return;
+    }
+    memcpy(&found, raw.stage, sizeof found);
+    raw.super = found;
+    if (!raw_super_check(&found) || found.segment_sectors != RAW_SEGMENT_SECTORS
+        || found.sample_rate != SAMPLE_RATE || found.channels != NUM_CHANNELS
+        || found.bits != FILE_BITS_PER_SAMPLE) {
+        // The volume number only has to differ from the one before
+        memset(&raw.super, 0, sizeof raw.super);
+        raw.super.volume = raw_super_check(&found) ? found.volume + 1 : (uint32_t)hal_time_us();
+        raw.super.segment_sectors = RAW_SEGMENT_SECTORS;
+        raw.super.sample_rate = SAMPLE_RATE;
+        raw.super.channels = NUM_CHANNELS;
+        raw.super.bits = FILE_BITS_PER_SAMPLE;
+        raw.super.formatted_us = hal_time_us();
+        if (!raw_super_seal(&raw.super, sectors)) {
+            ESP_LOGE(TAG, "Raw partition of %llu sectors too small to record to",
+                (unsigned long long)sectors);
+            return;
+        }
+        memset(raw.stage, 0, sizeof raw.stage);
+        memcpy(raw.stage, &raw.super, sizeof raw.super);
+        if (hal_raw_write(raw.start, raw.stage, 1) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to write the raw log's superblock");
+            return;
+        }
+        ESP_LOGI(TAG, "Formatted the raw log, volume %08x, %u slots of %u sectors",
+            raw.super.volume, raw.super.slots, raw.super.segment_sectors);
+    }
+    raw_find_end();
+    raw.ready = true;
+    ESP_LOGI(TAG, "Raw log: carrying on in slot %u of %u, segment %u, boot %u", raw.slot,
+        raw.super.slots, raw.seg.seq, raw.seg.boot);
+}
+
+// Find the slot after the last segment written. From slot 0 up to that
+// one, the segments follow on in sequence; after it, they're from the lap
+// before, or not there, or cut short by a reset. So it can be found by
+// bisection, reading a few dozen headers even on a big card.
+static void raw_find_end(void) {
+    uint32_t slots = raw.super.slots;
+    raw_seg_t first, h;
+    bool any;
+
+    if (raw_read_seg(0, &first)) {
+        uint32_t lo = 0, hi = slots;    // lo follows on from slot 0; hi doesn't, or is the end
+
+        while (hi - lo > 1) {
+            uint32_t mid = lo + (hi - lo) / 2;
+
+            if (raw_read_seg(mid, &h) && h.seq == first.seq + mid) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        any = raw_read_seg(lo, &h);
+        raw.slot = (lo + 1) % slots;
+    } else {
+        // Nothing written yet, or a reset cut short the first slot of a
+        // lap, in which case the last slot holds the segment before
+        any = raw_read_seg(slots - 1, &h);
+        raw.slot = 0;
+    }
+    memset(&raw.seg, 0, sizeof raw.seg);
+    raw.seg.volume = raw.super.volume;
+    raw.seg.seq = any ? h.seq + 1 : 0;
+    raw.seg.boot = any ? h.boot + 1 : 0;
+}
+
+// Read the header in slot's last sector. Returns false unless it's an
+// undamaged one from this volume.
+static bool raw_read_seg(uint32_t slot, raw_seg_t *h) {
+    if (hal_raw_read(raw.start + raw_seg_sector(&raw.super, slot), raw.stage, 1) != ESP_OK) {
+        return false;
+    }
+    memcpy(h, raw.stage, sizeof *h);
+    return raw_seg_check(h, &raw.super);
+}
+#endif
+
+#if SD_LEVEL_TRIGGER
+// Level-activated recording, in front of sd_write(). The gate says which
+// stretches of each buffer to record, and each stretch ends its file.
+// Between stretches, buffers are held back rather than handed straight
+// back to i2s_task, so that when the gate next opens, the
+// LEVEL_PREROLL_FRAMES before it can be written too. Frames the gate
+// leaves out count as gated, until pre-roll brings them back.
+static void gate_write(const recbuf_desc_t *m) {
+    uint32_t offset = 0;    // frames of m the gate has been through
+    uint32_t quiet = 0;     // first frame since the gate last closed
+
+    while (offset < m->frames) {
+        // Writing out the pre-roll can take m's buffer out of the window,
+        // so look it up again each time round
+        const uint8_t *data = recbuf_pool_map(&pool, RECBUF_WINDOW_DRAIN, m->buf_index);
+        level_span_t span;
+        uint32_t from, to;
+
+        if (data == NULL) {
+            ESP_LOGE(TAG, "sd_task: Failed to map record buffer %u", m->buf_index);
+            break;
+        }
+        data += m->offset * FRAME_BYTES;
+        level_gate_run(&gate, m->position + offset, data + offset * FRAME_BYTES,
+            m->frames - offset, &span);
+        from = offset + span.start;
+        to = offset + span.end;
+        if (span.opened) {
+            uint64_t start = m->position + from;
+
+            // Back up by the pre-roll: through the buffers held back, then
+            // the quiet part of this one
+            start = start > LEVEL_PREROLL_FRAMES ? start - LEVEL_PREROLL_FRAMES : 0;
+            gate_preroll(start);
+            from = start > m->position + offset ? start - m->position : offset;
+            sd_stats.segments++;
+        }
+        sd_stats.frames_gated += from - offset;
+        if (to > from) {
+            recbuf_desc_t part = desc_part(m, from, to);
+
+            part.flags = span.closed ? DESC_FILE_END : 0;
+            sd_write(&part);
+        }
+        offset = to;
+        if (span.closed) {
+            quiet = to;
+        }
+    }
+
+    // Hold on to whatever has been quiet since the gate closed, or hand
+    // the buffer back if there's none
+    if (gate.open || quiet == m->frames) {
+        recbuf_pool_put(&pool, RECBUF_WINDOW_DRAIN, m);
+    } else {
+        recbuf_desc_t tail = desc_part(m, quiet, m->frames);
+        gate_hold(&tail);
+    }
+}
+
+// Hold m back as pre-roll, handing back the oldest held buffers that
+// are no longer needed for it. Short buffers, from short reads, can
+// fill preroll before they add up to the pre-roll; then the oldest goes
+// to make room, and the pre-roll comes out shorter.
+static void gate_hold(const recbuf_desc_t *m) {
+    while (preroll_count > 0 && (preroll_count == LEVEL_PREROLL_BUFS
+            || preroll_frames + m->frames - preroll[0].frames >= LEVEL_PREROLL_FRAMES)) {
+        preroll_frames -= preroll[0].frames;
+        recbuf_pool_put(&pool, RECBUF_WINDOW_DRAIN, &preroll[0]);
+        preroll_count--;
+        memmove(preroll, preroll + 1, preroll_count * sizeof preroll[0]);
+    }
+    preroll[preroll_count++] = *m;
+    preroll_frames += m->frames;
+}
+
+// The gate has opened: write out the held buffers from position from on,
+// and hand them all back
+static void gate_preroll(uint64_t from) {
+    for (unsigned i = 0; i < preroll_count; i++) {
+        const recbuf_desc_t *h = &preroll[i];
+
+        if (h->position + h->frames > from) {
+            uint32_t skip = from > h->position ? from - h->position : 0;
+            recbuf_desc_t part = desc_part(h, skip, h->frames);
+
+            sd_stats.frames_gated -= part.frames;
+            sd_write(&part);
+        }
+        recbuf_pool_put(&pool, RECBUF_WINDOW_DRAIN, h);
+    }
+    preroll_count = 0;
+    preroll_frames = 0;
+}
+#endif
+
+#if SD_SEGMENTS
+// Frames [from, to) of m, as a descriptor of their own
+static recbuf_desc_t desc_part(const recbuf_desc_t *m, uint32_t from, uint32_t to) {
+    recbuf_desc_t d = *m;
+
+    d.position += from;
+    d.timestamp += (int64_t)from * 1000000 / SAMPLE_RATE;
+    d.offset += from;
+    d.frames = to - from;
+    d.flags = 0;
+    return d;
+}
+#endif
+
+#if SD_TRIGGER
+// Trigger capture, in place of sd_task's loop over the filled ring. A
+// snapshot runs from TRIGGER_PREROLL_FRAMES before a trigger to
+// TRIGGER_POST_FRAMES after it, and a trigger while one is being written
+// carries it on to TRIGGER_POST_FRAMES after that. Snapshots don't
+// overlap: one triggered within the pre-roll of the end of the last
+// starts where that ended. Each slot of the ring is copied into record
+// buffer 0 and written from there, so a copy i2s_task overwrote meanwhile
+// is caught before it reaches the file. Audio that falls out of the ring
+// before it can be copied is lost, and is a gap in the file.
+static void snapshot_run(void) {
+    static unsigned taken = 0;          // triggers acted on
+    static bool active = false;
+    static unsigned seq;                // the ring slot to copy next
+    static uint64_t next = 0;           // the next frame to write
+    static uint64_t end;                // the frame the snapshot ends at
+    unsigned count = atomic_load_explicit(&trigger_count, memory_order_acquire);
+
+    if (count != taken) {
+        uint64_t at = trigger_position(atomic_load_explicit(&trigger_frame, memory_order_relaxed));
+
+        sd_stats.triggers += count - taken;
+        if (!active) {
+            uint64_t start = at > TRIGGER_PREROLL_FRAMES ? at - TRIGGER_PREROLL_FRAMES : 0;
+
+            next = start > next ? start : next;
+            seq = preroll_ring_tail(&capture_ring);
+            active = true;
+            atomic_store(&snapshot_active, true);
+        }
+        end = at + TRIGGER_POST_FRAMES;
+        taken = count;
+        atomic_store(&trigger_taken, count);
+    }
+
+    while (active) {
+        recbuf_desc_t d;
+        recbuf_desc_t part;
+        uint32_t from, to;
+
+        if ((int)(seq - preroll_ring_tail(&capture_ring)) < 0) {
+            // A whole ring behind: go on from the oldest there is
+            sd_stats.snapshot_overruns++;
+            seq = preroll_ring_tail(&capture_ring);
+        }
+        if (seq == preroll_ring_head(&capture_ring)) {
+            return;
+        }
+        // Look at the descriptor first, to skip what's before the snapshot
+        // without copying it
+        if (!preroll_ring_read(&capture_ring, seq, &d, NULL)
+            || (d.position + d.frames > next && d.position < end
+                && !preroll_ring_read(&capture_ring, seq, &d,
+                    recbuf_pool_map(&pool, RECBUF_WINDOW_DRAIN, 0)))) {
+            continue;
+        }
+        seq++;
+        if (d.position + d.frames <= next) {
+            continue;
+        }
+
+        if (d.position >= end) {
+            // The snapshot ended in a gap: just end the file
+            part = (recbuf_desc_t){ .position = next, .timestamp = d.timestamp };
+            next = end;
+        } else {
+            from = next > d.position ? next - d.position : 0;
+            to = end - d.position < d.frames ? end - d.position : d.frames;
+            part = desc_part(&d, from, to);
+            part.buf_index = 0;
+            next = d.position + to;
+        }
+        if (next >= end) {
+            part.flags = DESC_FILE_END;
+            active = false;
+            sd_stats.snapshots++;
+        }
+        sd_write(&part);
+    }
+    atomic_store(&snapshot_active, false);
+}
+
+// The frame a trigger was at, from the low 32 bits of it that
+// recorder_trigger() left, and the latest audio in the ring, which is
+// well within 2^31 frames of it
+static uint64_t trigger_position(uint32_t low) {
+    recbuf_desc_t d = { 0 };
+    unsigned head = preroll_ring_head(&capture_ring);
+
+    if (head > 0) {
+        preroll_ring_read(&capture_ring, head - 1, &d, NULL);
+    }
+    return d.position + (int32_t)(low - (uint32_t)d.position);
+}
+
+// The trigger is at the frame being captured now, worked out from the
+// latest buffer in the ring, and how long ago its first frame came in
+bool recorder_trigger(void) {
+    recbuf_desc_t d;
+    unsigned head = preroll_ring_head(&capture_ring);
+    uint64_t at;
+
+    if (head == 0 || !preroll_ring_read(&capture_ring, head - 1, &d, NULL)) {
+        return false;
+    }
+    at = d.position + (uint64_t)(hal_time_us() - d.timestamp) * SAMPLE_RATE / 1000000;
+    atomic_store_explicit(&trigger_frame, (uint32_t)at, memory_order_relaxed);
+    atomic_fetch_add_explicit(&trigger_count, 1, memory_order_release);
+    hal_task_notify(sd_task_handle);
+    return true;
+}
+
+bool recorder_trigger_busy(void) {
+    return atomic_load(&trigger_count) != atomic_load(&trigger_taken)
+        || atomic_load(&snapshot_active);
+}
+#else
+bool recorder_trigger(void) {
+    return false;
+}
+
+bool recorder_trigger_busy(void) {
+    return false;
+}
+#endif
+
+#if !SD_RAW
+// How many frames a new file whose first frame was captured at timestamp
+// holds, and the time it starts, for its name. Files are rotated by
+// counting frames, not by the clock: the first file runs up to the next
+// multiple of SD_FILE_SECONDS, to the frame, counting from the microsecond
+// its first frame was captured, not the second, and once files are
+// aligned every one after that starts on a boundary, give or take clock
+// drift, and holds
+// FRAMES_PER_FILE frames. Segments (SD_SEGMENTS) start whenever the audio
+// to keep does, so aren't aligned: each file holds FRAMES_PER_FILE frames
+// from where it starts, and a segment only takes more than one file if it
+// lasts longer than that.
+static uint64_t file_frames(int64_t timestamp, bool aligned, time_t *start) {
+    *start = timestamp / 1000000;
+    if (SD_SEGMENTS) {
+        return FRAMES_PER_FILE;
+    }
+    if (aligned) {
+        *start = (*start + SD_FILE_SECONDS / 2) / SD_FILE_SECONDS * SD_FILE_SECONDS;
+        return FRAMES_PER_FILE;
+    }
+    return FRAMES_PER_FILE
+        - (uint64_t)(timestamp % (SD_FILE_SECONDS * 1000000LL)) * SAMPLE_RATE / 1000000;
+}
+#endif
+
+#if SD_FLAC
+// Encode the audio i2s_task captures into FLAC frames for sd_task. A FLAC
+// frame can't be split between files, so flac_task decides where files
+// start and end, by the same rules as sd_write(), and marks the buffers it
+// hands on to say so.
+static void flac_task(void * pvParameters) {
+    ESP_LOGI(TAG, "flac_task, starting up.");
+
+    while (true) {
+        recbuf_desc_t m;
+
+        while (!desc_ring_pop(&filled_ring, &m)) {
+            if (!hal_task_wait(2000)) {
+                // No audio for 2 seconds. Whatever comes next starts after
+                // a gap, so finish the file off now rather than leave it
+                // open with its last block still here.
+                flac_end_file(false);
+            }
+        }
+        flac_write(&m);
+        recbuf_pool_put(&pool, RECBUF_WINDOW_DRAIN, &m);
+    }
+}
+
+// flac_task's work in progress
+static struct {
+    uint32_t block_fill;        // frames gathered in flac_pcm
+    uint32_t block_silence;     // how many of them fill a gap
+    uint64_t block_position;    // position and time of the block's first frame
+    int64_t block_timestamp;
+    bool in_file;
+    uint64_t frames_left;       // frames still to go in the current file
+    uint8_t file_flags;         // flags for the first buffer of the current file
+    bool aligned;               // true once files start on a boundary
+    bool after_gap;             // the next file starts after a long gap
+    bool out_open;
+    recbuf_desc_t out;          // the encoded buffer being filled
+} encoding;
+
+// Gather one buffer of audio into blocks, encoding each as it fills. Gaps
+// are handled as sd_write() does: filled with silence if short, otherwise
+// the file is ended and the next starts when the audio picks up again.
+// (There's nowhere in a FLAC file to mark a gap, so that is left to the
+// log.)
+static void flac_write(const recbuf_desc_t *m) {
+    static uint64_t next_position = 0;  // position the next buffer should start at
+    static bool started = false;
+    const uint8_t *data = recbuf_pool_map(&pool, RECBUF_WINDOW_DRAIN, m->buf_index);
+    uint32_t gap = 0;
+
+    if (data == NULL) {
+        ESP_LOGE(TAG, "flac_task: Failed to map record buffer %u", m->buf_index);
+        return;
+    }
+
+    if (started && m->position > next_position) {
+        gap = m->position - next_position;
+        sd_stats.gaps++;
+        sd_stats.gap_frames += gap;
+        ESP_LOGW(TAG, "flac_task: %u frames lost before position %llu",
+            gap, (unsigned long long)m->position);
+        if (gap > SD_GAP_FILL_MAX) {
+            flac_end_file(false);
+            gap = 0;
+        }
+    }
+    started = true;
+    next_position = m->position + m->frames;
+
+    // First the gap, if any, then the audio
+    for (int part = 0; part < 2; part++) {
+        uint32_t frames = part == 0 ? gap : m->frames;
+        uint64_t position = m->position - (part == 0 ? gap : 0);
+        int64_t timestamp = m->timestamp - (part == 0 ? (int64_t)gap * 1000000 / SAMPLE_RATE : 0);
+        uint32_t offset = 0;
+
+        while (offset < frames) {
+            int64_t t = timestamp + (int64_t)offset * 1000000 / SAMPLE_RATE;
+            uint32_t n = frames - offset;
+
+            if (!encoding.in_file) {
+                time_t start;
+
+                encoding.frames_left = file_frames(t, encoding.aligned, &start);
+                encoding.file_flags = DESC_FILE_START | (encoding.aligned ? DESC_ALIGNED : 0)
+                    | (encoding.after_gap ? DESC_AFTER_GAP : 0);
+                encoding.in_file = true;
+                flac_enc_reset(&flac);
+            }
+            if (encoding.block_fill == 0) {
+                encoding.block_position = position + offset;
+                encoding.block_timestamp = t;
+            }
+            if (n > encoding.frames_left) {
+                n = encoding.frames_left;
+            }
+            if (n > FLAC_BLOCK_FRAMES - encoding.block_fill) {
+                n = FLAC_BLOCK_FRAMES - encoding.block_fill;
+            }
+
+            // Split the frames into channels, as the encoder wants them
+            for (int c = 0; c < NUM_CHANNELS; c++) {
+                int32_t *dst = flac_pcm[c] + encoding.block_fill;
+                if (part == 0) {
+                    memset(dst, 0, n * sizeof *dst);
+                    continue;
+                }
+#if FILE_BITS_PER_SAMPLE == 24
+                const uint8_t *src = data + (offset * NUM_CHANNELS + c) * 3;
+                for (uint32_t i = 0; i < n; i++, src += FRAME_BYTES) {
+                    dst[i] = (int32_t)((src[0] << 8) | (src[1] << 16) | ((uint32_t)src[2] << 24)) >> 8;
+                }
+#else
+                const int16_t *src = (const int16_t *)data + offset * NUM_CHANNELS + c;
+                for (uint32_t i = 0; i < n; i++, src += NUM_CHANNELS) {
+                    dst[i] = *src;
+                }
+#endif
+            }
+            if (part == 0) {
+                encoding.block_silence += n;
+            }
+            encoding.block_fill += n;
+            encoding.frames_left -= n;
+            offset += n;
+
+            if (encoding.block_fill == FLAC_BLOCK_FRAMES || encoding.frames_left == 0) {
+                flac_emit_block();
+            }
+            if (encoding.frames_left == 0) {
+                flac_end_file(true);
+            }
+        }
+    }
+}
+
+// Encode the gathered block into the encoded buffer, starting another if
+// it might not fit. A buffer goes to sd_task once it holds a record
+// buffer's worth of audio, so no more sits here than would with WAV.
+static void flac_emit_block(void) {
+    const size_t frame_max = FLAC_FRAME_MAX(FLAC_BLOCK_FRAMES, NUM_CHANNELS, FILE_BITS_PER_SAMPLE);
+
+    if (encoding.out_open && CODEDBUF_SIZE - encoding.out.bytes < frame_max) {
+        flac_push();
+    }
+    if (!encoding.out_open) {
+        recbuf_desc_t d;
+
+        // sd_task hands encoded buffers back as it writes them. If it has
+        // fallen behind, wait: meanwhile the record buffers take up the
+        // slack, and i2s_task applies the overrun policy if they run out.
+        while (!desc_ring_pop(&coded_free_ring, &d)) {
+            hal_task_wait(100);
+        }
+        encoding.out = (recbuf_desc_t){
+            .position = encoding.block_position,
+            .timestamp = encoding.block_timestamp,
+            .buf_index = d.buf_index,
+            .flags = encoding.file_flags,
+        };
+        encoding.file_flags = 0;
+        encoding.out_open = true;
+    }
+    encoding.out.bytes += flac_enc_block(&flac, flac_pcm, encoding.block_fill,
+        arena.coded[encoding.out.buf_index] + encoding.out.bytes);
+    encoding.out.frames += encoding.block_fill;
+    encoding.out.silence += encoding.block_silence;
+    encoding.block_fill = 0;
+    encoding.block_silence = 0;
+    if (encoding.out.frames >= RECBUF_FRAMES) {
+        flac_push();
+    }
+}
+
+// End the current file, on time or early, encoding whatever is left of
+// the block as the file's short last frame. Files after one that ended
+// early start wherever the audio picks up again, as with WAV.
+static void flac_end_file(bool on_time) {
+    encoding.aligned = on_time;
+    encoding.after_gap = !on_time;
+    if (!encoding.in_file) {
+        return;
+    }
+    if (encoding.block_fill > 0) {
+        flac_emit_block();
+    }
+    if (!encoding.out_open) {
+        // The file's audio has all gone to sd_task: send the end on its own
+        recbuf_desc_t d;
+        while (!desc_ring_pop(&coded_free_ring, &d)) {
+            hal_task_wait(100);
+        }
+        encoding.out = (recbuf_desc_t){ .buf_index = d.buf_index };
+        encoding.out_open = true;
+    }
+    encoding.out.flags |= DESC_FILE_END;
+    flac_push();
+    encoding.in_file = false;
+}
+
+static void flac_push(void) {
+    // The ring is as big as the pool, so this can't fail
+    desc_ring_push(&coded_ring, &encoding.out);
+    encoding.out_open = false;
+    hal_task_notify(sd_task_handle);
+}
+
+// Write one buffer of FLAC frames from flac_task, starting and finishing
+// files where it says
+static void sd_write_flac(const recbuf_desc_t *m) {
+    static int fd = -1;
+    static char cur_filename[256];
+    static uint64_t frames = 0;         // frames in the current file
+    static uint32_t unflushed = 0;
+    size_t written;
+    int64_t t;
+
+    if (m->flags & DESC_FILE_START) {
+        char datetime[32];
+        time_t start;
+
+        if (fd >= 0) {
+            sd_close_flac(fd, cur_filename, frames);
+        }
+        file_frames(m->timestamp, m->flags & DESC_ALIGNED, &start);
+        format_timestamp(start, m->flags & DESC_AFTER_GAP, datetime, sizeof datetime);
+        sprintf(cur_filename, "%s/%s.flac", MOUNT_POINT, datetime);
+
+        t = hal_uptime_us();
+        fd = sd_open(cur_filename);
+        sd_timed(SD_OP_OPEN, t);
+        if (fd < 0) {
+            ESP_LOGE(TAG, "sd_task: Failed to open new file, %s", cur_filename);
+        } else {
+            bool ok;
+
+            frames = 0;
+            unflushed = 0;
+            sd_stamp_flac(m->timestamp);
+            t = hal_uptime_us();
+            ok = sd_write_flac_header(fd, 0);
+            sd_timed(SD_OP_HEADER, t);
+            if (!ok) {
+                ESP_LOGE(TAG, "sd_task: Failed to write FLAC header");
+                close(fd);
+                fd = -1;
+            }
+        }
+    }
+
+    // Without a file, the rest of this one is lost until the next starts
+    if (fd >= 0 && m->bytes > 0) {
+        t = hal_uptime_us();
+        written = sd_put(fd, arena.coded[m->buf_index], m->bytes);
+        sd_timed(SD_OP_WRITE, t);
+        if (written < m->bytes) {
+            ESP_LOGE(TAG, "sd_task: Failed to write all FLAC frames, len=%u, written=%u",
+                (unsigned)m->bytes, (unsigned)written);
+        } else {
+            evt_log(EVT_SD_WROTE_FLAC, written, m->frames, 0, 0);
+        }
+        sd_stats.bytes_written += written;
+        frames += m->frames;
+        unflushed += m->frames;
+    }
+    sd_stats.frames_written += m->frames - m->silence;
+
+    if (fd >= 0 && (m->flags & DESC_FILE_END)) {
+        sd_close_flac(fd, cur_filename, frames);
+        fd = -1;
+    } else if (fd >= 0 && unflushed >= SD_FLUSH_INTERVAL) {
+        sd_sync(fd, cur_filename, frames);
+        unflushed = 0;
+    }
+}
+
+// The FLAC file's tags, set for each file by sd_stamp_flac(): the same
+// facts as a WAV file's bext chunk
+static char flac_tag_text[3][48];
+static const char *const flac_tags[3] = { flac_tag_text[0], flac_tag_text[1], flac_tag_text[2] };
+
+static void sd_stamp_flac(int64_t first_frame_us) {
+    const int64_t day_us = 86400LL * 1000000;
+    time_t start = first_frame_us / 1000000;
+    uint64_t since_midnight = (uint64_t)(first_frame_us % day_us) * SAMPLE_RATE / 1000000;
+    struct tm timeinfo;
+
+    gmtime_r(&start, &timeinfo);
+    snprintf(flac_tag_text[0], sizeof flac_tag_text[0], "ORIGINATOR=%s", CONFIG_RECORDER_NAME);
+    strftime(flac_tag_text[1], sizeof flac_tag_text[1], "DATE=%Y-%m-%dT%H:%M:%SZ", &timeinfo);
+    snprintf(flac_tag_text[2], sizeof flac_tag_text[2], "TIME_REFERENCE=%llu",
+        (unsigned long long)since_midnight);
+}
+
+// Rewrite the FLAC header at the start of the file, for frames frames. The
+// file position is left just after the header.
+static bool sd_write_flac_header(int fd, uint64_t frames) {
+    uint8_t hdr[FLAC_STREAMINFO_BYTES + 256];
+    size_t len = flac_enc_header(&flac, frames, flac_tags, 3, hdr, sizeof hdr);
+
+    return len > 0 && lseek(fd, 0, SEEK_SET) == 0 && sd_put(fd, hdr, len) == len;
+}
+
+// Finish off a FLAC file: put the number of frames in its header, and
+// close it
+static void sd_close_flac(int fd, const char *filename, uint64_t frames) {
+    int64_t t;
+    bool ok;
+
+    ESP_LOGI(TAG, "sd_task: file: %s, frames: %llu", filename, (unsigned long long)frames);
+    t = hal_uptime_us();
+    ok = sd_write_flac_header(fd, frames);
+    sd_timed(SD_OP_HEADER, t);
+    if (!ok) {
+        ESP_LOGE(TAG, "sd_task: Failed to rewrite FLAC header, %s", strerror(errno));
+    }
+    t = hal_uptime_us();
+    if (close(fd) != 0) {
+        ESP_LOGE(TAG, "sd_task: Failed to close %s, %s", filename, strerror(errno));
+    }
+    sd_stats.files_closed++;
+    sd_timed(SD_OP_CLOSE, t);
+}
+#endif
+
+#if !SD_RAW
+// Flush the open file to the card. In crash safe mode, the header is
+// patched first to cover the audio written so far, so if the recorder is
+// reset before the file is closed, the file still plays up to this point
+// (and sd_init() can tell how much of it is good). audio is the audio
+// written so far: bytes of it in a WAV file, frames in a FLAC file.
+static void sd_sync(int fd, const char *filename, uint64_t audio) {
+    int64_t t;
+#if SD_CRASH_SAFE
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    bool ok;
+
+    t = hal_uptime_us();
+#if SD_FLAC
+    ok = sd_write_flac_header(fd, audio) && lseek(fd, pos, SEEK_SET) == pos;
+#else
+    ok = sd_write_header(fd, audio, 0) && lseek(fd, pos, SEEK_SET) == pos;
+#endif
+    sd_timed(SD_OP_HEADER, t);
+    if (!ok) {
+        ESP_LOGE(TAG, "sd_task: Failed to patch header of %s, %s", filename, strerror(errno));
+    }
+#endif
+    t = hal_uptime_us();
+    if (fsync(fd) != 0) {
+        ESP_LOGE(TAG, "sd_task: Failed to flush %s, %s", filename, strerror(errno));
+    }
+    sd_timed(SD_OP_SYNC, t);
+}
+#endif
+
+#if !SD_FLAC && !SD_RAW
+// Rewrite the WAV header at the start of the file for audio_bytes of audio,
+// followed by trailer_bytes of other chunks. The file position is left just
+// after the header.
+static bool sd_write_header(int fd, uint64_t audio_bytes, uint32_t trailer_bytes) {
+    uint64_t wav_size = sizeof file_hdr - 8 + audio_bytes + trailer_bytes;
+
+    file_hdr.wav_size = wav_size;
+    file_hdr.data_bytes = audio_bytes;
+#if SD_RF64
+    if (wav_size > UINT32_MAX) {
+        // Too big for RIFF: the 32-bit sizes say "see ds64"
+        memcpy(file_hdr.riff_header, "RF64", 4);
+        memcpy(file_hdr.ds64.ds64_header, "ds64", 4);
+        file_hdr.wav_size = UINT32_MAX;
+        file_hdr.data_bytes = UINT32_MAX;
+        file_hdr.ds64.riff_size = wav_size;
+        file_hdr.ds64.data_size = audio_bytes;
+        file_hdr.ds64.sample_count = wav_frames(audio_bytes);
+    }
+#endif
+#if SD_ADPCM
+    file_hdr.sample_length = wav_frames(audio_bytes) < UINT32_MAX ? wav_frames(audio_bytes) : UINT32_MAX;
+#endif
+    return lseek(fd, 0, SEEK_SET) == 0 && sd_put(fd, &file_hdr, sizeof file_hdr) == sizeof file_hdr;
+}
+
+// Start file_hdr for a new file whose first frame was captured at
+// first_frame_us. Only the Broadcast WAV fields differ from file to file.
+static void sd_stamp_header(int64_t first_frame_us) {
+    file_hdr = wav_hdr;
+#if SD_BWF
+    const int64_t day_us = 86400LL * 1000000;
+    time_t start = first_frame_us / 1000000;
+    uint64_t since_midnight = (uint64_t)(first_frame_us % day_us) * SAMPLE_RATE / 1000000;
+    // Room for the name and six fields as wide as any int, though the year
+    // has four digits and the rest two
+    char text[sizeof(CONFIG_RECORDER_NAME) + 1 + 6 * 11];
+    size_t length;
+    struct tm timeinfo;
+
+    gmtime_r(&start, &timeinfo);
+    strftime(text, sizeof text, "%Y-%m-%d", &timeinfo);
+    memcpy(file_hdr.bext.origination_date, text, sizeof file_hdr.bext.origination_date);
+    strftime(text, sizeof text, "%H:%M:%S", &timeinfo);
+    memcpy(file_hdr.bext.origination_time, text, sizeof file_hdr.bext.origination_time);
+    snprintf(text, sizeof text, "%s-%04d%02d%02d%02d%02d%02d", CONFIG_RECORDER_NAME,
+        timeinfo.tm_year + 1900, timeinfo.tm_mon + 1, timeinfo.tm_mday,
+        timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec);
+    length = strlen(text);
+    memcpy(file_hdr.bext.originator_reference, text,
+        length < sizeof file_hdr.bext.originator_reference ? length : sizeof file_hdr.bext.originator_reference);
+    file_hdr.bext.time_reference_low = (uint32_t)since_midnight;
+    file_hdr.bext.time_reference_high = (uint32_t)(since_midnight >> 32);
+#endif
+}
+
+#if SD_RF64 || SD_ADPCM
+// Frames in audio_bytes of the data chunk of the open file, for the
+// headers that count them
+static uint64_t wav_frames(uint64_t audio_bytes) {
+#if SD_ADPCM
+    return audio_bytes / ADPCM_BLOCK_BYTES * ADPCM_BLOCK_FRAMES - adpcm.padding;
+#else
+    return audio_bytes / FRAME_BYTES;
+#endif
+}
+#endif
+
+#if SD_ADPCM
+// Write blocks encoded in adpcm.out to fd, adding the bytes written to
+// written. Returns false if the write came up short.
+static bool adpcm_put(int fd, uint32_t blocks, size_t *written) {
+    size_t done = sd_put(fd, adpcm.out, blocks * ADPCM_BLOCK_BYTES);
+
+    *written += done;
+    return done == blocks * ADPCM_BLOCK_BYTES;
+}
+
+// Encode frames of audio from src, or of silence if src is NULL, and write
+// every block that completes to fd, in as few writes as possible. Whole
+// blocks in src are encoded where they are; only the frames either side
+// go through adpcm.pcm. Sets written to the bytes written, and returns
+// false if any write came up short.
+static bool adpcm_write(int fd, const uint8_t *src, uint32_t frames, size_t *written) {
+    uint32_t blocks = 0;
+    bool ok = true;
+
+    *written = 0;
+    while (frames > 0) {
+        uint32_t n = ADPCM_BLOCK_FRAMES - adpcm.pending;
+        const int16_t *block = adpcm.pcm;
+
+        if (n > frames) {
+            n = frames;
+        }
+        if (n == ADPCM_BLOCK_FRAMES && src != NULL) {
+            block = (const int16_t *)src;
+        } else {
+            uint8_t *dst = (uint8_t *)adpcm.pcm + adpcm.pending * FRAME_BYTES;
+
+            if (src != NULL) {
+                memcpy(dst, src, n * FRAME_BYTES);
+            } else {
+                memset(dst, 0, n * FRAME_BYTES);
+            }
+            adpcm.pending += n;
+        }
+        if (src != NULL) {
+            src += n * FRAME_BYTES;
+        }
+        frames -= n;
+        if (block == adpcm.pcm && adpcm.pending < ADPCM_BLOCK_FRAMES) {
+            break;
+        }
+        adpcm.pending = 0;
+        ima_adpcm_block(&adpcm.enc, block, adpcm.out + blocks * ADPCM_BLOCK_BYTES);
+        if (++blocks == ADPCM_OUT_BLOCKS) {
+            ok = adpcm_put(fd, blocks, written) && ok;
+            blocks = 0;
+        }
+    }
+    if (blocks > 0) {
+        ok = adpcm_put(fd, blocks, written) && ok;
+    }
+    return ok;
+}
+
+// Write out the file's last block, if it has frames waiting, padded out by
+// repeating its last frame. The fact chunk says where the audio really
+// ends; a player that ignores it just hears the last sample held.
+static bool adpcm_flush(int fd, size_t *written) {
+    uint32_t padding = ADPCM_BLOCK_FRAMES - adpcm.pending;
+    int16_t *last;
+
+    *written = 0;
+    if (adpcm.pending == 0) {
+        return true;
+    }
+    last = adpcm.pcm + (adpcm.pending - 1) * NUM_CHANNELS;
+    for (uint32_t i = adpcm.pending; i < ADPCM_BLOCK_FRAMES; i++) {
+        memcpy(adpcm.pcm + i * NUM_CHANNELS, last, FRAME_BYTES);
+    }
+    adpcm.pending = 0;
+    ima_adpcm_block(&adpcm.enc, adpcm.pcm, adpcm.out);
+    if (!adpcm_put(fd, 1, written)) {
+        return false;
+    }
+    adpcm.padding = padding;
+    return true;
+}
+#endif
+
+// Finish off a file: write out the last ADPCM block, mark any dropouts in
+// it after the audio, rewrite its WAV header with the number of bytes in
+// the file, then close it.
+static void sd_close(int fd, const char *filename, uint64_t audio_bytes,
+    const sd_cue_t *cues, uint32_t num_cues, uint32_t gap_frames) {
+    uint32_t trailer_bytes = 0;
+    int64_t t;
+    bool ok;
+
+#if SD_ADPCM
+    size_t written;
+
+    if (!adpcm_flush(fd, &written)) {
+        ESP_LOGE(TAG, "sd_task: Failed to write the last ADPCM block of %s", filename);
+    }
+    audio_bytes += written;
+    sd_stats.bytes_written += written;
+#endif
+    if (num_cues > 0) {
+        ESP_LOGW(TAG, "sd_task: %s: %u dropouts, %u frames (%u ms) lost",
+            filename, num_cues, gap_frames,
+            (uint32_t)((uint64_t)gap_frames * 1000 / SAMPLE_RATE));
+        if (lseek(fd, sizeof wav_hdr + audio_bytes, SEEK_SET) != -1) {
+            trailer_bytes = sd_write_cues(fd, cues, num_cues);
+        }
+        if (trailer_bytes == 0) {
+            ESP_LOGE(TAG, "sd_task: Failed to write cue chunk to %s", filename);
+        }
+    }
+
+    ESP_LOGI(
+        TAG, 
+        "sd_task: file: %s, chunk: %llu, subchunk2: %llu", 
+        filename,
+        (unsigned long long)(sizeof file_hdr - 8 + audio_bytes), 
+        (unsigned long long)audio_bytes
+    );
+    t = hal_uptime_us();
+    ok = sd_write_header(fd, audio_bytes, trailer_bytes);
+    sd_timed(SD_OP_HEADER, t);
+    if (!ok) {
+        ESP_LOGE(
+            TAG, 
+            "sd_task: Failed to rewrite WAV header, %s",
+            strerror(errno));
+    } else {
+        ESP_LOGI(TAG, "sd_task: rewrote WAV header");
+    }
+    t = hal_uptime_us();
+    if (close(fd) != 0) {
+        ESP_LOGE(TAG, "sd_task: Failed to close %s, %s", filename, strerror(errno));
+    }
+    sd_stats.files_closed++;
+#if SD_PREALLOCATE
+    // Give back whatever was preallocated but not written, e.g. after a
+    // failed write. A file that came out full length, as most do, is left
+    // alone: besides the FAT update, ESP-IDF's truncate() borrows a FIL
+    // from the heap.
+    if (sizeof wav_hdr + audio_bytes + trailer_bytes < file_prealloc_bytes
+        && truncate(filename, sizeof wav_hdr + audio_bytes + trailer_bytes) != 0) {
+        ESP_LOGE(TAG, "sd_task: Failed to truncate %s, %s", filename, strerror(errno));
+    }
+#endif
+    sd_timed(SD_OP_CLOSE, t);
+}
+
+// Write a cue chunk with a cue point at the start of each dropout, and an
+// associated data list labelling each one with its length, e.g. "dropout
+// 1024 frames". Returns the number of bytes written, or 0 on failure.
+static uint32_t sd_write_cues(int fd, const sd_cue_t *cues, uint32_t num_cues) {
+    uint8_t chunk[12 + SD_MAX_CUES * 24 + 12 + SD_MAX_CUES * (12 + 32)];
+    uint8_t *p = chunk;
+    uint8_t *list;
+    uint32_t cue_bytes, list_bytes;
+
+    // cue: point id, play order position, "data", chunk and block start of
+    // 0 (there is only one data chunk), and the frame offset within it.
+    cue_bytes = 4 + num_cues * 24;
+    memcpy(p, "cue ", 4);
+    memcpy(p + 4, &cue_bytes, 4);
+    memcpy(p + 8, &num_cues, 4);
+    p += 12;
+    for (uint32_t i = 0; i < num_cues; i++) {
+        uint32_t cue[6] = { i + 1, i + 1, 0, 0, 0, cues[i].frame };
+
+        memcpy(&cue[2], "data", 4);
+        memcpy(p, cue, sizeof cue);
+        p += sizeof cue;
+    }
+
+    // LIST/adtl of labl chunks, each the cue point id and a NUL-terminated
+    // string, padded to an even length
+    list = p;
+    memcpy(p, "LIST", 4);
+    memcpy(p + 8, "adtl", 4);
+    p += 12;
+    for (uint32_t i = 0; i < num_cues; i++) {
+        char label[32] = { 0 };
+        uint32_t id = i + 1;
+        uint32_t label_bytes = 4 + snprintf(label, sizeof label, "dropout %u frames", cues[i].frames) + 1;
+        uint32_t padded = (label_bytes + 1) & ~1u;
+
+        memcpy(p, "labl", 4);
+        memcpy(p + 4, &label_bytes, 4);
+        memcpy(p + 8, &id, 4);
+        memcpy(p + 12, label, padded - 4);
+        p += 8 + padded;
+    }
+    list_bytes = p - list - 8;
+    memcpy(list + 4, &list_bytes, 4);
+
+    // In one write, as stdio would have buffered it
+    return sd_put(fd, chunk, p - chunk) == (size_t)(p - chunk) ? p - chunk : 0;
+}
+#endif
+
+// Record how long an operation that started at start_us took. Stalls are
+// logged with the wall-clock time they started, to line up with dropouts.
+static void sd_timed(sd_op_t op, int64_t start_us) {
+    int64_t us = hal_uptime_us() - start_us;
+
+    lat_hist_record(&sd_latency[op], &sd_stalls, op, hal_time_us() - us,
+        us < UINT32_MAX ? (uint32_t)us : UINT32_MAX);
+}
+
+#if !SD_RAW
+// sd_task writes files through file descriptors rather than stdio, which
+// allocates a FILE and its buffer for every file opened and frees them
+// at fclose(). The recorder's own writes are all big, or header sized,
+// and don't need the buffer. A new WAV file is named in SD_MARKER first,
+// for sd_init() to repair after a reset.
+static int sd_open(const char *filename) {
+    if (!SD_FLAC) {
+        wav_repair_mark(SD_MARKER, filename);
+    }
+    return open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+}
+
+// Write len bytes, as fwrite() would. Returns the number written, fewer
+// only if a write failed.
+//
+// Everything goes through hal_stage, as the arena is in PSRAM, where the
+// card's DMA can't reach. Each piece is copied to the same offset in a
+// word as it has in the file, so the whole sectors FATFS passes straight
+// to the driver are word-aligned, and ends on a sector boundary, so the
+// next one starts with whole sectors.
+static size_t sd_put(int fd, const void *data, size_t len) {
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    size_t done = 0;
+
+    while (pos >= 0 && done < len) {
+        size_t skew = pos % 4;
+        size_t n = HAL_STAGE_BYTES - pos % HAL_SECTOR_BYTES;
+        ssize_t written;
+
+        n = n < len - done ? n : len - done;
+        memcpy(hal_stage + skew, (const uint8_t *)data + done, n);
+        written = write(fd, hal_stage + skew, n);
+        if (written <= 0) {
+            break;
+        }
+        done += written;
+        pos += written;
+    }
+    return done;
+}
+#endif
+
+void recorder_dump_latency(FILE *out) {
+    for (int op = 0; op < SD_OP_COUNT; op++) {
+        lat_hist_dump(out, sd_op_names[op], &sd_latency[op]);
+    }
+    lat_stall_dump(out, &sd_stalls, sd_op_names);
+    fprintf(out, "dropped    %u frames, max outstanding buffers %u of %d\n",
+        recbuf_stats.dropped_frames, recbuf_stats.max_outstanding, NUM_RECBUFS);
+}
+
+void recorder_reset_latency(void) {
+    for (int op = 0; op < SD_OP_COUNT; op++) {
+        lat_hist_reset(&sd_latency[op]);
+    }
+}
+
+#if !SD_FLAC && !SD_RAW
+// Grow a newly created file to its full expected size in one go, by
+// writing its last byte. FATFS then allocates the whole cluster chain and
+// updates the FAT once, rather than extending the chain on every write.
+// It takes the first free clusters it finds, so the file is only
+// contiguous if the free space is; FATFS's f_expand() would look for a
+// run, but can't be reached through the VFS. The file position is left
+// where it was, so audio overwrites the preallocated space.
+static void sd_preallocate(int fd, const char *filename, uint64_t size) {
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+
+    file_prealloc_bytes = 0;
+    if ((off_t)size <= 0 || (uint64_t)(off_t)size != size) {
+        ESP_LOGW(TAG, "sd_task: %s is too big to preallocate", filename);
+        return;
+    }
+    file_prealloc_bytes = size;
+    if (lseek(fd, size - 1, SEEK_SET) == -1 || sd_put(fd, "", 1) != 1) {
+        ESP_LOGE(TAG, "sd_task: Failed to preallocate %s, %s", filename, strerror(errno));
+    }
+    if (lseek(fd, pos, SEEK_SET) != pos) {
+        ESP_LOGE(TAG, "sd_task: Failed to lseek() after preallocating %s", filename);
+    }
+}
+
+#endif
+
+static void i2s_task(void * pvParameters) {
+    ESP_LOGI(TAG, "i2s_task, starting up.");
+
+    // Absolute frame number of the next frame off the I2S bus, counting
+    // frames lost along the way, so gaps show up downstream
+    uint64_t position = 0;
+    uint64_t lost_seen = 0;
+
+    // Initialise the I2S bus
+    if (hal_i2s_init() != ESP_OK) {
+        ESP_LOGE(TAG, "i2s_task: Failed to initialise I2S");
+    }
+
+    while (true) {
+
+        // Loop reading from I2S and writing to a buffer
+        size_t bytesRead = 0;
+
+        esp_err_t rc;
+
+#if SD_TRIGGER
+        // Capture into the next slot of the ring, over the oldest audio in
+        // it. There's always one, so nothing is ever dropped here.
+        uint8_t *dest = preroll_ring_claim(&capture_ring);
+        int buf_index = preroll_ring_head(&capture_ring) % TRIGGER_RING_SLOTS;
+#else
+        // Take ownership of an empty buffer. If there is none, the audio for
+        // this buffer is lost, but keep draining I2S so DMA doesn't overflow.
+        int buf_index = acquire_buffer();
+        if (buf_index < 0) {
+            position += discard_buffer();
+            continue;
+        }
+        // A buffer in himem is mapped for as long as it takes to capture
+        // into it. (If it can't be, something is badly wrong: lose the
+        // audio rather than the buffer.)
+        uint8_t *dest = recbuf_pool_map(&pool, RECBUF_WINDOW_CAPTURE, buf_index);
+        if (dest == NULL) {
+            recbuf_pool_put(&pool, RECBUF_WINDOW_CAPTURE, &(recbuf_desc_t){ .buf_index = buf_index });
+            position += discard_buffer();
+            continue;
+        }
+#endif
+
+        // Account for anything the driver threw away while we weren't
+        // reading, before the frames we're about to read
+        uint64_t lost = hal_i2s_frames_lost();
+        if (lost != lost_seen) {
+            position += lost - lost_seen;
+            recbuf_stats.lost_frames += lost - lost_seen;
+            evt_log(EVT_I2S_OVERFLOW, lost - lost_seen, recbuf_stats.lost_frames, 0, 0);
+            lost_seen = lost;
+        }
+
+        // Request a buffer's worth of data from the I2S bus, timeout after
+        // an extra 0.5 seconds
+        rc = i2s_capture(
+            dest, 
+            RECBUF_SIZE, 
+            &bytesRead, 
+            RECBUF_MS + 500);
+#if !SD_TRIGGER
+        // Out of the window before sd_task maps it into its own
+        recbuf_pool_unmap(&pool, RECBUF_WINDOW_CAPTURE);
+#endif
+
+        evt_log(rc != ESP_OK ? EVT_I2S_READ_FAILED : EVT_I2S_READ,
+            rc, bytesRead, buf_index, 0);
+        if (bytesRead < RECBUF_SIZE) {
+            recbuf_stats.short_reads++;
+            evt_log(EVT_I2S_SHORT_READ, bytesRead, RECBUF_SIZE, 0, 0);
+        }
+        if (bytesRead == 0) {
+            // Nothing to pass on: the bus has stopped. (A ring slot stays
+            // claimed, to be captured into next time.)
+#if !SD_TRIGGER
+            recbuf_pool_put(&pool, RECBUF_WINDOW_CAPTURE, &(recbuf_desc_t){ .buf_index = buf_index });
+#endif
+            continue;
+        }
+
+        // Now pass the buffer to sd_task to be written to the SD card
+        recbuf_desc_t m = { 0 };
+        m.position = position;
+        // i2s_capture() returns as soon as DMA has delivered the last frame,
+        // so work back from now to the time of the first one.
+        m.timestamp = hal_time_us() - (int64_t)(bytesRead / FRAME_BYTES) * 1000000 / SAMPLE_RATE;
+        m.frames = bytesRead / FRAME_BYTES;
+        m.buf_index = buf_index;
+        position += m.frames;
+
+#if SD_TRIGGER
+        // Into the ring with it, for a snapshot to pick up
+        preroll_ring_publish(&capture_ring, &m);
+#else
+        // The ring is bigger than the pool, so this only fails if the
+        // ownership protocol has been broken. Don't leak the buffer if so.
+        if (!desc_ring_push(&filled_ring, &m)) {
+            ESP_LOGE(TAG, "i2s: desc_ring_push() failed");
+            recbuf_pool_put(&pool, RECBUF_WINDOW_CAPTURE, &m);
+        }
+#endif
+#if SD_FLAC
+        hal_task_notify(flac_task_handle);
+#else
+        hal_task_notify(sd_task_handle);
+#endif
+    }
+}
+
+#if !SD_TRIGGER
+// Get an empty buffer for i2s_task, applying the overrun policy if sd_task
+// has fallen behind. Returns the buffer index, or -1 if the caller must
+// discard the current buffer.
+static int acquire_buffer(void) {
+    recbuf_desc_t d;
+    uint32_t outstanding;
+
+    if (!recbuf_pool_get(&pool, &d)) {
+#if RECBUF_OVERRUN_POLICY == RECBUF_POLICY_DROP_OLDEST
+        // Steal back the oldest buffer that sd_task hasn't taken yet. Once
+        // it is out of the ring, sd_task can never see it, so it's ours.
+        if (!desc_ring_pop(&filled_ring, &d)) {
+            recbuf_stats.dropped_frames += RECBUF_FRAMES;
+            evt_log(EVT_I2S_NO_RECLAIM, recbuf_stats.dropped_frames, 0, 0, 0);
+            return -1;
+        }
+        recbuf_stats.dropped_frames += d.frames;
+        evt_log(EVT_I2S_DROP_OLDEST, recbuf_stats.dropped_frames, 0, 0, 0);
+#else
+        recbuf_stats.dropped_frames += RECBUF_FRAMES;
+        evt_log(EVT_I2S_DROP_NEWEST, recbuf_stats.dropped_frames, 0, 0, 0);
+        return -1;
+#endif
+    }
+
+    if (d.buf_index >= pool.mapped) {
+        recbuf_stats.banked_taken++;
+    }
+    outstanding = pool.count - recbuf_pool_free(&pool);
+    if (outstanding > recbuf_stats.max_outstanding) {
+        recbuf_stats.max_outstanding = outstanding;
+        evt_log(EVT_I2S_MAX_OUTSTANDING, outstanding, 0, 0, 0);
+    }
+    return d.buf_index;
+}
+
+// Read and throw away one buffer's worth of I2S data, keeping the DMA
+// ring drained while there is nowhere to put it. Returns the number of
+// frames thrown away.
+static uint32_t discard_buffer(void) {
+    static uint8_t scratch[MAX_SAMPLES * NUM_CHANNELS * I2S_SLOT_BYTES];
+    const size_t slot_frame_bytes = NUM_CHANNELS * I2S_SLOT_BYTES;
+    size_t total = RECBUF_FRAMES * slot_frame_bytes;
+    size_t remaining = total;
+
+    while (remaining > 0) {
+        size_t bytesRead = 0;
+        size_t len = remaining < sizeof scratch ? remaining : sizeof scratch;
+        if (hal_i2s_read(scratch, len, &bytesRead, 1500) != ESP_OK
+            || bytesRead == 0) {
+            ESP_LOGE(TAG, "i2s: i2s_read() failed while discarding");
+            break;
+        }
+        remaining -= bytesRead;
+    }
+    return (total - remaining) / slot_frame_bytes;
+}
+#endif
+
+
+// Mount the card, and fix up the file left unfinished by a power cut or
+// reset, if there is one. Only the file SD_MARKER names can be, so that
+// is the only one looked at, however many there are; i2s_task is already
+// capturing, and opening every file on a full card would hold sd_task up
+// for minutes. A preallocated file is longer than its audio, so its
+// header has to be believed; otherwise the file size is the better
+// guide. With
+// SD_RAW, there's nothing to mount or fix up, only the end of the log to
+// find.
+static void sd_init(void) {
+#if SD_RAW
+    raw_init();
+#else
+    int repaired;
+
+    if (hal_fs_mount(MOUNT_POINT) != ESP_OK) {
+        return;
+    }
+    repaired = wav_repair_marked(SD_MARKER, MOUNT_POINT, DATA_BLOCK_BYTES, SD_PREALLOCATE);
+    ESP_LOGI(TAG, "Repaired %d unfinished WAV files", repaired);
+#endif
+}
+
+// Read size bytes of audio, in file format, from the I2S bus into dest.
+// 16-bit audio goes straight into dest; 24-bit audio is read a DMA buffer
+// at a time into internal RAM and packed into dest from there.
+static esp_err_t i2s_capture(uint8_t *dest, size_t size, size_t *bytes_read, uint32_t timeout_ms) {
+#if FILE_BITS_PER_SAMPLE == 24
+    static int32_t slots[MAX_SAMPLES * NUM_CHANNELS];
+    esp_err_t rc = ESP_OK;
+
+    *bytes_read = 0;
+    while (*bytes_read < size) {
+        size_t samples = (size - *bytes_read) / 3;
+        size_t slot_bytes = 0;
+        if (samples > MAX_SAMPLES * NUM_CHANNELS) {
+            samples = MAX_SAMPLES * NUM_CHANNELS;
+        }
+        rc = hal_i2s_read(slots, samples * I2S_SLOT_BYTES, &slot_bytes, timeout_ms);
+        samples = slot_bytes / I2S_SLOT_BYTES;
+        pcm_pack_s32_to_s24(dest + *bytes_read, slots, samples);
+        *bytes_read += samples * 3;
+        if (rc != ESP_OK || samples == 0) {
+            break;
+        }
+    }
+    return rc;
+#else
+    return hal_i2s_read(dest, size, bytes_read, timeout_ms);
+#endif
+}
+
+#if !SD_RAW
+// Utility to format a timestamp for use in a filename. Only called by
+// sd_task, once per file.
+static void format_timestamp(time_t timestamp, bool seconds, char *datetime, size_t datetime_size) {
+    struct tm timeinfo;
+
+    localtime_r(&timestamp, &timeinfo);
+    strftime(datetime, datetime_size, seconds ? "%Y%m%d-%H%M%S" : "%Y%m%d-%H%M", &timeinfo);
+}
+#endif
@@ -0,0 +1,84 @@
+/* I2S recorder
+
+   The recording pipeline: i2s_task captures audio into a pool of record
+   buffers, and sd_task writes them out to minute-long WAV files, or with
+   SD_FLAC, flac_task encodes them for sd_task to write as FLAC files.
+   With SD_TRIGGER, i2s_task captures into a ring instead, and sd_task only
+   writes out what's around each recorder_trigger().
+*/
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "lat_hist.h"
+
+// Overrun accounting, only written by i2s_task
+typedef struct recbuf_stats {
+    uint32_t dropped_frames;    // frames of audio discarded for lack of a buffer
+    uint32_t max_outstanding;   // high-water mark of buffers not on the free list
+    uint32_t lost_frames;       // frames the I2S driver lost to DMA overflow
+    uint32_t short_reads;       // reads that returned less than a full buffer
+    uint32_t banked_taken;      // buffers taken from himem, the mapped ones all being in use
+} recbuf_stats_t;
+
+// Writer accounting, only written by sd_task, bar the gaps, which with
+// SD_FLAC flac_task counts
+typedef struct sd_stats {
+    uint64_t frames_written;    // frames handed to the filesystem, whether or not it took them
+    uint64_t bytes_written;     // bytes the filesystem took, including any silence
+    uint32_t files_closed;
+    uint32_t gaps;              // discontinuities in the audio reaching sd_task
+    uint64_t gap_frames;        // frames missing at them
+    uint32_t segments;          // times the level gate opened (SD_LEVEL_TRIGGER)
+    uint64_t frames_gated;      // frames it has kept out of the files so far
+    uint32_t triggers;          // recorder_trigger() calls taken up (SD_TRIGGER)
+    uint32_t snapshots;         // snapshots written
+    uint32_t snapshot_overruns; // times a snapshot fell a whole ring behind
+    uint32_t batches;           // writes of more than one buffer, once behind
+    uint32_t batched;           // buffers written in them
+    uint32_t log_segments;      // segments written to the raw log (SD_RAW)
+} sd_stats_t;
+
+// A dropout in a file, marked by a cue point
+typedef struct sd_cue {
+    uint32_t frame;             // where it is, in frames from the start of the data
+    uint32_t frames;            // how much audio is missing there
+} sd_cue_t;
+
+// Filesystem operations sd_task times
+typedef enum sd_op {
+    SD_OP_OPEN,         // open() of a new file
+    SD_OP_HEADER,       // writing or rewriting a WAV header
+    SD_OP_PREALLOC,     // growing a new file to full size
+    SD_OP_WRITE,        // write() of audio
+    SD_OP_SYNC,         // fsync()
+    SD_OP_CLOSE,        // close(), and truncating a preallocated file
+    SD_OP_COUNT
+} sd_op_t;
+
+extern recbuf_stats_t recbuf_stats;
+extern sd_stats_t sd_stats;
+
+// Latency of each sd_op_t, only recorded by sd_task
+extern lat_hist_t sd_latency[SD_OP_COUNT];
+extern lat_stall_log_t sd_stalls;
+
+// Allocate the record buffers and start i2s_task and sd_task
+void recorder_start(void);
+
+// Save the audio around now to a file of its own (SD_TRIGGER): from
+// TRIGGER_PREROLL_MS before to TRIGGER_POST_MS after, or if a snapshot is
+// being written already, carry it on to TRIGGER_POST_MS after now. Capture
+// carries on regardless. Can be called from any task, but not from an
+// interrupt. Returns false if there's no audio yet, or no SD_TRIGGER.
+bool recorder_trigger(void);
+
+// Whether a snapshot is still to be written, or being written
+bool recorder_trigger_busy(void);
+
+// Print the SD latency histograms and recent stalls
+void recorder_dump_latency(FILE *out);
+
+// Start the histograms again; stalls already logged are kept
+void recorder_reset_latency(void);
@@ -0,0 +1,177 @@
+/* I2S recorder configuration
+
+   Audio format and pipeline settings shared by the recorder and its HAL
+   implementations.
+*/
+#pragma once
+
+#include "sdkconfig.h"
+
+#ifndef SAMPLE_RATE
+#define SAMPLE_RATE     (48000)
+#endif
+#define NUM_CHANNELS    (2)
+#ifndef FILE_BITS_PER_SAMPLE
+#define FILE_BITS_PER_SAMPLE (16)   // 16, or 24 for the full resolution of the ADC
+#endif
+#if FILE_BITS_PER_SAMPLE == 24
+// 24-bit samples arrive left-justified in 32-bit I2S slots, and are packed
+// down to 3 bytes each on their way into the record buffer.
+#define I2S_SLOT_BYTES  (4)
+#else
+#define I2S_SLOT_BYTES  (2)
+#endif
+#define FRAME_BYTES     (NUM_CHANNELS*(FILE_BITS_PER_SAMPLE/8))
+// Record buffer size and count come from menuconfig ("I2S Recorder").
+// The size is rounded down to a multiple of 4 frames, so every buffer is
+// whole words whatever the format (4 frames of 24-bit stereo are 24 bytes).
+#define RECBUF_FRAMES   (CONFIG_RECORDER_CHUNK_SIZE/FRAME_BYTES/4*4)
+#define RECBUF_SIZE     (RECBUF_FRAMES*FRAME_BYTES)
+#define RECBUF_MS       ((int)((int64_t)RECBUF_FRAMES*1000/SAMPLE_RATE))
+// Files start on multiples of SD_FILE_SECONDS of the clock. Over 4 GB of
+// audio needs SD_RF64, and a filesystem and C library that can take it.
+#ifndef SD_FILE_SECONDS
+#define SD_FILE_SECONDS (60)
+#endif
+#define FRAMES_PER_FILE ((uint64_t)SD_FILE_SECONDS*SAMPLE_RATE)
+// Record buffers: CONFIG_RECORDER_NUM_CHUNKS in the mapped PSRAM, then
+// any in himem beyond it, which are only used when those run out
+#define MAPPED_RECBUFS  (CONFIG_RECORDER_NUM_CHUNKS)
+#ifdef CONFIG_RECORDER_HIMEM_CHUNKS
+#define HIMEM_RECBUFS   (CONFIG_RECORDER_HIMEM_CHUNKS)
+#else
+#define HIMEM_RECBUFS   (0)
+#endif
+#define NUM_RECBUFS     (MAPPED_RECBUFS + HIMEM_RECBUFS)
+#define RING_SIZE       (64)    // power of two, at least NUM_RECBUFS
+// What to do when i2s_task needs a buffer and sd_task still owns them all:
+// DROP_NEWEST discards the buffer being captured, DROP_OLDEST reclaims the
+// oldest buffer still waiting in the ring (i.e. not yet taken by sd_task).
+#define RECBUF_POLICY_DROP_NEWEST   (0)
+#define RECBUF_POLICY_DROP_OLDEST   (1)
+#define RECBUF_OVERRUN_POLICY       RECBUF_POLICY_DROP_OLDEST
+// DMA ring used by the I2S driver. i2s_read() copies one DMA buffer at a
+// time into the record buffer, so fewer, larger DMA buffers mean fewer
+// interrupts and copy calls per second. A DMA buffer's descriptor has 12
+// bits for its length, so it can hold at most DMA_BUF_MAX_BYTES: 1023
+// frames of 16-bit slots, 511 of 32-bit. The ring holds ~170 ms of audio
+// at 48 kHz either way, in 32 or 64 KB of internal RAM. There's no
+// capturing into the record buffers without a copy: the I2S DMA can't
+// reach PSRAM, and the driver doesn't lend its buffers out.
+#define DMA_BUF_MAX_BYTES (4092)
+#define MAX_SAMPLES     (DMA_BUF_MAX_BYTES/(NUM_CHANNELS*I2S_SLOT_BYTES))  // frames per DMA buffer
+#define DMA_BUF_COUNT   (4*I2S_SLOT_BYTES)
+#ifndef MOUNT_POINT
+#define MOUNT_POINT     "/sdcard"
+#endif
+#define SD_FLUSH_INTERVAL (10*SAMPLE_RATE)  // frames written between flushes of the open file
+#define SD_CRASH_SAFE   (1)     // keep the header of the open file up to date at each flush
+#define SD_PREALLOCATE  (1)     // allocate each file's clusters up front when it's created
+#define SD_MARKER       MOUNT_POINT "/recording.txt"  // names the file being recorded, to repair after a reset
+#define SD_BWF          (1)     // Broadcast WAV: a bext chunk with the time of the first frame, to the frame
+#ifndef SD_RF64
+#define SD_RF64         (0)     // reserve room for a ds64 chunk, so a file can grow past 4 GB as RF64
+#endif
+#define SD_GAP_FILL_MAX (SAMPLE_RATE/10)    // frames of lost audio padded with silence; longer gaps start a new file
+#define SD_MAX_CUES     (32)    // dropouts marked in each file's cue chunk
+// Once sd_task is behind, buffers that follow on from the one it's writing
+// go out with it in one write, up to this many bytes; 0 for one at a time.
+// Off by default: every write reaches the card in HAL_STAGE_BYTES pieces
+// anyway, and "make drain" shows no gain with 192 KB buffers, only with
+// buffers smaller than that
+#ifndef SD_BATCH_BYTES
+#define SD_BATCH_BYTES  (0)
+#endif
+// Raw recording: PCM straight to a partition of the card set aside for it
+// (MBR type 0xda), in the log raw_log.h describes, with no filesystem in
+// the way, for rates FATFS can't keep up with. Each segment of the log
+// takes up a slot of RAW_SEGMENT_BYTES, and only counts once its header
+// is written after its audio, so a reset loses at most the one being
+// written. ../host/rawextract.c turns a card image into WAV files. PCM only.
+#ifndef SD_RAW
+#define SD_RAW          (0)
+#endif
+#ifndef RAW_SEGMENT_BYTES
+#define RAW_SEGMENT_BYTES (1024*1024)   // whole sectors; the last one holds the header
+#endif
+// FLAC instead of WAV: flac_task encodes the record buffers into encoded
+// buffers of their own, which sd_task writes out as .flac files
+#ifndef SD_FLAC
+#define SD_FLAC         (0)
+#endif
+#define FLAC_BLOCK_FRAMES (4096)    // frames per FLAC frame
+#define NUM_CODEDBUFS   (4)     // encoded buffers, a power of two
+#define CODEDBUF_SIZE   (RECBUF_SIZE)
+// IMA-ADPCM instead of PCM: 4 bits a sample, a quarter of the SD bandwidth
+// of 16-bit PCM, in WAV files (format 0x11) of whole ADPCM_BLOCK_BYTES
+// blocks. sd_task encodes each record buffer on its way to the card.
+#ifndef SD_ADPCM
+#define SD_ADPCM        (0)
+#endif
+#define ADPCM_BLOCK_BYTES (1024*NUM_CHANNELS)   // block_align, a multiple of 4*NUM_CHANNELS
+#define ADPCM_BLOCK_FRAMES ((ADPCM_BLOCK_BYTES/NUM_CHANNELS - 4)*2 + 1)
+// The data chunk is written in blocks of DATA_BLOCK_FRAMES frames, each
+// DATA_BLOCK_BYTES long: single frames of PCM, or ADPCM blocks
+#if SD_ADPCM
+#define DATA_BLOCK_BYTES  ADPCM_BLOCK_BYTES
+#define DATA_BLOCK_FRAMES ADPCM_BLOCK_FRAMES
+#else
+#define DATA_BLOCK_BYTES  FRAME_BYTES
+#define DATA_BLOCK_FRAMES (1)
+#endif
+#define DATA_BYTES(frames) (((uint64_t)(frames) + DATA_BLOCK_FRAMES - 1) / DATA_BLOCK_FRAMES * DATA_BLOCK_BYTES)
+// Level-activated recording: only the stretches of audio that reach
+// LEVEL_THRESHOLD_DBFS are written, from LEVEL_PREROLL_MS before the
+// first loud block to LEVEL_HANGOVER_MS after the last, each starting a
+// file of its own. The pre-roll is held in record buffers, so it takes
+// up to LEVEL_PREROLL_BUFS of the pool while the gate is shut. WAV only.
+#ifndef SD_LEVEL_TRIGGER
+#define SD_LEVEL_TRIGGER (0)
+#endif
+#ifndef LEVEL_THRESHOLD_DBFS
+#define LEVEL_THRESHOLD_DBFS (-40)  // relative to full scale
+#endif
+#ifndef LEVEL_RMS
+#define LEVEL_RMS       (0)     // 1 to compare each block's RMS level, 0 for its peak
+#endif
+#define LEVEL_BLOCK_FRAMES (SAMPLE_RATE/100)   // frames per level measurement, 10 ms
+#ifndef LEVEL_HANGOVER_MS
+#define LEVEL_HANGOVER_MS (3000)
+#endif
+#ifndef LEVEL_PREROLL_MS
+#define LEVEL_PREROLL_MS (2000)
+#endif
+#define LEVEL_PREROLL_FRAMES ((uint64_t)LEVEL_PREROLL_MS*SAMPLE_RATE/1000)
+#define LEVEL_PREROLL_BUFS ((LEVEL_PREROLL_FRAMES + RECBUF_FRAMES - 1)/RECBUF_FRAMES + 1)
+// Trigger capture: i2s_task captures into a ring of TRIGGER_RING_BYTES of
+// PSRAM, over the oldest audio in it, and nothing is written until
+// recorder_trigger() is called. Then the TRIGGER_PREROLL_MS before the
+// trigger and the TRIGGER_POST_MS after it go to a file of their own. The
+// ring takes the place of the record buffer pool, bar one buffer that
+// sd_task copies out of the ring into. WAV only.
+#ifndef SD_TRIGGER
+#define SD_TRIGGER      (0)
+#endif
+#ifndef TRIGGER_RING_BYTES
+#define TRIGGER_RING_BYTES (3*1024*1024)    // no more than the 4 MB of PSRAM mapped at once
+#endif
+#define TRIGGER_RING_SLOTS (TRIGGER_RING_BYTES/RECBUF_SIZE)
+#ifndef TRIGGER_PREROLL_MS
+#define TRIGGER_PREROLL_MS (10000)
+#endif
+#ifndef TRIGGER_POST_MS
+#define TRIGGER_POST_MS (10000)
+#endif
+#define TRIGGER_PREROLL_FRAMES ((uint64_t)TRIGGER_PREROLL_MS*SAMPLE_RATE/1000)
+#define TRIGGER_POST_FRAMES ((uint64_t)TRIGGER_POST_MS*SAMPLE_RATE/1000)
+// Files that start wherever the audio to keep does, rather than on
+// SD_FILE_SECONDS boundaries, so are named to the second
+#define SD_SEGMENTS     (SD_LEVEL_TRIGGER || SD_TRIGGER)
+// Task stacks, in bytes of internal RAM, set aside with everything else the
+// recorder needs when it's built. FATFS keeps its long file name buffer on
+// the stack of whichever task calls it (CONFIG_FATFS_LFN_STACK), so
+// sd_task has room for that besides.
+#define SD_TASK_STACK   (8192 + 2*256)
+#define FLAC_TASK_STACK (8192)
+#define I2S_TASK_STACK  (8192)
+#define LOG_TASK_STACK  (4096)
@@ -0,0 +1,110 @@
+/* I2S recorder UART console
+
+*/
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/uart.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_vfs_dev.h"
+#include "linenoise/linenoise.h"
+#include "sdkconfig.h"
+#include "recorder.h"
+#include "recorder_config.h"
+#include "recorder_console.h"
+#include "recorder_hal.h"
+
+
+static const char *TAG = "i2s_recorder";
+
+static uint8_t console_stack[4096];
+
+static int cmd_latency(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        recorder_reset_latency();
+        printf("latency histograms reset\n");
+        return 0;
+    }
+    if (argc > 1) {
+        printf("usage: latency [reset]\n");
+        return 1;
+    }
+    recorder_dump_latency(stdout);
+    return 0;
+}
+
+#if SD_TRIGGER
+static int cmd_trigger(int argc, char **argv) {
+    if (!recorder_trigger()) {
+        printf("nothing captured yet\n");
+        return 1;
+    }
+    printf("saving %d s before and %d s after\n", TRIGGER_PREROLL_MS / 1000, TRIGGER_POST_MS / 1000);
+    return 0;
+}
+#endif
+
+static void console_task(void *pvParameters) {
+    for (;;) {
+        char *line = linenoise("recorder> ");
+        int ret;
+
+        if (line == NULL) {
+            continue;
+        }
+        if (line[0] != '\0') {
+            linenoiseHistoryAdd(line);
+            if (esp_console_run(line, &ret) == ESP_ERR_NOT_FOUND) {
+                printf("Unknown command: %s\n", line);
+            }
+        }
+        linenoiseFree(line);
+    }
+}
+
+void recorder_console_start(void) {
+    esp_console_config_t console_config = {
+        .max_cmdline_args = 4,
+        .max_cmdline_length = 64,
+    };
+    const esp_console_cmd_t latency_cmd = {
+        .command = "latency",
+        .help = "Print SD write latency histograms and recent stalls. "
+                "'latency reset' clears the histograms.",
+        .hint = "[reset]",
+        .func = &cmd_latency,
+    };
+#if SD_TRIGGER
+    const esp_console_cmd_t trigger_cmd = {
+        .command = "trigger",
+        .help = "Save the audio from before and after now to a file.",
+        .func = &cmd_trigger,
+    };
+#endif
+
+    // Blocking reads from the UART through the driver, rather than the
+    // default polling VFS
+    setvbuf(stdin, NULL, _IONBF, 0);
+    esp_vfs_dev_uart_set_rx_line_endings(ESP_LINE_ENDINGS_CR);
+    esp_vfs_dev_uart_set_tx_line_endings(ESP_LINE_ENDINGS_CRLF);
+    if (uart_driver_install(CONFIG_ESP_CONSOLE_UART_NUM, 256, 0, 0, NULL, 0) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to install the console UART driver.");
+        return;
+    }
+    esp_vfs_dev_uart_use_driver(CONFIG_ESP_CONSOLE_UART_NUM);
+
+    ESP_ERROR_CHECK(esp_console_init(&console_config));
+    linenoiseSetMultiLine(1);
+    linenoiseHistorySetMaxLen(10);
+    esp_console_register_help_command();
+    ESP_ERROR_CHECK(esp_console_cmd_register(&latency_cmd));
+#if SD_TRIGGER
+    ESP_ERROR_CHECK(esp_console_cmd_register(&trigger_cmd));
+#endif
+
+    // Lowest priority: it must never hold up i2s_task or sd_task
+    hal_task_create(console_task, "console", console_stack, sizeof console_stack, NULL, 0,
+        PRO_CPU);
+}
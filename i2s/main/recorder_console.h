@@ -0,0 +1,10 @@
+/* I2S recorder UART console
+
+   A small command line on the console UART, for looking at the recorder
+   while it runs. "latency" prints the SD write latency histograms and
+   recent stalls, "latency reset" starts the histograms again. With
+   SD_TRIGGER, "trigger" calls recorder_trigger().
+*/
+#pragma once
+
+void recorder_console_start(void);
@@ -0,0 +1,100 @@
+/* I2S recorder hardware abstraction
+
+   Everything the recorder pipeline needs from the platform: the I2S input,
+   the filesystem, or the card's sectors without one, PSRAM beyond the
+   address space, tasks and the clock. recorder_hal_esp.c implements it
+   with ESP-IDF; ../host/recorder_hal_linux.c implements it on Linux, so
+   the pipeline can be run and profiled without hardware.
+*/
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+#define PRO_CPU	0
+#define APP_CPU	1
+
+#define HAL_MAX_TASKS   (6)     // tasks hal_task_create() can start
+
+typedef void *hal_task_t;
+
+// Start the I2S bus, in the format given by recorder_config.h
+esp_err_t hal_i2s_init(void);
+
+// Read up to size bytes of I2S slots, as i2s_read() does
+esp_err_t hal_i2s_read(void *dest, size_t size, size_t *bytes_read, uint32_t timeout_ms);
+
+// Frames the I2S driver has thrown away since hal_i2s_init(), because they
+// weren't read before its DMA ring overflowed. Only called by the task
+// that reads.
+uint64_t hal_i2s_frames_lost(void);
+
+// Mount the filesystem that recordings are written to at mount_point
+esp_err_t hal_fs_mount(const char *mount_point);
+
+// Internal RAM the card's DMA can reach, set aside at build time for
+// sd_task to copy what it writes to files into, and for hal_raw_read() and
+// hal_raw_write() to go through. The SD driver takes a bounce buffer from
+// the heap, and writes a sector at a time, for anything in PSRAM or not
+// word-aligned. Whole sectors, and only sd_task's. Its size comes from
+// menuconfig ("I2S Recorder").
+#define HAL_STAGE_BYTES (CONFIG_RECORDER_STAGE_SIZE)
+extern uint8_t hal_stage[HAL_STAGE_BYTES];
+
+// The card itself, a sector at a time, for SD_RAW instead of the filesystem
+#define HAL_SECTOR_BYTES (512)
+_Static_assert(HAL_STAGE_BYTES % HAL_SECTOR_BYTES == 0,
+    "RECORDER_STAGE_SIZE has to be whole sectors");
+
+// Start the card without mounting anything on it, and say how many
+// sectors it has
+esp_err_t hal_raw_init(uint64_t *sectors);
+
+// Read or write count sectors from sector on, to or from anywhere in
+// memory, PSRAM included, HAL_STAGE_BYTES at a time through hal_stage.
+// Only one task uses the card.
+esp_err_t hal_raw_read(uint64_t sector, void *dest, uint32_t count);
+esp_err_t hal_raw_write(uint64_t sector, const void *src, uint32_t count);
+
+// PSRAM beyond the 4 MB that is mapped into the address space (himem),
+// got at a few banks at a time through windows of address space set
+// aside for it
+#define HAL_MAPPED_PSRAM_BYTES (4*1024*1024)
+#define HAL_BANK_BYTES  (32768)
+
+// Reserve banks banks of it, and windows windows of window_banks banks
+// each to map them through. Returns false if there isn't that much.
+bool hal_bank_init(uint32_t banks, unsigned windows, uint32_t window_banks);
+
+// Map count banks, from bank on, at the start of window, in place of
+// whatever was there. A bank can only be in one window at a time, and a
+// window is only used by one task. Returns where they are, or NULL if
+// they can't be mapped.
+void *hal_bank_map(unsigned window, uint32_t bank, uint32_t count);
+
+// Unmap whatever is in window
+void hal_bank_unmap(unsigned window);
+
+// Create a task running fn(arg) on stack, stack_size bytes of internal RAM
+// that the caller supplies and never frees, pinned to core where that means
+// something. Nothing comes from the heap: tasks never end, and their control
+// blocks are the HAL's, HAL_MAX_TASKS of them. Only called at start-up, one
+// task at a time. The host build runs each on a thread of its own instead.
+hal_task_t hal_task_create(void (*fn)(void *), const char *name, void *stack, uint32_t stack_size,
+    void *arg, int priority, int core);
+
+// Wake task from hal_task_wait()
+void hal_task_notify(hal_task_t task);
+
+// Wait up to timeout_ms for the calling task to be notified. Returns false
+// on timeout.
+bool hal_task_wait(uint32_t timeout_ms);
+
+// Wall-clock time, in microseconds since the epoch
+int64_t hal_time_us(void);
+
+// Monotonic time, in microseconds since boot, for timing things
+int64_t hal_uptime_us(void);
@@ -0,0 +1,372 @@
+/* I2S recorder hardware abstraction, ESP-IDF implementation
+
+*/
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "driver/i2s.h"
+#include "driver/gpio.h"
+#include "driver/sdmmc_host.h"
+#include "esp_attr.h"
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_vfs_fat.h"
+#include "esp32/himem.h"
+#include "driver/sdspi_host.h"
+#include "driver/spi_common.h"
+#include "sdmmc_cmd.h"
+#include "recorder_config.h"
+#include "recorder_hal.h"
+
+
+static const char *TAG = "i2s_recorder";
+
+#define I2S_BITS_PER_SAMPLE ((i2s_bits_per_sample_t)(I2S_SLOT_BYTES*8))
+#define I2S_NUM         (0)
+#define I2S_BCK_IO      (GPIO_NUM_32)
+#define I2S_WS_IO       (GPIO_NUM_27)
+#define I2S_DO_IO       (I2S_PIN_NO_CHANGE)
+#define I2S_DI_IO       (GPIO_NUM_25)
+
+// DMA channel to be used by the SPI peripheral
+#ifndef SPI_DMA_CHAN
+#define SPI_DMA_CHAN    1
+#endif //SPI_DMA_CHAN
+// Pin mapping when using SPI mode.
+// With this mapping, SD card can be used both in SPI and 1-line SD mode.
+// Note that a pull-up on CS line is required in SD mode.
+#define PIN_NUM_MISO 19
+#define PIN_NUM_MOSI 23
+#define PIN_NUM_CLK  18
+#define PIN_NUM_CS   5
+
+_Static_assert(MAX_SAMPLES * NUM_CHANNELS * I2S_SLOT_BYTES <= DMA_BUF_MAX_BYTES,
+    "a DMA buffer is too long for its descriptor");
+
+// Room for the I2S driver's RX_DONE events from two record buffers' worth
+// of DMA buffers, so none are lost between calls to hal_i2s_frames_lost()
+#define I2S_EVENT_QUEUE_LEN (2 * RECBUF_FRAMES / MAX_SAMPLES + DMA_BUF_COUNT)
+
+sdmmc_card_t *card;
+
+// hal_stage, in sectors
+#define STAGE_SECTORS (HAL_STAGE_BYTES / HAL_SECTOR_BYTES)
+DMA_ATTR uint8_t hal_stage[HAL_STAGE_BYTES];
+
+// For SD_RAW: the card, when there's no filesystem to keep it
+static sdmmc_card_t raw_card;
+
+// Most windows hal_bank_init() sets aside
+#define MAX_BANK_WINDOWS (4)
+
+// Control blocks of the tasks hal_task_create() has started
+static StaticTask_t task_tcb[HAL_MAX_TASKS];
+static unsigned task_count;
+
+_Static_assert(HAL_BANK_BYTES == ESP_HIMEM_BLKSZ, "HAL_BANK_BYTES isn't the himem block size");
+
+static QueueHandle_t i2s_event_queue;
+static uint64_t dma_frames;     // frames the DMA has finished receiving
+static uint64_t read_frames;    // frames handed out by hal_i2s_read()
+static uint64_t lost_frames;
+
+// Start the SPI bus the card is on, and say how to reach the card
+static esp_err_t card_bus_init(sdmmc_host_t *host, sdspi_device_config_t *slot_config) {
+    esp_err_t ret;
+
+    ESP_LOGI(TAG, "Initializing SD card");
+
+    ESP_LOGI(TAG, "Using SPI peripheral");
+
+    *host = (sdmmc_host_t)SDSPI_HOST_DEFAULT();
+    spi_bus_config_t bus_cfg = {
+        .mosi_io_num = PIN_NUM_MOSI,
+        .miso_io_num = PIN_NUM_MISO,
+        .sclk_io_num = PIN_NUM_CLK,
+        .quadwp_io_num = -1,
+        .quadhd_io_num = -1,
+        .max_transfer_sz = 4000,
+    };
+    ret = spi_bus_initialize(host->slot, &bus_cfg, SPI_DMA_CHAN);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to initialize bus.");
+        return ret;
+    }
+
+    // This initializes the slot without card detect (CD) and write protect (WP) signals.
+    // Modify slot_config.gpio_cd and slot_config.gpio_wp if your board has these signals.
+    *slot_config = (sdspi_device_config_t)SDSPI_DEVICE_CONFIG_DEFAULT();
+    slot_config->gpio_cs = PIN_NUM_CS;
+    slot_config->host_id = host->slot;
+    return ESP_OK;
+}
+
+// What's left of internal RAM once the card is started, with hal_stage
+// and the card's buffers taken out of it, for sizing RECORDER_STAGE_SIZE
+static void log_internal_ram(void) {
+    ESP_LOGI(TAG, "Staging card writes through %u bytes; internal RAM free %u, "
+        "DMA-capable %u, largest DMA-capable block %u", (unsigned)HAL_STAGE_BYTES,
+        (unsigned)heap_caps_get_free_size(MALLOC_CAP_INTERNAL),
+        (unsigned)heap_caps_get_free_size(MALLOC_CAP_DMA),
+        (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_DMA));
+}
+
+esp_err_t hal_fs_mount(const char *mount_point) {
+    esp_err_t ret;
+    sdmmc_host_t host;
+    sdspi_device_config_t slot_config;
+    
+    esp_vfs_fat_sdmmc_mount_config_t mount_config = {
+        .format_if_mount_failed = false,
+        .max_files = 5,
+        .allocation_unit_size = 16 * 1024
+    };
+
+    ret = card_bus_init(&host, &slot_config);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    ret = esp_vfs_fat_sdspi_mount(mount_point, &host, &slot_config, &mount_config, &card);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to mount filesystem, %s", esp_err_to_name(ret));
+        return ret;
+    }
+
+    // Card has been initialized, print its properties
+    sdmmc_card_print_info(stdout, card);
+    log_internal_ram();
+
+    return ESP_OK;
+}
+
+esp_err_t hal_raw_init(uint64_t *sectors) {
+    esp_err_t ret;
+    sdmmc_host_t host;
+    sdspi_device_config_t slot_config;
+    sdspi_dev_handle_t handle;
+
+    // What esp_vfs_fat_sdspi_mount() does, short of mounting
+    ret = card_bus_init(&host, &slot_config);
+    if (ret == ESP_OK) {
+        ret = sdspi_host_init();
+    }
+    if (ret == ESP_OK) {
+        ret = sdspi_host_init_device(&slot_config, &handle);
+    }
+    if (ret == ESP_OK) {
+        host.slot = handle;
+        ret = sdmmc_card_init(&host, &raw_card);
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start the card, %s", esp_err_to_name(ret));
+        return ret;
+    }
+    card = &raw_card;
+    sdmmc_card_print_info(stdout, card);
+    log_internal_ram();
+    *sectors = (uint64_t)card->csd.capacity * card->csd.sector_size / HAL_SECTOR_BYTES;
+    return ESP_OK;
+}
+
+esp_err_t hal_raw_read(uint64_t sector, void *dest, uint32_t count) {
+    while (count > 0) {
+        uint32_t n = count < STAGE_SECTORS ? count : STAGE_SECTORS;
+        esp_err_t ret = sdmmc_read_sectors(card, hal_stage, sector, n);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+        memcpy(dest, hal_stage, n * HAL_SECTOR_BYTES);
+        dest = (uint8_t *)dest + n * HAL_SECTOR_BYTES;
+        sector += n;
+        count -= n;
+    }
+    return ESP_OK;
+}
+
+esp_err_t hal_raw_write(uint64_t sector, const void *src, uint32_t count) {
+    // Each piece goes as one multiple block write
+    while (count > 0) {
+        uint32_t n = count < STAGE_SECTORS ? count : STAGE_SECTORS;
+        esp_err_t ret;
+        memcpy(hal_stage, src, n * HAL_SECTOR_BYTES);
+        ret = sdmmc_write_sectors(card, hal_stage, sector, n);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+        src = (const uint8_t *)src + n * HAL_SECTOR_BYTES;
+        sector += n;
+        count -= n;
+    }
+    return ESP_OK;
+}
+
+esp_err_t hal_i2s_init(void) {
+
+    // ESP32 as slave seems to be prone to frame alignment errors eg samples 
+    // that should start 0xF start 0x7. 
+    // Switching instead to ESP32 as master using code from:
+    // https://github.com/YetAnotherElectronicsChannel/ESP32_DSP_I2S_SETUP/blob/master/code/main/main.c
+
+    i2s_config_t i2s_config = {
+        .mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX),
+        .sample_rate = SAMPLE_RATE,
+        .bits_per_sample = I2S_BITS_PER_SAMPLE,
+        .channel_format = I2S_CHANNEL_FMT_RIGHT_LEFT,                           //2-channels
+        .communication_format = I2S_COMM_FORMAT_STAND_I2S,
+        .dma_buf_count = DMA_BUF_COUNT,
+        .dma_buf_len = MAX_SAMPLES,
+        .use_apll = false,
+        .intr_alloc_flags = ESP_INTR_FLAG_LEVEL1,  //Interrupt level 1
+        .tx_desc_auto_clear = true,
+    };
+    i2s_pin_config_t pin_config = {
+        .bck_io_num = I2S_BCK_IO,
+        .ws_io_num = I2S_WS_IO,
+        .data_out_num = I2S_DO_IO,
+        .data_in_num = I2S_DI_IO                                               //Not used
+    };
+    if (ESP_OK != i2s_driver_install(I2S_NUM, &i2s_config, I2S_EVENT_QUEUE_LEN, &i2s_event_queue)) {
+        printf("i2s_driver_install: error");
+        return ESP_FAIL;
+    }
+    if (ESP_OK != i2s_set_pin(I2S_NUM, &pin_config)) {
+        printf("i2s_set_pin: error");
+        return ESP_FAIL;
+    }
+
+    //enable MCLK on GPIO0
+	REG_WRITE(PIN_CTRL, 0xFF0); 
+	PIN_FUNC_SELECT(PERIPHS_IO_MUX_GPIO0_U, FUNC_GPIO0_CLK_OUT1);
+
+    return ESP_OK;
+}
+
+esp_err_t hal_i2s_read(void *dest, size_t size, size_t *bytes_read, uint32_t timeout_ms) {
+    esp_err_t rc = i2s_read(I2S_NUM, dest, size, bytes_read, timeout_ms / portTICK_PERIOD_MS);
+
+    read_frames += *bytes_read / (NUM_CHANNELS * I2S_SLOT_BYTES);
+    return rc;
+}
+
+// This version of the driver has no RX overflow event; when its queue of
+// DMA buffers is full it silently reuses the oldest. But it does send an
+// RX_DONE event for every DMA buffer received, so count those: anything
+// received beyond what has been read and what the DMA ring can still be
+// holding has been overwritten. This lags by up to a DMA ring's worth,
+// but never reports loss that didn't happen.
+uint64_t hal_i2s_frames_lost(void) {
+    i2s_event_t event;
+    uint64_t unread;
+
+    while (xQueueReceive(i2s_event_queue, &event, 0) == pdTRUE) {
+        if (event.type == I2S_EVENT_RX_DONE) {
+            dma_frames += MAX_SAMPLES;
+        }
+    }
+    unread = dma_frames - read_frames;
+    if (unread > lost_frames + DMA_BUF_COUNT * MAX_SAMPLES) {
+        lost_frames = unread - DMA_BUF_COUNT * MAX_SAMPLES;
+    }
+    return lost_frames;
+}
+
+static esp_himem_handle_t bank_mem;
+static esp_himem_rangehandle_t bank_window[MAX_BANK_WINDOWS];
+static void *bank_window_addr[MAX_BANK_WINDOWS];    // what each window has mapped, if anything
+static uint32_t bank_window_count[MAX_BANK_WINDOWS];
+
+bool hal_bank_init(uint32_t banks, unsigned windows, uint32_t window_banks) {
+    esp_err_t rc;
+
+    if (windows > MAX_BANK_WINDOWS) {
+        ESP_LOGE(TAG, "At most %d bank windows", MAX_BANK_WINDOWS);
+        return false;
+    }
+    if ((rc = esp_himem_alloc((size_t)banks * HAL_BANK_BYTES, &bank_mem)) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to reserve %u banks of himem, %s (%u bytes free)",
+            banks, esp_err_to_name(rc), esp_himem_get_free_size());
+        return false;
+    }
+    for (unsigned w = 0; w < windows; w++) {
+        if ((rc = esp_himem_alloc_map_range((size_t)window_banks * HAL_BANK_BYTES,
+                &bank_window[w])) != ESP_OK) {
+            // CONFIG_SPIRAM_BANKSWITCH_RESERVE has to cover every window
+            ESP_LOGE(TAG, "Failed to set aside a window of %u banks, %s",
+                window_banks, esp_err_to_name(rc));
+            while (w-- > 0) {
+                esp_himem_free_map_range(bank_window[w]);
+            }
+            esp_himem_free(bank_mem);
+            return false;
+        }
+    }
+    ESP_LOGI(TAG, "Reserved %u banks of himem, and %u windows of %u banks",
+        banks, windows, window_banks);
+    return true;
+}
+
+void *hal_bank_map(unsigned window, uint32_t bank, uint32_t count) {
+    esp_err_t rc;
+
+    hal_bank_unmap(window);
+    rc = esp_himem_map(bank_mem, bank_window[window], (size_t)bank * HAL_BANK_BYTES, 0,
+        (size_t)count * HAL_BANK_BYTES, 0, &bank_window_addr[window]);
+    if (rc != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to map banks %u-%u, %s", bank, bank + count - 1, esp_err_to_name(rc));
+        bank_window_addr[window] = NULL;
+        return NULL;
+    }
+    bank_window_count[window] = count;
+    return bank_window_addr[window];
+}
+
+void hal_bank_unmap(unsigned window) {
+    if (bank_window_addr[window] != NULL) {
+        esp_himem_unmap(bank_window[window], bank_window_addr[window],
+            (size_t)bank_window_count[window] * HAL_BANK_BYTES);
+        bank_window_addr[window] = NULL;
+    }
+}
+
+hal_task_t hal_task_create(void (*fn)(void *), const char *name, void *stack, uint32_t stack_size,
+    void *arg, int priority, int core) {
+    TaskHandle_t handle;
+
+    if (task_count == HAL_MAX_TASKS) {
+        ESP_LOGE(TAG, "Failed to create task %s, too many tasks", name);
+        return NULL;
+    }
+    // On the ESP32 a StackType_t is a byte, so the depth is in bytes
+    handle = xTaskCreateStaticPinnedToCore(fn, name, stack_size, arg, priority, stack,
+        &task_tcb[task_count], core);
+    if (handle == NULL) {
+        ESP_LOGE(TAG, "Failed to create task %s", name);
+    } else {
+        task_count++;
+    }
+    return handle;
+}
+
+void hal_task_notify(hal_task_t task) {
+    xTaskNotifyGive((TaskHandle_t)task);
+}
+
+bool hal_task_wait(uint32_t timeout_ms) {
+    return ulTaskNotifyTake(pdTRUE, timeout_ms / portTICK_PERIOD_MS) != 0;
+}
+
+int64_t hal_time_us(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+int64_t hal_uptime_us(void) {
+    return esp_timer_get_time();
+}
@@ -0,0 +1,214 @@
+/* WAV file recovery
+
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include "esp_log.h"
+#include "wav_repair.h"
+
+static const char *TAG = "wav_repair";
+
+// How much of the start of a file to search for the data chunk
+#define WAV_REPAIR_HDR_MAX  (1024)
+
+static uint32_t get_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t *p) {
+    return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void put_le64(uint8_t *p, uint64_t v) {
+    put_le32(p, v);
+    put_le32(p + 4, v >> 32);
+}
+
+bool wav_repair_file(const char *path, size_t frame_bytes, bool trust_header) {
+    uint8_t hdr[WAV_REPAIR_HDR_MAX];
+    size_t n;
+    size_t off = 12;
+    off_t end;
+    uint64_t size, hdr_bytes, data_bytes, avail, riff_size;
+    uint32_t data_off = 0;
+    uint32_t ds64_off = 0;  // ds64 chunk, or JUNK big enough to become one
+    uint32_t fact_off = 0;  // fact chunk, which compressed audio has
+    uint32_t block_frames = 1;  // frames in each frame_bytes of audio
+    bool rf64;
+    bool ok;
+
+    FILE *f = fopen(path, "r+");
+    if (f == NULL) {
+        ESP_LOGE(TAG, "Failed to open %s", path);
+        return false;
+    }
+    n = fread(hdr, 1, sizeof hdr, f);
+    if (n < 12 || (memcmp(hdr, "RIFF", 4) != 0 && memcmp(hdr, "RF64", 4) != 0)
+        || memcmp(hdr + 8, "WAVE", 4) != 0) {
+        ESP_LOGW(TAG, "%s is not a WAV file, skipping", path);
+        fclose(f);
+        return false;
+    }
+    rf64 = memcmp(hdr, "RF64", 4) == 0;
+    if (fseeko(f, 0, SEEK_END) != 0 || (end = ftello(f)) < 0) {
+        ESP_LOGE(TAG, "Failed to find the size of %s", path);
+        fclose(f);
+        return false;
+    }
+    size = end;
+
+    // Walk the chunks to find where the audio starts
+    while (off + 8 <= n) {
+        uint32_t len = get_le32(hdr + off + 4);
+        if (off == 12 && off + 8 + 28 <= n && len >= 28
+            && (memcmp(hdr + off, "ds64", 4) == 0 || memcmp(hdr + off, "JUNK", 4) == 0)) {
+            ds64_off = off + 8;
+        }
+        // IMA-ADPCM keeps its samples per block after the PCM fields
+        if (memcmp(hdr + off, "fmt ", 4) == 0 && off + 8 + 20 <= n && len >= 20
+            && (hdr[off + 8] | (hdr[off + 9] << 8)) == 0x11) {
+            block_frames = hdr[off + 26] | (hdr[off + 27] << 8);
+        }
+        if (memcmp(hdr + off, "fact", 4) == 0 && off + 12 <= n && len >= 4) {
+            fact_off = off + 8;
+        }
+        if (memcmp(hdr + off, "data", 4) == 0) {
+            data_off = off + 8;
+            break;
+        }
+        off += 8 + len + (len & 1);
+    }
+    if (data_off == 0 || data_off > size || (rf64 && ds64_off == 0)) {
+        ESP_LOGW(TAG, "%s has no data chunk, skipping", path);
+        fclose(f);
+        return false;
+    }
+
+    // A finalized file's sizes add up exactly, with the data chunk possibly
+    // followed by others, e.g. cue points. RF64 keeps the real sizes in ds64.
+    if (rf64) {
+        riff_size = get_le64(hdr + ds64_off);
+        hdr_bytes = get_le64(hdr + ds64_off + 8);
+    } else {
+        riff_size = get_le32(hdr + 4);
+        hdr_bytes = get_le32(hdr + data_off - 4);
+    }
+    if (data_off + hdr_bytes <= size && riff_size == size - 8) {
+        fclose(f);
+        return false;
+    }
+
+    avail = size - data_off;
+    data_bytes = (trust_header && hdr_bytes < avail) ? hdr_bytes : avail;
+    if (data_off + data_bytes - 8 > UINT32_MAX && ds64_off == 0) {
+        // No room to make it RF64, so keep what RIFF can describe
+        data_bytes = UINT32_MAX - (data_off - 8);
+    }
+    data_bytes -= data_bytes % frame_bytes;
+    riff_size = data_off + data_bytes - 8;
+    ESP_LOGW(TAG, "Repairing %s: size %llu, data %llu -> %llu", path,
+        (unsigned long long)size, (unsigned long long)hdr_bytes, (unsigned long long)data_bytes);
+
+    // Rewrite the start of the header, up to the data chunk size, in one go
+    if (riff_size > UINT32_MAX) {
+        memcpy(hdr, "RF64", 4);
+        put_le32(hdr + 4, UINT32_MAX);
+        memcpy(hdr + ds64_off - 8, "ds64", 4);
+        put_le64(hdr + ds64_off, riff_size);
+        put_le64(hdr + ds64_off + 8, data_bytes);
+        put_le64(hdr + ds64_off + 16, data_bytes / frame_bytes * block_frames);
+        put_le32(hdr + data_off - 4, UINT32_MAX);
+    } else {
+        memcpy(hdr, "RIFF", 4);
+        put_le32(hdr + 4, riff_size);
+        if (ds64_off != 0) {
+            memcpy(hdr + ds64_off - 8, "JUNK", 4);
+        }
+        put_le32(hdr + data_off - 4, data_bytes);
+    }
+    if (fact_off != 0) {
+        uint64_t frames = data_bytes / frame_bytes * block_frames;
+        put_le32(hdr + fact_off, frames < UINT32_MAX ? frames : UINT32_MAX);
+    }
+    ok = fseeko(f, 0, SEEK_SET) == 0 && fwrite(hdr, 1, data_off, f) == data_off;
+    ok = (fclose(f) == 0) && ok;
+    ok = ok && truncate(path, data_off + data_bytes) == 0;
+    if (!ok) {
+        ESP_LOGE(TAG, "Failed to repair %s", path);
+    }
+    return ok;
+}
+
+int wav_repair_dir(const char *dir, size_t frame_bytes, bool trust_header) {
+    char path[300];
+    struct dirent *de;
+    int repaired = 0;
+
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        ESP_LOGE(TAG, "Failed to open directory %s", dir);
+        return 0;
+    }
+    while ((de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name);
+        if (len < 4 || strcasecmp(de->d_name + len - 4, ".wav") != 0) {
+            continue;
+        }
+        snprintf(path, sizeof path, "%s/%s", dir, de->d_name);
+        if (wav_repair_file(path, frame_bytes, trust_header)) {
+            repaired++;
+        }
+    }
+    closedir(d);
+    return repaired;
+}
+
+bool wav_repair_mark(const char *marker, const char *path) {
+    size_t len = strlen(path);
+    int fd = open(marker, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    bool ok;
+
+    if (fd < 0) {
+        ESP_LOGE(TAG, "Failed to create %s", marker);
+        return false;
+    }
+    ok = write(fd, path, len) == (ssize_t)len;
+    ok = close(fd) == 0 && ok;
+    if (!ok) {
+        ESP_LOGE(TAG, "Failed to write %s", marker);
+    }
+    return ok;
+}
+
+int wav_repair_marked(const char *marker, const char *dir, size_t frame_bytes,
+    bool trust_header) {
+    char path[300];
+    ssize_t len;
+    int fd = open(marker, O_RDONLY);
+
+    if (fd < 0) {
+        ESP_LOGW(TAG, "No %s, checking every file in %s", marker, dir);
+        return wav_repair_dir(dir, frame_bytes, trust_header);
+    }
+    len = read(fd, path, sizeof path - 1);
+    close(fd);
+    path[len > 0 ? len : 0] = '\0';
+    // A marker cut short by a reset while it was written was cut before
+    // the file it names was created, so there is nothing to repair
+    if (len < 4 || strcasecmp(path + len - 4, ".wav") != 0 || access(path, F_OK) != 0) {
+        return 0;
+    }
+    return wav_repair_file(path, frame_bytes, trust_header) ? 1 : 0;
+}
@@ -0,0 +1,35 @@
+/* WAV file recovery
+
+   Find WAV files that were never finalized, e.g. because of a power cut
+   or reset while recording, and fix up their headers so they play.
+*/
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Check one WAV or RF64 file, and repair its RIFF (or ds64) and data chunk
+// sizes if they don't match the file. If trust_header is set, the data
+// chunk size in the header is taken as the amount of good audio (the file
+// may have been preallocated beyond it); otherwise everything after the
+// data chunk header is. Either way the audio is cut to whole frames of
+// frame_bytes (whole blocks, for IMA-ADPCM, whose fact chunk is set to
+// match), and the file is truncated to match, becoming RF64 if it is past
+// 4 GB and has a JUNK chunk to hold the sizes. Returns true if it was
+// repaired.
+bool wav_repair_file(const char *path, size_t frame_bytes, bool trust_header);
+
+// Run wav_repair_file() over every .wav file in dir. Returns the number
+// of files repaired.
+int wav_repair_dir(const char *dir, size_t frame_bytes, bool trust_header);
+
+// Note in the file marker that path is the one being recorded, so that
+// after a reset only it needs repairing. Call it before creating path,
+// once the file before it is finished. Returns false if it couldn't.
+bool wav_repair_mark(const char *marker, const char *path);
+
+// Run wav_repair_file() over the file marker names, if it is a .wav file.
+// If there is no marker, e.g. on a card last recorded without one, fall
+// back to wav_repair_dir(). Returns the number of files repaired.
+int wav_repair_marked(const char *marker, const char *dir, size_t frame_bytes,
+    bool trust_header);